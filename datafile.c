@@ -15,10 +15,14 @@
  * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
  */
 
+#include <ctype.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 
 #define ISC_BUFFER_USEINLINE
@@ -27,12 +31,50 @@
 #include <isc/mem.h>
 
 #include "datafile.h"
+#include "dns.h"
 #include "log.h"
 #include "os.h"
+#include "scan.h"
 #include "util.h"
+#include "zfile.h"
 
 #define BUFFER_SIZE (64 * 1024)
 
+/*
+ * Text files up to this size are mapped and indexed, at 8 bytes a
+ * record; larger ones are read through the buffer, under the lock.
+ */
+#define MAX_MAPPED_TEXT (64 * 1024 * 1024)
+
+/*
+ * A compiled corpus is a header, the messages, each preceded by its
+ * length, and an index of their offsets.  Every number is in network
+ * byte order.
+ *
+ *	magic		8 bytes
+ *	version		4 bytes
+ *	flags		4 bytes
+ *	count		8 bytes, the number of messages
+ *	index offset	8 bytes
+ */
+#define CORPUS_MAGIC		"DNSPERFC"
+#define CORPUS_MAGICLEN		8
+#define CORPUS_VERSION		1
+#define CORPUS_HEADERLEN	32
+#define CORPUS_UPDATES		0x1
+
+typedef struct {
+	isc_uint32_t offset;
+	isc_uint32_t length;
+} textline_t;
+
+/* The records of a shard, and how many of them have been handed out. */
+typedef struct {
+	isc_uint64_t start;
+	isc_uint64_t count;
+	isc_uint64_t cursor;
+} shard_t;
+
 struct perf_datafile {
 	isc_mem_t *mctx;
 	pthread_mutex_t lock;
@@ -46,8 +88,59 @@ struct perf_datafile {
 	unsigned int maxruns;
 	unsigned int nruns;
 	isc_boolean_t read_any;
+	/* A compiled corpus, mapped in place of the buffered text. */
+	const unsigned char *corpus;
+	size_t corpus_size;
+	isc_boolean_t corpus_updates;
+	const unsigned char *index;
+	size_t index_offset;
+	isc_uint64_t nmsgs;
+	/*
+	 * A text file, unless large, is also mapped, and split into the
+	 * lines holding records, for them to be claimed without the lock.  The cursor
+	 * counts the lines, or the messages of a corpus, handed out over
+	 * every run; 'span' is one run's worth.
+	 */
+	const char *text;
+	textline_t *lines;
+	isc_uint64_t nlines;
+	isc_uint64_t lines_alloc;
+	isc_uint64_t span;
+	isc_uint64_t cursor;
+	/*
+	 * Sharded, shard i holds entries 'start' to 'start' + 'count' - 1
+	 * of 'order', which lists the records by shard, or of the file if
+	 * there is no 'order'.  'hashes' holds each record's name hash.
+	 */
+	shard_t *shards;
+	unsigned int nshards;
+	isc_uint64_t *order;
+	isc_uint32_t *hashes;
+	isc_uint64_t nrecords;
+	/* A compressed file, read through its decompressor. */
+	perf_zfile_t *zfile;
 };
 
+static inline isc_uint64_t
+get_uint64(const unsigned char *p)
+{
+	return (((isc_uint64_t)p[0] << 56) | ((isc_uint64_t)p[1] << 48) |
+		((isc_uint64_t)p[2] << 40) | ((isc_uint64_t)p[3] << 32) |
+		((isc_uint64_t)p[4] << 24) | ((isc_uint64_t)p[5] << 16) |
+		((isc_uint64_t)p[6] << 8) | (isc_uint64_t)p[7]);
+}
+
+static inline void
+put_uint64(unsigned char *p, isc_uint64_t val)
+{
+	int i;
+
+	for (i = 7; i >= 0; i--) {
+		p[i] = val & 0xff;
+		val >>= 8;
+	}
+}
+
 static inline void
 nul_terminate(perf_datafile_t *dfile)
 {
@@ -57,6 +150,102 @@ nul_terminate(perf_datafile_t *dfile)
 	*data = '\0';
 }
 
+/*
+ * Maps the file if it is a compiled corpus.
+ */
+static void
+map_corpus(perf_datafile_t *dfile, const char *filename)
+{
+	unsigned char header[CORPUS_HEADERLEN];
+	const unsigned char *corpus;
+	isc_uint64_t nmsgs, index_offset;
+
+	if (dfile->size < CORPUS_HEADERLEN ||
+	    pread(dfile->fd, header, sizeof(header), 0) != sizeof(header) ||
+	    memcmp(header, CORPUS_MAGIC, CORPUS_MAGICLEN) != 0)
+		return;
+
+	if (get_uint64(header + 8) >> 32 != CORPUS_VERSION)
+		perf_log_fatal("%s: unsupported compiled input version",
+			       filename);
+	nmsgs = get_uint64(header + 16);
+	index_offset = get_uint64(header + 24);
+	if (index_offset < CORPUS_HEADERLEN || index_offset > dfile->size ||
+	    nmsgs > (dfile->size - index_offset) / 8)
+		perf_log_fatal("%s: corrupt compiled input", filename);
+
+	corpus = mmap(NULL, dfile->size, PROT_READ, MAP_SHARED, dfile->fd, 0);
+	if (corpus == MAP_FAILED)
+		perf_log_fatal("unable to map file: %s", filename);
+
+	dfile->corpus = corpus;
+	dfile->corpus_size = dfile->size;
+	dfile->corpus_updates = ISC_TF(get_uint64(header + 8) &
+				       CORPUS_UPDATES);
+	dfile->index = corpus + index_offset;
+	dfile->index_offset = index_offset;
+	dfile->nmsgs = nmsgs;
+	dfile->span = nmsgs;
+}
+
+/*
+ * Finds the lines of the mapped text which hold records, skipping empty
+ * lines and comments as read_one_line() does.
+ */
+static void
+split_text(perf_datafile_t *dfile)
+{
+	textline_t *lines, *newlines;
+	isc_uint64_t nlines, nalloc, pos;
+	size_t length;
+
+	nalloc = 1024;
+	lines = isc_mem_get(dfile->mctx, nalloc * sizeof(*lines));
+	if (lines == NULL)
+		perf_log_fatal("out of memory");
+	nlines = 0;
+
+	for (pos = 0; pos < dfile->size; pos += length + 1) {
+		length = perf_scan_newline(dfile->text + pos,
+					   dfile->size - pos);
+		if (length == 0 || dfile->text[pos] == ';')
+			continue;
+		if (nlines == nalloc) {
+			newlines = isc_mem_get(dfile->mctx,
+					       2 * nalloc * sizeof(*lines));
+			if (newlines == NULL)
+				perf_log_fatal("out of memory");
+			memcpy(newlines, lines, nalloc * sizeof(*lines));
+			isc_mem_put(dfile->mctx, lines,
+				    nalloc * sizeof(*lines));
+			lines = newlines;
+			nalloc *= 2;
+		}
+		lines[nlines].offset = pos;
+		lines[nlines].length = length;
+		nlines++;
+	}
+
+	dfile->lines = lines;
+	dfile->nlines = nlines;
+	dfile->lines_alloc = nalloc;
+	dfile->span = nlines;
+}
+
+static void
+map_text(perf_datafile_t *dfile, const char *filename)
+{
+	const char *text;
+
+	if (dfile->size == 0 || dfile->size > MAX_MAPPED_TEXT)
+		return;
+	text = mmap(NULL, dfile->size, PROT_READ, MAP_SHARED, dfile->fd, 0);
+	if (text == MAP_FAILED)
+		perf_log_fatal("unable to map file: %s", filename);
+	dfile->text = text;
+	split_text(dfile);
+}
+
 perf_datafile_t *
 perf_datafile_open(isc_mem_t *mctx, const char *filename)
 {
@@ -76,6 +265,24 @@ perf_datafile_open(isc_mem_t *mctx, const char *filename)
 	dfile->maxruns = 1;
 	dfile->nruns = 0;
 	dfile->read_any = ISC_FALSE;
+	dfile->corpus = NULL;
+	dfile->corpus_size = 0;
+	dfile->corpus_updates = ISC_FALSE;
+	dfile->index = NULL;
+	dfile->index_offset = 0;
+	dfile->nmsgs = 0;
+	dfile->text = NULL;
+	dfile->lines = NULL;
+	dfile->nlines = 0;
+	dfile->lines_alloc = 0;
+	dfile->span = 0;
+	dfile->cursor = 0;
+	dfile->shards = NULL;
+	dfile->nshards = 0;
+	dfile->order = NULL;
+	dfile->hashes = NULL;
+	dfile->nrecords = 0;
+	dfile->zfile = NULL;
 	isc_buffer_init(&dfile->data, dfile->databuf, BUFFER_SIZE);
 	if (filename == NULL) {
 		dfile->fd = STDIN_FILENO;
@@ -86,6 +293,12 @@ perf_datafile_open(isc_mem_t *mctx, const char *filename)
 		if (fstat(dfile->fd, &buf) == 0 && S_ISREG(buf.st_mode)) {
 			dfile->is_file = ISC_TRUE;
 			dfile->size = buf.st_size;
+			dfile->zfile = perf_zfile_open(mctx, dfile->fd,
+						       filename);
+			if (dfile->zfile == NULL)
+				map_corpus(dfile, filename);
+			if (dfile->zfile == NULL && dfile->corpus == NULL)
+				map_text(dfile, filename);
 		}
 	}
 	nul_terminate(dfile);
@@ -103,6 +316,24 @@ perf_datafile_close(perf_datafile_t **dfilep)
 	dfile = *dfilep;
 	*dfilep = NULL;
 
+	if (dfile->corpus != NULL)
+		munmap((void *)dfile->corpus, dfile->corpus_size);
+	if (dfile->text != NULL) {
+		munmap((void *)dfile->text, dfile->size);
+		isc_mem_put(dfile->mctx, dfile->lines,
+			    dfile->lines_alloc * sizeof(*dfile->lines));
+	}
+	if (dfile->zfile != NULL)
+		perf_zfile_close(&dfile->zfile);
+	if (dfile->shards != NULL)
+		isc_mem_put(dfile->mctx, dfile->shards,
+			    dfile->nshards * sizeof(*dfile->shards));
+	if (dfile->order != NULL)
+		isc_mem_put(dfile->mctx, dfile->order,
+			    dfile->nrecords * sizeof(*dfile->order));
+	if (dfile->hashes != NULL)
+		isc_mem_put(dfile->mctx, dfile->hashes,
+			    dfile->nrecords * sizeof(*dfile->hashes));
 	if (dfile->fd >= 0 && dfile->fd != STDIN_FILENO)
 		close(dfile->fd);
 	MUTEX_DESTROY(&dfile->lock);
@@ -119,6 +350,8 @@ void
 perf_datafile_setmaxruns(perf_datafile_t *dfile, unsigned int maxruns)
 {
 	dfile->maxruns = maxruns;
+	if (dfile->zfile != NULL)
+		perf_zfile_setrepeat(dfile->zfile, ISC_TF(maxruns != 1));
 }
 
 static void
@@ -126,6 +359,10 @@ reopen_file(perf_datafile_t *dfile)
 {
 	if (dfile->cached) {
 		isc_buffer_first(&dfile->data);
+	} else if (dfile->zfile != NULL) {
+		perf_zfile_rewind(dfile->zfile);
+		isc_buffer_clear(&dfile->data);
+		nul_terminate(dfile);
 	} else {
 		if (lseek(dfile->fd, 0L, SEEK_SET) < 0)
 			perf_log_fatal("cannot reread input");
@@ -153,14 +390,18 @@ read_more(perf_datafile_t *dfile)
 	data = isc_buffer_used(&dfile->data);
 	size = isc_buffer_availablelength(&dfile->data);
 
-	n = read(dfile->fd, data, size);
+	if (dfile->zfile != NULL)
+		n = perf_zfile_read(dfile->zfile, data, size);
+	else
+		n = read(dfile->fd, data, size);
 	if (n < 0)
 		return (ISC_R_FAILURE);
 
 	isc_buffer_add(&dfile->data, n);
 	nul_terminate(dfile);
 
-	if (dfile->is_file &&
+	/* The size of a compressed file says nothing of its contents. */
+	if (dfile->is_file && dfile->zfile == NULL &&
 	    isc_buffer_usedlength(&dfile->data) == dfile->size)
 		dfile->cached = ISC_TRUE;
 
@@ -177,13 +418,13 @@ read_one_line(perf_datafile_t *dfile, isc_buffer_t *lines)
 	while (ISC_TRUE) {
 		/* Get the current line */
 		cur = isc_buffer_current(&dfile->data);
-		curlen = strcspn(cur, "\n");
+		nrem = isc_buffer_remaininglength(&dfile->data);
+		curlen = perf_scan_newline(cur, nrem);
 
 		/*
 		 * If the current line contains the rest of the buffer,
 		 * we need to read more (unless the full file is cached).
 		 */
-		nrem = isc_buffer_remaininglength(&dfile->data);
 		if (curlen == nrem) {
 			if (! dfile->cached) {
 				result = read_more(dfile);
@@ -222,8 +463,16 @@ perf_datafile_next(perf_datafile_t *dfile, isc_buffer_t *lines,
 		   isc_boolean_t is_update)
 {
 	const char *current;
+	isc_region_t record;
+	unsigned int count;
 	isc_result_t result;
 
+	if (dfile->text != NULL && !is_update) {
+		count = 1;
+		return (perf_datafile_nextbatch(dfile, lines, &record, &count,
+						ISC_FALSE));
+	}
+
 	LOCK(&dfile->lock);
 
 	if (dfile->maxruns > 0 && dfile->maxruns == dfile->nruns) {
@@ -271,5 +520,459 @@ perf_datafile_next(perf_datafile_t *dfile, isc_buffer_t *lines,
 unsigned int
 perf_datafile_nruns(const perf_datafile_t *dfile)
 {
+	const shard_t *shard;
+	isc_uint64_t nruns, least;
+	unsigned int i;
+
+	/* Sharded, the file has been run through as often as every shard. */
+	if (dfile->shards != NULL) {
+		least = ISC_UINT64_MAX;
+		for (i = 0; i < dfile->nshards; i++) {
+			shard = &dfile->shards[i];
+			if (shard->count == 0)
+				continue;
+			nruns = __atomic_load_n(&shard->cursor,
+						__ATOMIC_RELAXED) /
+				shard->count;
+			if (nruns < least)
+				least = nruns;
+		}
+		return (least != ISC_UINT64_MAX ? least : 0);
+	}
+
+	/* Runs are counted by the cursor or the lock, whichever was used. */
+	if (dfile->span > 0)
+		return (dfile->nruns +
+			__atomic_load_n(&dfile->cursor, __ATOMIC_RELAXED) /
+			dfile->span);
 	return dfile->nruns;
 }
+
+isc_boolean_t
+perf_datafile_iscompiled(const perf_datafile_t *dfile,
+			 isc_boolean_t *is_updatep)
+{
+	if (is_updatep != NULL)
+		*is_updatep = dfile->corpus_updates;
+	return (ISC_TF(dfile->corpus != NULL));
+}
+
+/*
+ * Returns the message at this position of the corpus.
+ */
+static void
+get_message(perf_datafile_t *dfile, isc_uint64_t n, isc_region_t *msg)
+{
+	isc_uint64_t offset;
+	unsigned int length;
+	const unsigned char *p;
+
+	offset = get_uint64(dfile->index + 8 * (n % dfile->nmsgs));
+	if (offset < CORPUS_HEADERLEN || offset > dfile->index_offset - 2)
+		perf_log_fatal("corrupt compiled input");
+	p = dfile->corpus + offset;
+	length = (p[0] << 8) | p[1];
+	if (length > dfile->index_offset - offset - 2)
+		perf_log_fatal("corrupt compiled input");
+
+	msg->base = (unsigned char *)p + 2;
+	msg->length = length;
+}
+
+static isc_result_t
+next_messages(perf_datafile_t *dfile, isc_region_t *msgs,
+	      unsigned int *countp)
+{
+	isc_uint64_t cursor, limit, n;
+	unsigned int i;
+
+	if (dfile->nmsgs == 0)
+		return (ISC_R_INVALIDFILE);
+
+	if (dfile->maxruns > 0)
+		limit = (isc_uint64_t)dfile->maxruns * dfile->nmsgs;
+	else
+		limit = ISC_UINT64_MAX;
+	cursor = __atomic_load_n(&dfile->cursor, __ATOMIC_RELAXED);
+	do {
+		if (cursor >= limit)
+			return (ISC_R_EOF);
+		n = *countp;
+		if (n > limit - cursor)
+			n = limit - cursor;
+	} while (!__atomic_compare_exchange_n(&dfile->cursor, &cursor,
+					      cursor + n, ISC_FALSE,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	for (i = 0; i < n; i++)
+		get_message(dfile, cursor + i, &msgs[i]);
+	*countp = n;
+
+	return (ISC_R_SUCCESS);
+}
+
+/*
+ * Copies a line of the mapped text into 'lines', cut short if it does
+ * not fit, and terminates it.
+ */
+static void
+copy_line(perf_datafile_t *dfile, isc_uint64_t n, isc_buffer_t *lines,
+	  isc_region_t *record)
+{
+	const textline_t *line;
+	unsigned int length, space;
+
+	line = &dfile->lines[n];
+	space = isc_buffer_availablelength(lines);
+	length = line->length < space ? line->length : space - 1;
+	record->base = isc_buffer_used(lines);
+	record->length = length;
+	isc_buffer_putmem(lines, (const unsigned char *)dfile->text +
+				 line->offset, length);
+	isc_buffer_putuint8(lines, 0);
+}
+
+/*
+ * Claims the next lines of a mapped text file, as many as are wanted and
+ * fit in 'lines', and copies them there.
+ */
+static isc_result_t
+next_lines(perf_datafile_t *dfile, isc_buffer_t *lines,
+	   isc_region_t *records, unsigned int *countp)
+{
+	isc_uint64_t cursor, limit, i;
+	unsigned int n, length, space, used;
+
+	if (dfile->nlines == 0)
+		return (ISC_R_INVALIDFILE);
+	space = isc_buffer_availablelength(lines);
+	if (space == 0)
+		return (ISC_R_NOSPACE);
+
+	if (dfile->maxruns > 0)
+		limit = (isc_uint64_t)dfile->maxruns * dfile->nlines;
+	else
+		limit = ISC_UINT64_MAX;
+	cursor = __atomic_load_n(&dfile->cursor, __ATOMIC_RELAXED);
+	do {
+		if (cursor >= limit)
+			return (ISC_R_EOF);
+		used = 0;
+		i = cursor % dfile->nlines;
+		for (n = 0; n < *countp && n < limit - cursor; n++) {
+			length = dfile->lines[i].length;
+			/* A line too long for the buffer alone is cut short. */
+			if (length + 1 > space - used) {
+				if (n > 0)
+					break;
+				length = space - 1;
+			}
+			used += length + 1;
+			if (++i == dfile->nlines)
+				i = 0;
+		}
+	} while (!__atomic_compare_exchange_n(&dfile->cursor, &cursor,
+					      cursor + n, ISC_FALSE,
+					      __ATOMIC_RELAXED,
+					      __ATOMIC_RELAXED));
+
+	i = cursor % dfile->nlines;
+	for (*countp = 0; *countp < n; (*countp)++) {
+		copy_line(dfile, i, lines, &records[*countp]);
+		if (++i == dfile->nlines)
+			i = 0;
+	}
+
+	return (ISC_R_SUCCESS);
+}
+
+isc_result_t
+perf_datafile_nextbatch(perf_datafile_t *dfile, isc_buffer_t *lines,
+			isc_region_t *records, unsigned int *countp,
+			isc_boolean_t is_update)
+{
+	unsigned int start;
+	isc_result_t result;
+
+	if (dfile->corpus != NULL)
+		return (next_messages(dfile, records, countp));
+	if (dfile->text != NULL && !is_update)
+		return (next_lines(dfile, lines, records, countp));
+
+	/* Updates span several lines, and are read one at a time. */
+	start = isc_buffer_usedlength(lines);
+	result = perf_datafile_next(dfile, lines, is_update);
+	if (result != ISC_R_SUCCESS)
+		return (result);
+	records[0].base = (unsigned char *)isc_buffer_base(lines) + start;
+	records[0].length = isc_buffer_usedlength(lines) - start;
+	*countp = 1;
+
+	return (ISC_R_SUCCESS);
+}
+
+isc_result_t
+perf_datafile_nextmsg(perf_datafile_t *dfile, isc_region_t *msg)
+{
+	unsigned int count;
+
+	count = 1;
+	return (next_messages(dfile, msg, &count));
+}
+
+/*
+ * Hashes the query name of a record, ignoring case, and a final dot in
+ * text: the first field of a line, or the name of a message's question.
+ */
+static isc_uint32_t
+hash_name(perf_datafile_t *dfile, isc_uint64_t n)
+{
+	const unsigned char *p, *end;
+	isc_region_t msg;
+	isc_uint32_t hash;
+	size_t length;
+
+	hash = 2166136261U;
+	if (dfile->corpus != NULL) {
+		get_message(dfile, n, &msg);
+		if (msg.length < 12)
+			return (hash);
+		p = msg.base + 12;
+		end = msg.base + msg.length;
+		/* The label lengths stand in for the dots. */
+		while (p < end && *p != 0 && *p < 64) {
+			length = *p + 1;
+			if (length > (size_t)(end - p))
+				length = end - p;
+			for (; length > 0; length--, p++)
+				hash = (hash ^ tolower(*p)) * 16777619U;
+		}
+	} else {
+		p = (const unsigned char *)dfile->text + dfile->lines[n].offset;
+		length = perf_scan_space((const char *)p,
+					 dfile->lines[n].length);
+		if (length > 1 && p[length - 1] == '.')
+			length--;
+		for (end = p + length; p < end; p++)
+			hash = (hash ^ tolower(*p)) * 16777619U;
+	}
+
+	return (hash);
+}
+
+void
+perf_datafile_shard(perf_datafile_t *dfile, perf_shard_t how,
+		    unsigned int nshards, isc_boolean_t is_update)
+{
+	shard_t *shards;
+	isc_uint64_t n, *next;
+	unsigned int i;
+
+	if (dfile->corpus == NULL && !dfile->is_file)
+		perf_log_fatal("only input from a file can be sharded");
+	if (dfile->zfile != NULL)
+		perf_log_fatal("compressed input cannot be sharded");
+	if (dfile->corpus == NULL && is_update)
+		perf_log_fatal("updates can only be sharded once compiled");
+	if (dfile->corpus == NULL && dfile->size > MAX_MAPPED_TEXT)
+		perf_log_fatal("text input over %u MB can only be sharded "
+			       "once compiled", MAX_MAPPED_TEXT >> 20);
+
+	dfile->nrecords = dfile->corpus != NULL ? dfile->nmsgs : dfile->nlines;
+	shards = isc_mem_get(dfile->mctx, nshards * sizeof(*shards));
+	if (shards == NULL)
+		perf_log_fatal("out of memory");
+	memset(shards, 0, nshards * sizeof(*shards));
+	dfile->shards = shards;
+	dfile->nshards = nshards;
+
+	if (how == perf_shard_contiguous) {
+		for (i = 0; i < nshards; i++) {
+			shards[i].start = dfile->nrecords * i / nshards;
+			shards[i].count = dfile->nrecords * (i + 1) / nshards -
+					  shards[i].start;
+		}
+		return;
+	}
+
+	if (dfile->nrecords == 0)
+		return;
+	dfile->hashes = isc_mem_get(dfile->mctx,
+				    dfile->nrecords * sizeof(*dfile->hashes));
+	dfile->order = isc_mem_get(dfile->mctx,
+				   dfile->nrecords * sizeof(*dfile->order));
+	if (dfile->hashes == NULL || dfile->order == NULL)
+		perf_log_fatal("out of memory");
+	for (n = 0; n < dfile->nrecords; n++) {
+		dfile->hashes[n] = hash_name(dfile, n);
+		shards[dfile->hashes[n] % nshards].count++;
+	}
+	for (i = 1; i < nshards; i++)
+		shards[i].start = shards[i - 1].start + shards[i - 1].count;
+
+	/* Each record goes after those of its shard before it. */
+	next = isc_mem_get(dfile->mctx, nshards * sizeof(*next));
+	if (next == NULL)
+		perf_log_fatal("out of memory");
+	for (i = 0; i < nshards; i++)
+		next[i] = shards[i].start;
+	for (n = 0; n < dfile->nrecords; n++)
+		dfile->order[next[dfile->hashes[n] % nshards]++] = n;
+	isc_mem_put(dfile->mctx, next, nshards * sizeof(*next));
+}
+
+isc_result_t
+perf_datafile_nextshard(perf_datafile_t *dfile, unsigned int shard,
+			isc_buffer_t *lines, isc_region_t *records,
+			isc_uint32_t *hashes, unsigned int *countp)
+{
+	shard_t *sh;
+	isc_uint64_t cursor, limit, n;
+	unsigned int count, space, used;
+
+	if (dfile->nrecords == 0)
+		return (ISC_R_INVALIDFILE);
+	sh = &dfile->shards[shard];
+	if (sh->count == 0)
+		return (ISC_R_EOF);
+	if (dfile->maxruns > 0)
+		limit = (isc_uint64_t)dfile->maxruns * sh->count;
+	else
+		limit = ISC_UINT64_MAX;
+
+	/* Only this shard's thread moves its cursor. */
+	cursor = sh->cursor;
+	if (cursor >= limit)
+		return (ISC_R_EOF);
+	space = isc_buffer_availablelength(lines);
+	if (dfile->corpus == NULL && space == 0)
+		return (ISC_R_NOSPACE);
+	used = 0;
+	for (count = 0; count < *countp && cursor < limit; count++) {
+		n = sh->start + cursor % sh->count;
+		if (dfile->order != NULL)
+			n = dfile->order[n];
+		if (dfile->corpus != NULL) {
+			get_message(dfile, n, &records[count]);
+		} else {
+			/* A line too long for the buffer alone is cut short. */
+			if (dfile->lines[n].length + 1 > space - used &&
+			    count > 0)
+				break;
+			copy_line(dfile, n, lines, &records[count]);
+			used += records[count].length + 1;
+		}
+		if (hashes != NULL)
+			hashes[count] = dfile->hashes != NULL ?
+					dfile->hashes[n] : 0;
+		cursor++;
+	}
+	__atomic_store_n(&sh->cursor, cursor, __ATOMIC_RELAXED);
+	*countp = count;
+
+	return (ISC_R_SUCCESS);
+}
+
+static void
+write_corpus(FILE *fp, const char *filename, const void *data, size_t len)
+{
+	if (fwrite(data, 1, len, fp) != len)
+		perf_log_fatal("writing %s: %s", filename, strerror(errno));
+}
+
+void
+perf_datafile_compile(perf_datafile_t *dfile, perf_dnsctx_t *ctx,
+		      const char *filename, isc_uint64_t *nmsgsp,
+		      isc_uint64_t *nskippedp)
+{
+	FILE *fp;
+	char input_data[BUFFER_SIZE];
+	unsigned char packet[2 + MAX_EDNS_PACKET];
+	unsigned char header[CORPUS_HEADERLEN];
+	isc_buffer_t lines, msg;
+	isc_region_t used;
+	isc_uint64_t *offsets, *newoffsets;
+	isc_uint64_t nmsgs, nalloc, nskipped, offset, i;
+	isc_result_t result;
+
+	if (dfile->corpus != NULL)
+		perf_log_fatal("the input is already compiled");
+
+	fp = fopen(filename, "w");
+	if (fp == NULL)
+		perf_log_fatal("unable to open file: %s", filename);
+
+	/* The header is written again once the counts are known. */
+	memset(header, 0, sizeof(header));
+	write_corpus(fp, filename, header, sizeof(header));
+
+	nalloc = 1024;
+	offsets = isc_mem_get(dfile->mctx, nalloc * sizeof(*offsets));
+	if (offsets == NULL)
+		perf_log_fatal("out of memory");
+	nmsgs = 0;
+	nskipped = 0;
+	offset = CORPUS_HEADERLEN;
+	isc_buffer_init(&lines, input_data, sizeof(input_data));
+
+	while (ISC_TRUE) {
+		isc_buffer_clear(&lines);
+		result = perf_datafile_next(dfile, &lines, ISC_TF(ctx != NULL));
+		if (result == ISC_R_INVALIDFILE)
+			perf_log_fatal("input file contains no data");
+		if (result != ISC_R_SUCCESS)
+			break;
+
+		/*
+		 * The ID is patched, and any OPT and TSIG records added, as
+		 * each message is sent.
+		 */
+		isc_buffer_usedregion(&lines, &used);
+		isc_buffer_init(&msg, packet + 2, MAX_EDNS_PACKET);
+		result = perf_dns_buildrequest(ctx, (isc_textregion_t *)&used,
+					       0, ISC_FALSE, ISC_FALSE, NULL,
+					       &msg);
+		if (result != ISC_R_SUCCESS) {
+			nskipped++;
+			continue;
+		}
+		packet[0] = (msg.used >> 8) & 0xff;
+		packet[1] = msg.used & 0xff;
+		write_corpus(fp, filename, packet, msg.used + 2);
+
+		if (nmsgs == nalloc) {
+			newoffsets = isc_mem_get(dfile->mctx,
+						 2 * nalloc * sizeof(*offsets));
+			if (newoffsets == NULL)
+				perf_log_fatal("out of memory");
+			memcpy(newoffsets, offsets, nalloc * sizeof(*offsets));
+			isc_mem_put(dfile->mctx, offsets,
+				    nalloc * sizeof(*offsets));
+			offsets = newoffsets;
+			nalloc *= 2;
+		}
+		offsets[nmsgs++] = offset;
+		offset += msg.used + 2;
+	}
+
+	for (i = 0; i < nmsgs; i++) {
+		put_uint64(header, offsets[i]);
+		write_corpus(fp, filename, header, 8);
+	}
+	isc_mem_put(dfile->mctx, offsets, nalloc * sizeof(*offsets));
+
+	memcpy(header, CORPUS_MAGIC, CORPUS_MAGICLEN);
+	put_uint64(header + 8, ((isc_uint64_t)CORPUS_VERSION << 32) |
+			       (ctx != NULL ? CORPUS_UPDATES : 0));
+	put_uint64(header + 16, nmsgs);
+	put_uint64(header + 24, offset);
+	if (fseek(fp, 0L, SEEK_SET) != 0)
+		perf_log_fatal("writing %s: %s", filename, strerror(errno));
+	write_corpus(fp, filename, header, sizeof(header));
+	if (fclose(fp) != 0)
+		perf_log_fatal("writing %s: %s", filename, strerror(errno));
+
+	*nmsgsp = nmsgs;
+	*nskippedp = nskipped;
+}
@@ -20,8 +20,16 @@
 
 #include <isc/types.h>
 
+#include "dns.h"
+
 typedef struct perf_datafile perf_datafile_t;
 
+typedef enum {
+	perf_shard_none,
+	perf_shard_contiguous,
+	perf_shard_qname
+} perf_shard_t;
+
 perf_datafile_t *
 perf_datafile_open(isc_mem_t *mctx, const char *filename);
 
@@ -38,7 +46,69 @@ isc_result_t
 perf_datafile_next(perf_datafile_t *dfile, isc_buffer_t *lines,
 		   isc_boolean_t is_update);
 
+/*
+ * Returns up to *countp records at once, setting *countp to the number
+ * returned: lines of a text file, each copied into 'lines' and
+ * terminated, or the messages of a compiled corpus, as for
+ * perf_datafile_nextmsg().  Lines of a file, rather than a pipe, and
+ * messages are claimed without taking the lock.  Updates are returned
+ * one at a time.
+ */
+isc_result_t
+perf_datafile_nextbatch(perf_datafile_t *dfile, isc_buffer_t *lines,
+			isc_region_t *records, unsigned int *countp,
+			isc_boolean_t is_update);
+
 unsigned int
 perf_datafile_nruns(const perf_datafile_t *dfile);
 
+/*
+ * Splits the records of the file into 'nshards' shards, each to be read
+ * by one thread only: contiguous ranges of the file, or the records
+ * whose query name hashes to the shard.  Each shard is run through the
+ * number of times set by perf_datafile_setmaxruns(), so the file as a
+ * whole is sent that many times over.  The input must be a file of
+ * queries or a compiled corpus.
+ */
+void
+perf_datafile_shard(perf_datafile_t *dfile, perf_shard_t how,
+		    unsigned int nshards, isc_boolean_t is_update);
+
+/*
+ * As perf_datafile_nextbatch(), from one shard.  With hashing by name,
+ * the hash of each record's query name is stored in 'hashes', if not
+ * NULL; it is 0 otherwise.
+ */
+isc_result_t
+perf_datafile_nextshard(perf_datafile_t *dfile, unsigned int shard,
+			isc_buffer_t *lines, isc_region_t *records,
+			isc_uint32_t *hashes, unsigned int *countp);
+
+/*
+ * Whether the file is a corpus written by perf_datafile_compile(), and
+ * if so, whether it holds updates rather than queries.
+ */
+isc_boolean_t
+perf_datafile_iscompiled(const perf_datafile_t *dfile,
+			 isc_boolean_t *is_updatep);
+
+/*
+ * Returns the next message of a compiled corpus, which stays mapped
+ * until the file is closed.  Runs through the file are counted as for
+ * perf_datafile_next().
+ */
+isc_result_t
+perf_datafile_nextmsg(perf_datafile_t *dfile, isc_region_t *msg);
+
+/*
+ * Reads the input once through, building each record with 'ctx' (NULL
+ * for queries) into a message with ID 0 and neither OPT nor TSIG
+ * record, and writes the messages to 'filename' as a compiled corpus.
+ * Records which cannot be built are skipped and counted.
+ */
+void
+perf_datafile_compile(perf_datafile_t *dfile, perf_dnsctx_t *ctx,
+		      const char *filename, isc_uint64_t *nmsgsp,
+		      isc_uint64_t *nskippedp);
+
 #endif
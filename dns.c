@@ -51,6 +51,7 @@
 #include <isc/util.h>
 
 #include <dns/callbacks.h>
+#include <dns/compress.h>
 #include <dns/fixedname.h>
 #include <dns/message.h>
 #include <dns/name.h>
@@ -62,6 +63,7 @@
 #include "dns.h"
 #include "log.h"
 #include "opt.h"
+#include "scan.h"
 
 #define WHITESPACE			" \t\n"
 
@@ -480,10 +482,116 @@ add_tsig(isc_buffer_t *packet, perf_dnstsigkey_t *tsigkey)
 	return (ISC_R_SUCCESS);
 }
 
+/*
+ * The common query types, placed by a hash of their length and first and
+ * last characters which has no collisions among them.  Other types are
+ * left to dns_rdatatype_fromtext().
+ */
+#define QTYPE_HASHSIZE	64
+
+static const struct {
+	const char *name;
+	dns_rdatatype_t type;
+} qtype_table[QTYPE_HASHSIZE] = {
+	[1] = { "MX", dns_rdatatype_mx },
+	[3] = { "SPF", dns_rdatatype_spf },
+	[4] = { "ANY", dns_rdatatype_any },
+	[7] = { "NSEC3", dns_rdatatype_nsec3 },
+	[9] = { "NSEC", dns_rdatatype_nsec },
+	[12] = { "PTR", dns_rdatatype_ptr },
+	[14] = { "CNAME", dns_rdatatype_cname },
+	[15] = { "DNAME", dns_rdatatype_dname },
+	[16] = { "A", dns_rdatatype_a },
+	[18] = { "TXT", dns_rdatatype_txt },
+	[19] = { "SRV", dns_rdatatype_srv },
+	[29] = { "HINFO", dns_rdatatype_hinfo },
+	[31] = { "RRSIG", dns_rdatatype_rrsig },
+	[38] = { "NAPTR", dns_rdatatype_naptr },
+	[39] = { "NSEC3PARAM", dns_rdatatype_nsec3param },
+	[49] = { "DNSKEY", dns_rdatatype_dnskey },
+	[51] = { "DS", dns_rdatatype_ds },
+	[58] = { "AAAA", dns_rdatatype_aaaa },
+	[61] = { "NS", dns_rdatatype_ns },
+	[62] = { "SOA", dns_rdatatype_soa },
+};
+
+static inline isc_boolean_t
+qtype_lookup(const isc_textregion_t *r, dns_rdatatype_t *typep)
+{
+	unsigned int hash;
+	const char *name;
+
+	hash = (toupper(r->base[0] & 0xff) +
+		toupper(r->base[r->length - 1] & 0xff) + 14 * r->length) %
+	       QTYPE_HASHSIZE;
+	name = qtype_table[hash].name;
+	if (name == NULL || strlen(name) != r->length ||
+	    strncasecmp(name, r->base, r->length) != 0)
+		return (ISC_FALSE);
+	*typep = qtype_table[hash].type;
+	return (ISC_TRUE);
+}
+
+/*
+ * Writes a name of letters, digits, '-', '_', '*' and '/' in labels
+ * separated by dots straight into the message, as dns_name_fromtext()
+ * would with the root as origin.  Anything else, including escapes and
+ * names which would not fit, is left to it, with nothing written here.
+ */
+static inline isc_boolean_t
+name_fromsimple(const char *str, unsigned int len, isc_buffer_t *target)
+{
+	unsigned char *wire, *label;
+	unsigned int i, n, count;
+	int c;
+
+	if (len == 0 || len + 2 > isc_buffer_availablelength(target))
+		return (ISC_FALSE);
+
+	wire = isc_buffer_used(target);
+	if (len == 1 && str[0] == '.') {
+		wire[0] = 0;
+		isc_buffer_add(target, 1);
+		return (ISC_TRUE);
+	}
+
+	label = wire;
+	n = 1;
+	count = 0;
+	for (i = 0; i < len; i++) {
+		c = str[i] & 0xff;
+		if (c == '.') {
+			if (count == 0)
+				return (ISC_FALSE);
+			*label = count;
+			label = wire + n++;
+			count = 0;
+		} else if (isalnum(c) || c == '-' || c == '_' || c == '*' ||
+			   c == '/')
+		{
+			if (count == 63)
+				return (ISC_FALSE);
+			wire[n++] = c;
+			count++;
+		} else {
+			return (ISC_FALSE);
+		}
+	}
+	/* Without a trailing dot, the root label still has to be added. */
+	*label = count;
+	if (count > 0)
+		wire[n++] = 0;
+	if (n > DNS_NAME_MAXWIRE)
+		return (ISC_FALSE);
+
+	isc_buffer_add(target, n);
+	return (ISC_TRUE);
+}
+
 static isc_result_t
 build_query(const isc_textregion_t *line, isc_buffer_t *msg)
 {
-	char *domain_str;
+	char *domain_str, *end;
 	int domain_len;
 	dns_name_t name;
 	dns_offsets_t offsets;
@@ -492,29 +600,34 @@ build_query(const isc_textregion_t *line, isc_buffer_t *msg)
 	isc_result_t result;
 
 	domain_str = line->base;
-	domain_len = strcspn(line->base, WHITESPACE);
+	end = line->base + line->length;
+	domain_len = perf_scan_space(line->base, line->length);
 
 	qtype_r.base = line->base + domain_len;
-	while (isspace(*qtype_r.base & 0xff))
+	while (qtype_r.base < end && isspace(*qtype_r.base & 0xff))
 		qtype_r.base++;
-	qtype_r.length = strcspn(qtype_r.base, WHITESPACE);
+	qtype_r.length = perf_scan_space(qtype_r.base, end - qtype_r.base);
 
 	/* Create the question section */
-	DNS_NAME_INIT(&name, offsets);
-	result = name_fromstring(&name, dns_rootname, domain_str, domain_len,
-				 msg, "domain");
-	if (result != ISC_R_SUCCESS)
-		return (result);
+	if (!name_fromsimple(domain_str, domain_len, msg)) {
+		DNS_NAME_INIT(&name, offsets);
+		result = name_fromstring(&name, dns_rootname, domain_str,
+					 domain_len, msg, "domain");
+		if (result != ISC_R_SUCCESS)
+			return (result);
+	}
 
 	if (qtype_r.length == 0) {
 		perf_log_warning("invalid query input format: %s", line->base);
 		return (ISC_R_FAILURE);
 	}
-	result = dns_rdatatype_fromtext(&qtype, &qtype_r);
-	if (result != ISC_R_SUCCESS) {
-		perf_log_warning("invalid query type: %.*s",
-				 (int) qtype_r.length, qtype_r.base);
-		return (ISC_R_FAILURE);
+	if (!qtype_lookup(&qtype_r, &qtype)) {
+		result = dns_rdatatype_fromtext(&qtype, &qtype_r);
+		if (result != ISC_R_SUCCESS) {
+			perf_log_warning("invalid query type: %.*s",
+					 (int) qtype_r.length, qtype_r.base);
+			return (ISC_R_FAILURE);
+		}
 	}
 
 	isc_buffer_putuint16(msg, qtype);
@@ -802,6 +915,31 @@ build_update(perf_dnsctx_t *ctx, const isc_textregion_t *record,
 	return result;
 }
 
+/*
+ * Adds the OPT and TSIG records, as wanted, to a message otherwise
+ * complete.
+ */
+static isc_result_t
+finish_request(isc_boolean_t edns, isc_boolean_t dnssec,
+	       perf_dnstsigkey_t *tsigkey, isc_buffer_t *msg)
+{
+	isc_result_t result;
+
+	if (edns) {
+		result = add_edns(msg, dnssec);
+		if (result != ISC_R_SUCCESS)
+			return (result);
+	}
+
+	if (tsigkey != NULL) {
+		result = add_tsig(msg, tsigkey);
+		if (result != ISC_R_SUCCESS)
+			return (result);
+	}
+
+	return (ISC_R_SUCCESS);
+}
+
 isc_result_t
 perf_dns_buildrequest(perf_dnsctx_t *ctx, const isc_textregion_t *record,
 		      isc_uint16_t qid,
@@ -832,17 +970,59 @@ perf_dns_buildrequest(perf_dnsctx_t *ctx, const isc_textregion_t *record,
 	if (result != ISC_R_SUCCESS)
 		return (result);
 
-	if (edns) {
-		result = add_edns(msg, dnssec);
-		if (result != ISC_R_SUCCESS)
-			return (result);
-	}
+	return (finish_request(edns, dnssec, tsigkey, msg));
+}
 
-	if (tsigkey != NULL) {
-		result = add_tsig(msg, tsigkey);
-		if (result != ISC_R_SUCCESS)
-			return (result);
+isc_result_t
+perf_dns_copyrequest(const isc_region_t *wire, isc_uint16_t qid,
+		     isc_boolean_t edns, isc_boolean_t dnssec,
+		     perf_dnstsigkey_t *tsigkey, isc_buffer_t *msg)
+{
+	unsigned char *base;
+
+	if (wire->length < DNS_MESSAGE_HEADERLEN ||
+	    wire->length > isc_buffer_availablelength(msg))
+	{
+		perf_log_warning("invalid compiled message");
+		return (ISC_R_FAILURE);
 	}
 
-	return (ISC_R_SUCCESS);
+	base = isc_buffer_used(msg);
+	isc_buffer_putmem(msg, wire->base, wire->length);
+	base[0] = (qid >> 8) & 0xff;
+	base[1] = qid & 0xff;
+
+	return (finish_request(edns, dnssec, tsigkey, msg));
+}
+
+void
+perf_dns_describe(const isc_region_t *wire, char *buf, unsigned int size)
+{
+	isc_buffer_t source;
+	dns_decompress_t dctx;
+	dns_fixedname_t fname;
+	dns_name_t *name;
+	char namebuf[DNS_NAME_FORMATSIZE];
+	char typebuf[DNS_RDATATYPE_FORMATSIZE];
+	isc_result_t result;
+
+	isc_buffer_init(&source, wire->base, wire->length);
+	isc_buffer_add(&source, wire->length);
+	isc_buffer_forward(&source, DNS_MESSAGE_HEADERLEN);
+
+	dns_fixedname_init(&fname);
+	name = dns_fixedname_name(&fname);
+	dns_decompress_init(&dctx, -1, DNS_DECOMPRESS_NONE);
+	result = dns_name_fromwire(name, &source, &dctx, 0, NULL);
+	dns_decompress_invalidate(&dctx);
+	if (result != ISC_R_SUCCESS ||
+	    isc_buffer_remaininglength(&source) < 2)
+	{
+		snprintf(buf, size, "(malformed)");
+		return;
+	}
+	dns_name_format(name, namebuf, sizeof(namebuf));
+	dns_rdatatype_format(isc_buffer_getuint16(&source), typebuf,
+			     sizeof(typebuf));
+	snprintf(buf, size, "%s %s", namebuf, typebuf);
 }
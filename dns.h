@@ -63,4 +63,21 @@ perf_dns_buildrequest(perf_dnsctx_t *ctx, const isc_textregion_t *record,
 		      isc_boolean_t edns, isc_boolean_t dnssec,
 		      perf_dnstsigkey_t *tsigkey, isc_buffer_t *msg);
 
+/*
+ * Copies a message built in advance, with neither OPT nor TSIG record,
+ * into 'msg', setting its ID to 'qid' and adding those records as for
+ * perf_dns_buildrequest().
+ */
+isc_result_t
+perf_dns_copyrequest(const isc_region_t *wire, isc_uint16_t qid,
+		     isc_boolean_t edns, isc_boolean_t dnssec,
+		     perf_dnstsigkey_t *tsigkey, isc_buffer_t *msg);
+
+/*
+ * Writes the first question of a message as the name and type it was
+ * built from.
+ */
+void
+perf_dns_describe(const isc_region_t *wire, char *buf, unsigned int size);
+
 #endif
@@ -64,9 +64,12 @@
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
-#include <sys/ioctl.h>
+#include <poll.h>
 
+#include <sys/resource.h>
+#include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 
 #define ISC_BUFFER_USEINLINE
 
@@ -81,31 +84,80 @@
 #include <isc/sockaddr.h>
 #include <isc/types.h>
 
+#include <dns/name.h>
 #include <dns/rcode.h>
+#include <dns/rdatatype.h>
 #include <dns/result.h>
 
 #include "net.h"
 #include "datafile.h"
 #include "dns.h"
+#include "doh.h"
+#include "doq.h"
 #include "log.h"
 #include "opt.h"
 #include "os.h"
+#include "tls.h"
+#include "uring.h"
 #include "util.h"
 #include "version.h"
 
 #define DEFAULT_SERVER_NAME		"127.0.0.1"
 #define DEFAULT_SERVER_PORT		53
+#define DEFAULT_TLS_PORT		853
+#define DEFAULT_DOH_PORT		443
+#define DEFAULT_DOH_PATH		"/dns-query"
+#define DEFAULT_DOQ_STREAMS		100
 #define DEFAULT_LOCAL_PORT		0
 #define DEFAULT_MAX_OUTSTANDING		100
 #define DEFAULT_TIMEOUT			5
 
 #define TIMEOUT_CHECK_TIME		100000
 
+/* How often QUIC connections are serviced, for their timers. */
+#define DOQ_SERVICE_TIME		10000
+
 #define MAX_INPUT_DATA			(64 * 1024)
+#define INPUT_BATCH_SIZE		64
+
+/* Descriptors needed besides the sockets: per thread, and in all. */
+#define FILES_PER_THREAD		4
+#define RESERVED_FILES			32
+
+#define DEFAULT_RECV_BATCH_SIZE		16
+#define MAX_RECV_BATCH_SIZE		1024
+
+#define DEFAULT_SEND_BATCH_SIZE		1
+#define MAX_SEND_BATCH_SIZE		1024
+
+/* Room for the 2 byte length prefix used on TCP connections. */
+#define SEND_SLOT_SIZE			(MAX_EDNS_PACKET + 2)
+
+/* Both sendmmsg() and the uring engine need a message header per query. */
+#if defined(HAVE_SENDMMSG) || defined(HAVE_LINUX_IO_URING_H)
+#define SEND_MSGHDRS 1
+#endif
+
+#define TCP_RECV_BUFFER_SIZE		16384
+/* The largest frame, with its length prefix. */
+#define MAX_TCP_FRAME			(2 + 65535)
+
+/* Idle connections: opened per second, and how often each is queried. */
+#define DEFAULT_IDLE_RATE		1000
+#define DEFAULT_IDLE_INTERVAL		10
 
-#define MAX_SOCKETS			2048
+#define TCP_BACKOFF_MIN			10000
+#define TCP_BACKOFF_MAX			1000000
 
-#define RECV_BATCH_SIZE			16
+/*
+ * Connection setup times are also kept in a histogram, with 8 buckets
+ * for each power of two microseconds, to report percentiles.
+ */
+#define HIST_SUB_BITS			3
+#define HIST_BUCKETS			(62 << HIST_SUB_BITS)
+
+#define MIN_URING_BUFFERS		256
+#define MAX_URING_BUFFERS		32768
 
 typedef struct {
 	int argc;
@@ -129,6 +181,41 @@ typedef struct {
 	isc_boolean_t verbose;
 	isc_boolean_t usetcp;
 	isc_uint32_t max_tcp_q;
+	isc_uint32_t send_batch;
+	isc_uint32_t send_batch_bytes;
+	isc_uint32_t recv_batch;
+	isc_boolean_t uring;
+	isc_boolean_t uring_sqpoll;
+	unsigned int tcpopts;
+	isc_boolean_t tcp_open_first;
+	isc_boolean_t use_local_pool;
+	perf_net_localpool_t local_pool;
+	isc_boolean_t usetls;
+#ifdef HAVE_LIBSSL
+	perf_tlsctx_t *tlsctx;
+#endif
+	isc_boolean_t tls_early_data;
+	isc_boolean_t ktls;
+	isc_boolean_t usedoh;
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+	perf_doh_method_t doh_method;
+#endif
+	const char *doh_path;
+	char doh_authority[300];
+	isc_boolean_t usedoq;
+	isc_uint32_t doq_streams;
+	isc_uint32_t doq_conns;
+	isc_uint32_t conn_rate;
+	isc_uint32_t idle_conns;
+	isc_uint32_t idle_rate;
+	isc_uint64_t idle_interval;
+	unsigned char idle_query[2 + MAX_UDP_PACKET];
+	unsigned int idle_query_len;
+	const char *compile_file;
+	isc_boolean_t compiled;
+	isc_boolean_t builder;
+	perf_shard_t shard;
+	isc_boolean_t shard_pin;
 } config_t;
 
 typedef struct {
@@ -146,6 +233,24 @@ typedef struct {
 	isc_uint64_t num_timedout;
 	isc_uint64_t num_completed;
 	isc_uint64_t num_tcp_conns;
+	isc_uint64_t num_tcp_nodelay;
+	isc_uint64_t num_tcp_fastopen;
+	isc_uint64_t num_tcp_reset;
+	isc_uint64_t num_tcp_reconnects;
+	isc_uint64_t num_tcp_failed;
+	isc_uint64_t num_bind_inuse;
+	isc_uint64_t num_bind_notavail;
+	isc_uint64_t num_bind_other;
+	isc_uint64_t tcp_downtime;
+	isc_uint64_t num_tcp_setups;
+	isc_uint64_t num_tls_resumed;
+	isc_uint64_t num_tls_early;
+	isc_uint64_t num_tls_early_rejected;
+	isc_uint64_t num_ktls_send;
+	isc_uint64_t num_ktls_recv;
+	isc_uint64_t num_ktls_none;
+	isc_uint64_t num_doh_failed;
+	isc_uint64_t num_doq_failed;
 
 	isc_uint64_t total_request_size;
 	isc_uint64_t total_response_size;
@@ -154,6 +259,28 @@ typedef struct {
 	isc_uint64_t latency_sum_squares;
 	isc_uint64_t latency_min;
 	isc_uint64_t latency_max;
+
+	isc_uint64_t setup_sum;
+	isc_uint64_t setup_sum_squares;
+	isc_uint64_t setup_min;
+	isc_uint64_t setup_max;
+	isc_uint64_t setup_hist[HIST_BUCKETS];
+
+	isc_uint64_t num_idle_opened;
+	isc_uint64_t num_idle_established;
+	isc_uint64_t num_idle_closed;
+	isc_uint64_t num_idle_lost;
+	isc_uint64_t num_idle_keepalives;
+	isc_uint64_t num_idle_answers;
+	isc_uint64_t idle_close_first;
+	isc_uint64_t idle_close_last;
+	isc_uint64_t idle_age_max;
+	isc_uint64_t idle_age_hist[HIST_BUCKETS];
+
+	isc_uint64_t num_ring_taken;
+	isc_uint64_t ring_fill_sum;
+	isc_uint64_t num_ring_empty;
+	isc_uint64_t num_ring_full;
 } stats_t;
 
 typedef ISC_LIST(struct query_info) query_list;
@@ -162,40 +289,178 @@ typedef struct query_info {
 	isc_uint64_t timestamp;
 	query_list *list;
 	char *desc;
-	int sock;
+	unsigned int socknum;	/* The socket it is sent on ... */
+	isc_uint16_t qid;	/* ... and its ID there */
+	isc_boolean_t early;	/* Sent as TLS early data */
 	/*
 	 * This link links the query into the list of outstanding
-	 * queries or the list of available query IDs.
+	 * queries or the list of unused queries.
 	 */
 	ISC_LINK(struct query_info) link;
+	/* ... and this one, while outstanding, into its socket's list. */
+	ISC_LINK(struct query_info) sock_link;
 } query_info;
 
+/*
+ * Each socket has a query ID space of its own, so a thread may have up
+ * to this many queries outstanding on each of its sockets.
+ */
 #define NQIDS 65536
 
+/*
+ * The life of a TCP connection.  Over TLS, a connection goes through its
+ * TLS handshake once connected, unless it can send early data, in which
+ * case the handshake completes while it is in use.  The sender only uses
+ * open connections, and moves one to draining once it has sent its last
+ * query, or to error when a send fails; the receiver makes every other
+ * change.  A connection which is lost is closed, its outstanding queries
+ * are failed, and it is opened again, either at once or after backing
+ * off.  A connection waiting for its turn under -O conn-rate is also
+ * backing off.
+ *
+ * Each client is a slot.  Normally a slot has a single connection, but
+ * with -O tcp-recycle=open-first it has two, 'nslots' apart: while one is
+ * open, its replacement is established and waits on standby, ready to
+ * take over as soon as the first starts draining.
+ *
+ * With -O idle-conns, the receiver also holds idle connections, after
+ * the clients' ones.  Each is a slot of its own, which the sender never
+ * uses: it is opened once, at the -O idle-rate, sent an occasional
+ * keepalive query, and not replaced when the server closes it.
+ */
 typedef enum {
 	TCP_CLOSED,
-	TCP_IN_HANDSHAKE,
-	TCP_OK,
-	TCP_SENT_MAX
+	TCP_CONNECTING,
+	TCP_HANDSHAKE,
+	TCP_STANDBY,
+	TCP_OPEN,
+	TCP_DRAINING,
+	TCP_PEER_CLOSED,
+	TCP_ERROR,
+	TCP_BACKOFF
 } tcp_conn_state_t;
 
+#define TCP_CONN_LOST(state) \
+	((state) == TCP_PEER_CLOSED || (state) == TCP_ERROR)
+
+/*
+ * Bytes read from a TCP connection but not yet parsed into responses lie
+ * between 'start' and 'end'.
+ */
+typedef struct {
+	unsigned char *base;
+	unsigned int size;
+	unsigned int start;
+	unsigned int end;
+} tcp_buffer_t;
+
+/* Input records taken a batch at a time, by one thread. */
+typedef struct {
+	char data[MAX_INPUT_DATA];
+	isc_buffer_t lines;
+	isc_region_t records[INPUT_BATCH_SIZE];
+	isc_uint32_t hashes[INPUT_BATCH_SIZE];
+	unsigned int count;
+	unsigned int next;
+} record_batch_t;
+
+/*
+ * With -O builder, each sender has a thread of its own building its
+ * queries, which it passes on through a ring: only the builder moves
+ * 'ring_tail', and only the sender 'ring_head'.
+ */
+#define BUILD_RING_SIZE			256
+
+typedef struct {
+	unsigned int length;
+	isc_uint32_t hash;
+	char *desc;
+	unsigned char data[MAX_EDNS_PACKET];
+} built_query_t;
+
+/*
+ * Outstanding queries are found by socket and ID in a hash table of
+ * indexes into 'queries', with linear probing.  It is kept no more than
+ * half full.  Each socket also lists its own, so that a lost connection's
+ * queries can be failed without looking through every other.
+ */
+#define QID_EMPTY			UINT_MAX
+
 typedef struct {
-	query_info queries[NQIDS];
+	query_info *queries;
+	unsigned int nqueries;
 	query_list outstanding_queries;
 	query_list unused_queries;
+	unsigned int *qid_table;
+	unsigned int qid_mask;
+	isc_uint16_t *sock_next_qid;
+	unsigned int *sock_outstanding;
+	query_list *sock_queries;
 
 	pthread_t sender;
 	pthread_t receiver;
+	pthread_t builder;
+
+	built_query_t *ring;
+	unsigned int ring_head;
+	unsigned int ring_tail;
+	isc_boolean_t build_stop;
+	isc_boolean_t build_done;
 
 	pthread_mutex_t lock;
 	pthread_cond_t cond;
 
 	unsigned int nsocks;
+	unsigned int nactive;		/* the clients' sockets come first */
 	int current_sock;
 	int *socks;
 	isc_uint64_t *sock_num_recv;
 	isc_uint64_t *sock_num_sent;
 	tcp_conn_state_t *tcp_conn_state;
+	isc_uint64_t *tcp_backoff;
+	isc_uint64_t *tcp_retry;
+	unsigned int tcp_nbackoff;
+	isc_uint64_t tcp_next_retry;
+	int send_sock;
+	unsigned int nslots;
+	isc_uint64_t *slot_down_since;
+	unsigned int *open_socks;	/* the connections in TCP_OPEN */
+	unsigned int *open_index;	/* ... and where each is in it */
+	unsigned int nopen;
+	unsigned int open_next;
+	isc_uint64_t *tcp_open_time;
+	isc_uint64_t tcp_setup_check;
+	isc_uint32_t conn_rate;
+	isc_uint64_t next_conn_time;
+	unsigned int nidle;
+	unsigned int idle_next;		/* the next idle connection to open */
+	isc_uint64_t idle_open_time;
+	isc_uint32_t idle_rate;
+	unsigned int idle_cursor;	/* ... and to send a keepalive on */
+	isc_uint64_t idle_keepalive_time;
+	isc_uint64_t *idle_up;		/* when each was established */
+	unsigned int *idle_sent;	/* ... and how much of its keepalive */
+	unsigned int local_first;
+	unsigned int local_count;
+	unsigned int local_next;
+	tcp_buffer_t *tcp_bufs;
+	tcp_buffer_t spare_buf;
+#ifdef HAVE_LIBSSL
+	perf_tls_t **tls;
+#endif
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+	perf_doh_t **doh;
+#endif
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+	perf_doq_t **doq;
+	isc_uint64_t doq_service;
+#endif
+	perf_os_events_t *events;
+#ifdef HAVE_LINUX_IO_URING_H
+	perf_uring_t *send_ring;
+	perf_uring_t *recv_ring;
+	isc_uint32_t *sock_gen;
+#endif
 
 	perf_dnsctx_t *dnsctx;
 
@@ -228,6 +493,17 @@ static isc_mem_t *mctx;
 
 static perf_datafile_t *input;
 
+/* Resource usage before the threads and their sockets are set up. */
+static struct rusage start_usage;
+
+/* Idle connections established and not yet lost, over every thread. */
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static isc_uint64_t idle_held;
+static isc_uint64_t idle_peak;
+
+/* Whether a failure to bind a connection's local endpoint was reported. */
+static isc_boolean_t bind_warned;
+
 static void
 handle_sigint(int sig)
 {
@@ -296,13 +572,154 @@ stddev(isc_uint64_t sum_of_squares, isc_uint64_t sum, isc_uint64_t total)
 	return sqrt((sum_of_squares - (squared / total)) / (total - 1));
 }
 
+static unsigned int
+hist_bucket(isc_uint64_t value)
+{
+	unsigned int msb, bucket;
+
+	if (value < (1 << HIST_SUB_BITS))
+		return value;
+	for (msb = HIST_SUB_BITS; msb < 63 && (value >> (msb + 1)) != 0; msb++)
+		;
+	bucket = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) |
+		 ((value >> (msb - HIST_SUB_BITS)) &
+		  ((1 << HIST_SUB_BITS) - 1));
+	if (bucket >= HIST_BUCKETS)
+		bucket = HIST_BUCKETS - 1;
+	return bucket;
+}
+
+/* The largest value counted in a histogram bucket. */
+static isc_uint64_t
+hist_upper(unsigned int bucket)
+{
+	unsigned int shift;
+
+	if (bucket < (1 << HIST_SUB_BITS))
+		return bucket;
+	shift = (bucket >> HIST_SUB_BITS) - 1;
+	return ((((isc_uint64_t)1 << HIST_SUB_BITS) |
+		 (bucket & ((1 << HIST_SUB_BITS) - 1))) << shift) +
+	       ((isc_uint64_t)1 << shift) - 1;
+}
+
+static isc_uint64_t
+hist_percentile(const isc_uint64_t *hist, isc_uint64_t total, double percent,
+		isc_uint64_t max)
+{
+	isc_uint64_t rank, seen;
+	unsigned int i;
+
+	rank = (isc_uint64_t)ceil(total * percent / 100);
+	if (rank == 0)
+		rank = 1;
+	seen = 0;
+	for (i = 0; i < HIST_BUCKETS; i++) {
+		seen += hist[i];
+		if (seen >= rank)
+			return hist_upper(i) < max ? hist_upper(i) : max;
+	}
+	return max;
+}
+
+static double
+rusage_kbytes(long maxrss)
+{
+#ifdef __APPLE__
+	return maxrss / 1024.0;		/* bytes, not kilobytes */
+#else
+	return maxrss;
+#endif
+}
+
+static double
+rusage_seconds(const struct timeval *tv)
+{
+	return tv->tv_sec + tv->tv_usec / (double)MILLION;
+}
+
+/*
+ * Reports the memory and CPU time the run took, to size load generating
+ * hosts by.  The memory per connection is the growth in peak RSS since
+ * before the threads were set up, shared over the sockets they hold; it
+ * does not include the kernel's socket buffers.
+ */
+static void
+print_usage(const config_t *config, const stats_t *stats)
+{
+	struct rusage usage;
+	isc_uint64_t nsocks;
+	double user, sys, grown;
+
+	if (getrusage(RUSAGE_SELF, &usage) < 0)
+		return;
+	nsocks = (isc_uint64_t)config->clients * config->doq_conns *
+		 (config->tcp_open_first ? 2 : 1) + config->idle_conns;
+	grown = rusage_kbytes(usage.ru_maxrss) -
+		rusage_kbytes(start_usage.ru_maxrss);
+	user = rusage_seconds(&usage.ru_utime) -
+	       rusage_seconds(&start_usage.ru_utime);
+	sys = rusage_seconds(&usage.ru_stime) -
+	      rusage_seconds(&start_usage.ru_stime);
+	printf("  Peak memory (RSS):    %.1lf MB (%.2lf KB per connection)\n",
+	       rusage_kbytes(usage.ru_maxrss) / 1024,
+	       SAFE_DIV(grown > 0 ? grown : 0, nsocks));
+	printf("  CPU time (s):         %.2lf user, %.2lf system (%.1lf us "
+	       "per connection)\n", user, sys,
+	       SAFE_DIV((user + sys) * MILLION,
+			stats->num_tcp_conns + stats->num_idle_opened));
+}
+
+/*
+ * Reports what became of the idle connections: how many were held, and
+ * when the server closed those it did, both since the start of the run
+ * and as the age of each connection.
+ */
+static void
+print_idle_statistics(const config_t *config, const stats_t *stats)
+{
+	static const double percents[] = { 50, 90, 99 };
+	isc_uint64_t age, ncloses;
+	unsigned int i;
+
+	printf("  Idle connections:     %u target, %" ISC_PRINT_QUADFORMAT
+	       "u established, peak %" ISC_PRINT_QUADFORMAT "u held\n",
+	       config->idle_conns, stats->num_idle_established, idle_peak);
+	printf("  Idle keepalives:      %" ISC_PRINT_QUADFORMAT "u sent, %"
+	       ISC_PRINT_QUADFORMAT "u answered\n",
+	       stats->num_idle_keepalives, stats->num_idle_answers);
+	printf("  Idle closed:          %" ISC_PRINT_QUADFORMAT "u by the "
+	       "server, %" ISC_PRINT_QUADFORMAT "u failed, %"
+	       ISC_PRINT_QUADFORMAT "u never established\n",
+	       stats->num_idle_closed, stats->num_idle_lost,
+	       stats->num_idle_opened - stats->num_idle_established);
+	ncloses = stats->num_idle_closed + stats->num_idle_lost;
+	if (ncloses == 0)
+		return;
+	printf("  Idle closes at (s):   first %u.%06u, last %u.%06u\n",
+	       (unsigned int)(stats->idle_close_first / MILLION),
+	       (unsigned int)(stats->idle_close_first % MILLION),
+	       (unsigned int)(stats->idle_close_last / MILLION),
+	       (unsigned int)(stats->idle_close_last % MILLION));
+	printf("  Idle age at close:    ");
+	for (i = 0; i < sizeof(percents) / sizeof(percents[0]); i++) {
+		age = hist_percentile(stats->idle_age_hist, ncloses,
+				      percents[i], stats->idle_age_max);
+		printf("%s%g%% %u.%06u", i > 0 ? ", " : "", percents[i],
+		       (unsigned int)(age / MILLION),
+		       (unsigned int)(age % MILLION));
+	}
+	printf("\n");
+}
+
 static void
 print_statistics(const config_t *config, const times_t *times, stats_t *stats)
 {
+	static const double percents[] = { 50, 90, 99, 99.9 };
 	const char *units;
 	isc_uint64_t run_time;
 	isc_boolean_t first_rcode;
-	isc_uint64_t latency_avg;
+	isc_uint64_t latency_avg, setup_avg, setup;
 	unsigned int i;
 
 	units = config->updates ? "Updates" : "Queries";
@@ -352,12 +769,89 @@ print_statistics(const config_t *config, const times_t *times, stats_t *stats)
 	       (unsigned int)(run_time % MILLION));
 	printf("  %s per second:   %.6lf\n", units,
 	       SAFE_DIV(stats->num_completed, (((double)run_time) / MILLION)));
-	if (stats->num_tcp_conns != 0) {
+	/*
+	 * A ring that is mostly empty means the builders cannot keep up,
+	 * and one that is mostly full that the senders cannot.
+	 */
+	if (config->builder)
+		printf("  Build ring:           %.2lf%% full on average; empty %"
+		       ISC_PRINT_QUADFORMAT "u times, full %"
+		       ISC_PRINT_QUADFORMAT "u times\n",
+		       SAFE_DIV(100.0 * stats->ring_fill_sum,
+				(double)stats->num_ring_taken *
+				BUILD_RING_SIZE),
+		       stats->num_ring_empty, stats->num_ring_full);
+	if (stats->num_tcp_conns != 0 || stats->num_bind_inuse +
+	    stats->num_bind_notavail + stats->num_bind_other != 0) {
 		printf("  TCP connections:      %u\n",
 		        (unsigned int)stats->num_tcp_conns);
 		printf("  Ave %s per conn: %i\n", units,
 		       (int)round(SAFE_DIV((double)stats->num_completed,
 		                (double)stats->num_tcp_conns)));
+		if (stats->num_tcp_reconnects > 0)
+			printf("  TCP reconnects:       %" ISC_PRINT_QUADFORMAT
+			       "u\n", stats->num_tcp_reconnects);
+		if (stats->num_tcp_failed > 0)
+			printf("  Lost with connection: %" ISC_PRINT_QUADFORMAT
+			       "u (%.2lf%%)\n", stats->num_tcp_failed,
+			       SAFE_DIV(100.0 * stats->num_tcp_failed,
+					stats->num_sent));
+		if (stats->num_bind_inuse + stats->num_bind_notavail +
+		    stats->num_bind_other > 0)
+			printf("  Failed binds:         %" ISC_PRINT_QUADFORMAT
+			       "u in use, %" ISC_PRINT_QUADFORMAT
+			       "u not available, %" ISC_PRINT_QUADFORMAT
+			       "u other\n", stats->num_bind_inuse,
+			       stats->num_bind_notavail, stats->num_bind_other);
+		printf("  Slot downtime (s):    %u.%06u (%.2lf%% of %u "
+		       "slots)\n",
+		       (unsigned int)(stats->tcp_downtime / MILLION),
+		       (unsigned int)(stats->tcp_downtime % MILLION),
+		       SAFE_DIV(100.0 * stats->tcp_downtime,
+				(double)run_time * config->clients *
+				config->doq_conns),
+		       config->clients * config->doq_conns);
+		if ((config->tcpopts & PERF_NET_TCP_NODELAY) != 0)
+			printf("  TCP_NODELAY set:      %" ISC_PRINT_QUADFORMAT
+			       "u connections\n", stats->num_tcp_nodelay);
+		if ((config->tcpopts & PERF_NET_TCP_FASTOPEN) != 0)
+			printf("  Data in SYN (TFO):    %" ISC_PRINT_QUADFORMAT
+			       "u connections\n", stats->num_tcp_fastopen);
+		if ((config->tcpopts & PERF_NET_TCP_RESET) != 0)
+			printf("  Closed with RST:      %" ISC_PRINT_QUADFORMAT
+			       "u connections\n", stats->num_tcp_reset);
+		if (config->usetls) {
+			printf("  TLS handshakes:       %" ISC_PRINT_QUADFORMAT
+			       "u (%.2lf per second)\n", stats->num_tcp_setups,
+			       SAFE_DIV(stats->num_tcp_setups,
+					(((double)run_time) / MILLION)));
+			printf("  Resumed sessions:     %" ISC_PRINT_QUADFORMAT
+			       "u (%.2lf%%)\n", stats->num_tls_resumed,
+			       SAFE_DIV(100.0 * stats->num_tls_resumed,
+					stats->num_tcp_setups));
+		}
+		if (config->tls_early_data)
+			printf("  Early data:           %" ISC_PRINT_QUADFORMAT
+			       "u accepted, %" ISC_PRINT_QUADFORMAT
+			       "u rejected\n",
+			       stats->num_tls_early -
+			       stats->num_tls_early_rejected,
+			       stats->num_tls_early_rejected);
+		if (config->ktls)
+			printf("  Kernel TLS (kTLS):    %" ISC_PRINT_QUADFORMAT
+			       "u send, %" ISC_PRINT_QUADFORMAT "u receive, %"
+			       ISC_PRINT_QUADFORMAT "u user space only\n",
+			       stats->num_ktls_send, stats->num_ktls_recv,
+			       stats->num_ktls_none);
+		if (config->usedoh)
+			printf("  Failed HTTP streams:  %" ISC_PRINT_QUADFORMAT
+			       "u\n", stats->num_doh_failed);
+		if (config->usedoq)
+			printf("  Failed QUIC streams:  %" ISC_PRINT_QUADFORMAT
+			       "u\n", stats->num_doq_failed);
+		if (config->idle_conns > 0)
+			print_idle_statistics(config, stats);
+		print_usage(config, stats);
 	}
 	printf("\n");
 
@@ -375,6 +869,33 @@ print_statistics(const config_t *config, const times_t *times, stats_t *stats)
 			      stats->num_completed) / MILLION);
 	}
 
+	/* Connection setup, including any TLS handshake, is kept apart. */
+	if (stats->num_tcp_setups > 0) {
+		setup_avg = stats->setup_sum / stats->num_tcp_setups;
+		printf("  Average setup (s):    %u.%06u (min %u.%06u, "
+		       "max %u.%06u)\n",
+		       (unsigned int)(setup_avg / MILLION),
+		       (unsigned int)(setup_avg % MILLION),
+		       (unsigned int)(stats->setup_min / MILLION),
+		       (unsigned int)(stats->setup_min % MILLION),
+		       (unsigned int)(stats->setup_max / MILLION),
+		       (unsigned int)(stats->setup_max % MILLION));
+		if (stats->num_tcp_setups > 1)
+			printf("  Setup StdDev (s):     %f\n",
+			       stddev(stats->setup_sum_squares, stats->setup_sum,
+				      stats->num_tcp_setups) / MILLION);
+		printf("  Setup percentiles:    ");
+		for (i = 0; i < sizeof(percents) / sizeof(percents[0]); i++) {
+			setup = hist_percentile(stats->setup_hist,
+						stats->num_tcp_setups,
+						percents[i], stats->setup_max);
+			printf("%s%g%% %u.%06u", i > 0 ? ", " : "",
+			       percents[i], (unsigned int)(setup / MILLION),
+			       (unsigned int)(setup % MILLION));
+		}
+		printf("\n");
+	}
+
 	printf("\n");
 }
 
@@ -396,6 +917,15 @@ sum_stats(const config_t *config, stats_t *total)
 		total->num_timedout += stats->num_timedout;
 		total->num_completed += stats->num_completed;
 		total->num_tcp_conns += stats->num_tcp_conns;
+		total->num_tcp_nodelay += stats->num_tcp_nodelay;
+		total->num_tcp_fastopen += stats->num_tcp_fastopen;
+		total->num_tcp_reset += stats->num_tcp_reset;
+		total->num_tcp_reconnects += stats->num_tcp_reconnects;
+		total->num_tcp_failed += stats->num_tcp_failed;
+		total->num_bind_inuse += stats->num_bind_inuse;
+		total->num_bind_notavail += stats->num_bind_notavail;
+		total->num_bind_other += stats->num_bind_other;
+		total->tcp_downtime += stats->tcp_downtime;
 
 		total->total_request_size += stats->total_request_size;
 		total->total_response_size += stats->total_response_size;
@@ -404,6 +934,50 @@ sum_stats(const config_t *config, stats_t *total)
 		total->latency_sum_squares += stats->latency_sum_squares;
 		total->latency_min += stats->latency_min;
 		total->latency_max += stats->latency_max;
+
+		if (stats->num_tcp_setups > 0 &&
+		    (total->num_tcp_setups == 0 ||
+		     stats->setup_min < total->setup_min))
+			total->setup_min = stats->setup_min;
+		if (stats->setup_max > total->setup_max)
+			total->setup_max = stats->setup_max;
+		total->num_tcp_setups += stats->num_tcp_setups;
+		total->setup_sum += stats->setup_sum;
+		total->setup_sum_squares += stats->setup_sum_squares;
+		for (j = 0; j < HIST_BUCKETS; j++)
+			total->setup_hist[j] += stats->setup_hist[j];
+		total->num_tls_resumed += stats->num_tls_resumed;
+		total->num_tls_early += stats->num_tls_early;
+		total->num_tls_early_rejected += stats->num_tls_early_rejected;
+		total->num_ktls_send += stats->num_ktls_send;
+		total->num_ktls_recv += stats->num_ktls_recv;
+		total->num_ktls_none += stats->num_ktls_none;
+		total->num_doh_failed += stats->num_doh_failed;
+		total->num_doq_failed += stats->num_doq_failed;
+
+		total->num_idle_opened += stats->num_idle_opened;
+		total->num_idle_established += stats->num_idle_established;
+		if (stats->num_idle_closed + stats->num_idle_lost > 0) {
+			if (total->num_idle_closed + total->num_idle_lost == 0 ||
+			    stats->idle_close_first < total->idle_close_first)
+				total->idle_close_first =
+					stats->idle_close_first;
+			if (stats->idle_close_last > total->idle_close_last)
+				total->idle_close_last = stats->idle_close_last;
+		}
+		total->num_idle_closed += stats->num_idle_closed;
+		total->num_idle_lost += stats->num_idle_lost;
+		total->num_idle_keepalives += stats->num_idle_keepalives;
+		total->num_idle_answers += stats->num_idle_answers;
+		if (stats->idle_age_max > total->idle_age_max)
+			total->idle_age_max = stats->idle_age_max;
+		for (j = 0; j < HIST_BUCKETS; j++)
+			total->idle_age_hist[j] += stats->idle_age_hist[j];
+
+		total->num_ring_taken += stats->num_ring_taken;
+		total->ring_fill_sum += stats->ring_fill_sum;
+		total->num_ring_empty += stats->num_ring_empty;
+		total->num_ring_full += stats->num_ring_full;
 	}
 }
 
@@ -416,16 +990,61 @@ stringify(unsigned int value)
 	return buf;
 }
 
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * Whether the kernel can run the uring engine: receives on datagram
+ * sockets, and readiness polls on connections, must stay armed.
+ */
+static isc_boolean_t
+uring_usable(const config_t *config)
+{
+	perf_uring_t *ring;
+	unsigned int need;
+	isc_boolean_t usable;
+
+	ring = perf_uring_create(mctx, 1, 1, ISC_FALSE);
+	if (ring == NULL) {
+		perf_log_warning("cannot use io_uring: %s; "
+				 "using the poll engine", strerror(errno));
+		return ISC_FALSE;
+	}
+	need = config->usetcp == ISC_TRUE ? PERF_URING_POLL_MULTISHOT
+					  : PERF_URING_RECV_MULTISHOT;
+	usable = ISC_TF((perf_uring_features(ring) & need) != 0);
+	if (!usable)
+		perf_log_warning("this kernel has no multishot %s for "
+				 "io_uring; using the poll engine",
+				 need == PERF_URING_POLL_MULTISHOT ?
+				 "poll" : "receive");
+	perf_uring_destroy(&ring);
+	return usable;
+}
+#endif
+
 static void
 setup(int argc, char **argv, config_t *config)
 {
 	const char *family = NULL;
 	const char *server_name = DEFAULT_SERVER_NAME;
-	in_port_t server_port = DEFAULT_SERVER_PORT;
+	in_port_t server_port = 0;
 	const char *local_name = NULL;
 	in_port_t local_port = DEFAULT_LOCAL_PORT;
 	const char *filename = NULL;
 	const char *tsigkey = NULL;
+	const char *engine = "poll";
+	const char *tcp_recycle = "close-first";
+	const char *local_addrs = NULL;
+	const char *local_ports = NULL;
+	const char *tls_servername = NULL;
+	const char *tls_resume = "none";
+	const char *shard = "none";
+	isc_boolean_t compiled_updates;
+	const char *doh_method = "post";
+	isc_boolean_t tcp_nodelay = ISC_FALSE;
+	isc_boolean_t tcp_fastopen = ISC_FALSE;
+	isc_boolean_t tcp_reset = ISC_FALSE;
+	isc_uint64_t nfiles;
+	unsigned int maxfiles;
 	isc_result_t result;
 
 	result = isc_mem_create(0, 0, &mctx);
@@ -444,6 +1063,13 @@ setup(int argc, char **argv, config_t *config)
 	config->threads = 1;
 	config->timeout = DEFAULT_TIMEOUT * MILLION;
 	config->max_outstanding = DEFAULT_MAX_OUTSTANDING;
+	config->send_batch = DEFAULT_SEND_BATCH_SIZE;
+	config->recv_batch = DEFAULT_RECV_BATCH_SIZE;
+	config->doh_path = DEFAULT_DOH_PATH;
+	config->doq_streams = DEFAULT_DOQ_STREAMS;
+	config->doq_conns = 1;
+	config->idle_rate = DEFAULT_IDLE_RATE;
+	config->idle_interval = DEFAULT_IDLE_INTERVAL * MILLION;
 
 	perf_opt_add('f', perf_opt_string, "family",
 		     "address family of DNS transport, inet or inet6", "any",
@@ -510,8 +1136,189 @@ setup(int argc, char **argv, config_t *config)
  		     "max no. of queries to be sent on a single TCP connection",
  		     stringify(0),
  		     &config->max_tcp_q);	
+	perf_long_opt_add("send-batch", perf_opt_uint, "N",
+			  "number of queries to send per system call",
+			  stringify(DEFAULT_SEND_BATCH_SIZE),
+			  &config->send_batch);
+	perf_long_opt_add("send-batch-bytes", perf_opt_uint, "N",
+			  "send a batch once it holds this many bytes", NULL,
+			  &config->send_batch_bytes);
+	perf_long_opt_add("recv-batch", perf_opt_uint, "N",
+			  "maximum number of responses to process at once",
+			  stringify(DEFAULT_RECV_BATCH_SIZE),
+			  &config->recv_batch);
+	perf_long_opt_add("engine", perf_opt_string, "poll|uring",
+			  "how sockets are driven", "poll", &engine);
+	perf_long_opt_add("uring-sqpoll", perf_opt_boolean, NULL,
+			  "submit uring requests from a kernel thread", NULL,
+			  &config->uring_sqpoll);
+	perf_long_opt_add("tcp-nodelay", perf_opt_boolean, NULL,
+			  "set TCP_NODELAY on connections", NULL,
+			  &tcp_nodelay);
+	perf_long_opt_add("tcp-fastopen", perf_opt_boolean, NULL,
+			  "send the first queries in the SYN (TCP Fast Open)",
+			  NULL, &tcp_fastopen);
+	perf_long_opt_add("tcp-rst-close", perf_opt_boolean, NULL,
+			  "close connections with a RST, avoiding TIME_WAIT",
+			  NULL, &tcp_reset);
+	perf_long_opt_add("tcp-recycle", perf_opt_string,
+			  "close-first|open-first",
+			  "how connections are replaced under -Z",
+			  "close-first", &tcp_recycle);
+	perf_long_opt_add("local-addrs", perf_opt_string, "addr,...",
+			  "local addresses for TCP connections to rotate over",
+			  NULL, &local_addrs);
+	perf_long_opt_add("local-ports", perf_opt_string, "low-high",
+			  "local ports for TCP connections to rotate over",
+			  NULL, &local_ports);
+	perf_long_opt_add("tls", perf_opt_boolean, NULL,
+			  "use DNS over TLS (implies -z; port 853 unless -p)",
+			  NULL, &config->usetls);
+	perf_long_opt_add("tls-servername", perf_opt_string, "name",
+			  "server name to send in the TLS handshake (SNI)",
+			  NULL, &tls_servername);
+	perf_long_opt_add("tls-resume", perf_opt_string,
+			  "none|ticket|early-data",
+			  "how new TLS sessions start", "none", &tls_resume);
+	perf_long_opt_add("doh", perf_opt_boolean, NULL,
+			  "use DNS over HTTPS over HTTP/2 (implies tls; "
+			  "port 443 unless -p)", NULL, &config->usedoh);
+	perf_long_opt_add("doh-method", perf_opt_string, "post|get",
+			  "how DNS over HTTPS queries are sent", "post",
+			  &doh_method);
+	perf_long_opt_add("doh-path", perf_opt_string, "path",
+			  "the DNS over HTTPS URI path", DEFAULT_DOH_PATH,
+			  &config->doh_path);
+	perf_long_opt_add("doq", perf_opt_boolean, NULL,
+			  "use DNS over QUIC (implies tls; port 853 unless -p)",
+			  NULL, &config->usedoq);
+	perf_long_opt_add("doq-streams", perf_opt_uint, "N",
+			  "queries in flight on each DNS over QUIC connection",
+			  stringify(DEFAULT_DOQ_STREAMS), &config->doq_streams);
+	perf_long_opt_add("doq-conns", perf_opt_uint, "N",
+			  "DNS over QUIC connections per client", "1",
+			  &config->doq_conns);
+	perf_long_opt_add("ktls", perf_opt_boolean, NULL,
+			  "have the kernel encrypt TLS records (kTLS)", NULL,
+			  &config->ktls);
+	perf_long_opt_add("conn-rate", perf_opt_uint, "N",
+			  "open at most N connections per second", NULL,
+			  &config->conn_rate);
+	perf_long_opt_add("idle-conns", perf_opt_uint, "N",
+			  "also hold N idle connections open", NULL,
+			  &config->idle_conns);
+	perf_long_opt_add("idle-rate", perf_opt_uint, "N",
+			  "open idle connections at N per second",
+			  stringify(DEFAULT_IDLE_RATE), &config->idle_rate);
+	perf_long_opt_add("idle-interval", perf_opt_timeval, "S",
+			  "send a keepalive query on each idle connection "
+			  "every S seconds (0: never)",
+			  stringify(DEFAULT_IDLE_INTERVAL),
+			  &config->idle_interval);
+	perf_long_opt_add("builder", perf_opt_boolean, NULL,
+			  "build queries on a thread of their own for each "
+			  "sender", NULL, &config->builder);
+	perf_long_opt_add("shard", perf_opt_string, "none|contiguous|qname",
+			  "give each thread a part of the input of its own",
+			  "none", &shard);
+	perf_long_opt_add("shard-pin", perf_opt_boolean, NULL,
+			  "send each query name from one client only, with "
+			  "shard=qname", NULL, &config->shard_pin);
+	perf_long_opt_add("compile", perf_opt_string, "file",
+			  "write the input to file as ready-made messages, "
+			  "and exit", NULL, &config->compile_file);
 	perf_opt_parse(argc, argv);
 
+	if (config->usedoh) {
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+		if (strcmp(doh_method, "post") == 0) {
+			config->doh_method = perf_doh_post;
+		} else if (strcmp(doh_method, "get") == 0) {
+			config->doh_method = perf_doh_get;
+		} else {
+			fprintf(stderr, "invalid doh-method %s\n", doh_method);
+			perf_opt_usage();
+			exit(1);
+		}
+		/* Rejected early data would take the HTTP/2 preface with it. */
+		if (strcmp(tls_resume, "early-data") == 0)
+			perf_log_fatal("early data cannot be used with DNS "
+				       "over HTTPS");
+		config->usetls = ISC_TRUE;
+#else
+		perf_log_fatal("this build does not support DNS over HTTPS");
+#endif
+	}
+	if (config->usedoq) {
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+		if (config->usedoh)
+			perf_log_fatal("only one of doh and doq may be used");
+		if (config->doq_streams == 0 || config->doq_conns == 0) {
+			fprintf(stderr, "invalid doq-streams or doq-conns\n");
+			perf_opt_usage();
+			exit(1);
+		}
+		config->usetls = ISC_TRUE;
+#else
+		perf_log_fatal("this build does not support DNS over QUIC");
+#endif
+	} else {
+		config->doq_conns = 1;
+	}
+	if (config->usetls) {
+#ifdef HAVE_LIBSSL
+		perf_tls_resume_t resume;
+		unsigned int tlsopts = 0;
+
+		if (strcmp(tls_resume, "none") == 0) {
+			resume = perf_tls_resume_none;
+		} else if (strcmp(tls_resume, "ticket") == 0) {
+			resume = perf_tls_resume_ticket;
+		} else if (strcmp(tls_resume, "early-data") == 0) {
+			resume = perf_tls_resume_early;
+			config->tls_early_data = ISC_TRUE;
+		} else {
+			fprintf(stderr, "invalid tls-resume %s\n", tls_resume);
+			perf_opt_usage();
+			exit(1);
+		}
+		if (config->ktls && config->usedoq) {
+			perf_log_warning("ktls has no effect with doq");
+			config->ktls = ISC_FALSE;
+		}
+		if (config->ktls)
+			tlsopts |= PERF_TLS_CTX_KTLS;
+		if (config->usedoq)
+			tlsopts |= PERF_TLS_CTX_QUIC;
+		config->usetcp = ISC_TRUE;
+		config->tlsctx = perf_tls_createctx(mctx,
+						    config->usedoh ? "h2" :
+						    config->usedoq ? "doq" :
+								     "dot",
+						    tls_servername, resume,
+						    tlsopts);
+#else
+		perf_log_fatal("this build does not support TLS");
+#endif
+	}
+	if (server_port == 0)
+		server_port = config->usedoh ? DEFAULT_DOH_PORT :
+			      config->usetls ? DEFAULT_TLS_PORT :
+					       DEFAULT_SERVER_PORT;
+	if (config->usedoh) {
+		const char *host;
+
+		host = tls_servername != NULL ? tls_servername : server_name;
+		snprintf(config->doh_authority, sizeof(config->doh_authority),
+			 strchr(host, ':') != NULL ? "[%s]" : "%s", host);
+		if (server_port != DEFAULT_DOH_PORT)
+			snprintf(config->doh_authority +
+				 strlen(config->doh_authority),
+				 sizeof(config->doh_authority) -
+				 strlen(config->doh_authority),
+				 ":%u", server_port);
+	}
+
 	if (family != NULL)
 		config->family = perf_net_parsefamily(family);
 	perf_net_parseserver(config->family, server_name, server_port,
@@ -524,13 +1331,102 @@ setup(int argc, char **argv, config_t *config)
 	if (config->maxruns == 0 && config->timelimit == 0)
 		config->maxruns = 1;
 	perf_datafile_setmaxruns(input, config->maxruns);
+	config->compiled = perf_datafile_iscompiled(input, &compiled_updates);
+	if (config->compiled && compiled_updates != config->updates)
+		perf_log_fatal("the input holds compiled %s",
+			       compiled_updates ? "updates, but -u was not given"
+						: "queries, but -u was given");
 
 	if (config->dnssec)
 		config->edns = ISC_TRUE;
 
+	if (config->send_batch > MAX_SEND_BATCH_SIZE)
+		config->send_batch = MAX_SEND_BATCH_SIZE;
+	if (config->recv_batch > MAX_RECV_BATCH_SIZE)
+		config->recv_batch = MAX_RECV_BATCH_SIZE;
+
+	if (tcp_nodelay)
+		config->tcpopts |= PERF_NET_TCP_NODELAY;
+	if (tcp_fastopen)
+		config->tcpopts |= PERF_NET_TCP_FASTOPEN;
+	if (tcp_reset)
+		config->tcpopts |= PERF_NET_TCP_RESET;
+
+	if (strcmp(engine, "uring") == 0) {
+#ifdef HAVE_LINUX_IO_URING_H
+		config->uring = uring_usable(config);
+#else
+		perf_log_fatal("this build does not support the uring engine");
+#endif
+	} else if (strcmp(engine, "poll") != 0) {
+		fprintf(stderr, "invalid engine %s\n", engine);
+		perf_opt_usage();
+		exit(1);
+	}
+
+	if (strcmp(shard, "contiguous") == 0) {
+		config->shard = perf_shard_contiguous;
+	} else if (strcmp(shard, "qname") == 0) {
+		config->shard = perf_shard_qname;
+	} else if (strcmp(shard, "none") != 0) {
+		fprintf(stderr, "invalid shard %s\n", shard);
+		perf_opt_usage();
+		exit(1);
+	}
+	if (config->shard_pin && config->shard != perf_shard_qname) {
+		fprintf(stderr, "shard-pin needs shard=qname\n");
+		perf_opt_usage();
+		exit(1);
+	}
+
+	if (strcmp(tcp_recycle, "open-first") == 0) {
+		config->tcp_open_first = ISC_TRUE;
+		if (!config->usetcp || config->max_tcp_q == 0) {
+			perf_log_warning("tcp-recycle=open-first has no effect "
+					 "without -z and -Z");
+			config->tcp_open_first = ISC_FALSE;
+		}
+	} else if (strcmp(tcp_recycle, "close-first") != 0) {
+		fprintf(stderr, "invalid tcp-recycle %s\n", tcp_recycle);
+		perf_opt_usage();
+		exit(1);
+	}
+
+	if (local_addrs != NULL || local_ports != NULL) {
+		perf_net_parselocalpool(mctx,
+					isc_sockaddr_pf(&config->server_addr),
+					local_addrs, local_ports,
+					&config->local_addr,
+					&config->local_pool);
+		config->use_local_pool = ISC_TRUE;
+	}
+
 	if (tsigkey != NULL)
 		config->tsigkey = perf_dns_parsetsigkey(tsigkey, mctx);
 
+	if (config->idle_conns > 0) {
+		isc_buffer_t msg;
+		isc_textregion_t record;
+
+		if (!config->usetcp)
+			perf_log_fatal("idle-conns needs -z or tls");
+		if (config->usedoh || config->usedoq)
+			perf_log_fatal("idle-conns cannot be used with doh or "
+				       "doq");
+		/* The same plain query serves as every keepalive. */
+		record.base = (char *)". NS";
+		record.length = strlen(record.base);
+		isc_buffer_init(&msg, config->idle_query + 2, MAX_UDP_PACKET);
+		result = perf_dns_buildrequest(NULL, &record, 0, ISC_FALSE,
+					       ISC_FALSE, NULL, &msg);
+		if (result != ISC_R_SUCCESS)
+			perf_log_fatal("building keepalive query: %s",
+				       isc_result_totext(result));
+		config->idle_query[0] = (msg.used >> 8) & 0xff;
+		config->idle_query[1] = msg.used & 0xff;
+		config->idle_query_len = msg.used + 2;
+	}
+
 	/*
 	 * If we run more threads than max-qps, some threads will have
 	 * ->max_qps set to 0, and be unlimited.
@@ -543,6 +1439,51 @@ setup(int argc, char **argv, config_t *config)
 	 */
 	if (config->threads > config->clients)
 		config->threads = config->clients;
+
+	/* Once the number of threads is known, each is given its shard. */
+	if (config->shard != perf_shard_none && config->compile_file == NULL)
+		perf_datafile_shard(input, config->shard, config->threads,
+				    config->updates);
+
+	/*
+	 * Each client holds a socket per connection, or two while one
+	 * replaces another with tcp-recycle=open-first, and each idle
+	 * connection one more; there is no limit on them but the number of
+	 * open files.
+	 */
+	nfiles = (isc_uint64_t)config->clients * config->doq_conns *
+		 (config->tcp_open_first ? 2 : 1) + config->idle_conns +
+		 config->threads * FILES_PER_THREAD + RESERVED_FILES;
+	maxfiles = perf_os_raisefdlimit(nfiles < UINT_MAX ? nfiles : UINT_MAX);
+	if (nfiles > maxfiles)
+		perf_log_fatal("%" ISC_PRINT_QUADFORMAT "u open files are "
+			       "needed, but the limit is %u (see ulimit -n)",
+			       nfiles, maxfiles);
+}
+
+/*
+ * Builds each record of the input once, without ID, OPT or TSIG record,
+ * for later runs to send as they are.
+ */
+static void
+compile_input(const config_t *config)
+{
+	perf_dnsctx_t *ctx;
+	isc_uint64_t nmsgs, nskipped;
+
+	ctx = perf_dns_createctx(config->updates);
+	perf_datafile_setmaxruns(input, 1);
+	perf_datafile_compile(input, ctx, config->compile_file, &nmsgs,
+			      &nskipped);
+	perf_dns_destroyctx(&ctx);
+
+	printf("[Status] Compiled %" ISC_PRINT_QUADFORMAT "u %s to %s",
+	       nmsgs, config->updates ? "updates" : "queries",
+	       config->compile_file);
+	if (nskipped > 0)
+		printf(" (%" ISC_PRINT_QUADFORMAT "u records skipped)",
+		       nskipped);
+	printf("\n");
 }
 
 static void
@@ -558,18 +1499,118 @@ cleanup(config_t *config)
 	}
 	if (config->tsigkey != NULL)
 		perf_dns_destroytsigkey(&config->tsigkey);
+	if (config->use_local_pool)
+		perf_net_freelocalpool(mctx, &config->local_pool);
+#ifdef HAVE_LIBSSL
+	if (config->tlsctx != NULL)
+		perf_tls_destroyctx(&config->tlsctx);
+#endif
 	isc_mem_destroy(&mctx);
 }
 
+static inline unsigned int
+qid_home(const threadinfo_t *tinfo, unsigned int socknum, isc_uint16_t qid)
+{
+	isc_uint64_t key;
+
+	key = ((isc_uint64_t)socknum << 16) | qid;
+	return (unsigned int)((key * 0x9E3779B97F4A7C15ULL) >> 32) &
+	       tinfo->qid_mask;
+}
+
+/* Finds the outstanding query with this ID on this socket, if any. */
+static query_info *
+qid_lookup(const threadinfo_t *tinfo, unsigned int socknum, isc_uint16_t qid)
+{
+	query_info *q;
+	unsigned int i;
+
+	for (i = qid_home(tinfo, socknum, qid);
+	     tinfo->qid_table[i] != QID_EMPTY;
+	     i = (i + 1) & tinfo->qid_mask)
+	{
+		q = &tinfo->queries[tinfo->qid_table[i]];
+		if (q->socknum == socknum && q->qid == qid)
+			return q;
+	}
+	return NULL;
+}
+
+static void
+qid_insert(threadinfo_t *tinfo, query_info *q)
+{
+	unsigned int i;
+
+	i = qid_home(tinfo, q->socknum, q->qid);
+	while (tinfo->qid_table[i] != QID_EMPTY)
+		i = (i + 1) & tinfo->qid_mask;
+	tinfo->qid_table[i] = q - tinfo->queries;
+	tinfo->sock_outstanding[q->socknum]++;
+	ISC_LIST_APPEND(tinfo->sock_queries[q->socknum], q, sock_link);
+}
+
+/*
+ * Removes a query from the table, moving up any entries after it which
+ * would otherwise no longer be found.
+ */
+static void
+qid_remove(threadinfo_t *tinfo, query_info *q)
+{
+	unsigned int i, j, home, mask;
+	query_info *moved;
+
+	mask = tinfo->qid_mask;
+	i = qid_home(tinfo, q->socknum, q->qid);
+	while (tinfo->qid_table[i] != (unsigned int)(q - tinfo->queries))
+		i = (i + 1) & mask;
+	tinfo->sock_outstanding[q->socknum]--;
+	ISC_LIST_UNLINK(tinfo->sock_queries[q->socknum], q, sock_link);
+
+	for (j = i;;) {
+		tinfo->qid_table[i] = QID_EMPTY;
+		do {
+			j = (j + 1) & mask;
+			if (tinfo->qid_table[j] == QID_EMPTY)
+				return;
+			moved = &tinfo->queries[tinfo->qid_table[j]];
+			home = qid_home(tinfo, moved->socknum, moved->qid);
+		} while (i <= j ? (i < home && home <= j) :
+				  (i < home || home <= j));
+		tinfo->qid_table[i] = tinfo->qid_table[j];
+		i = j;
+	}
+}
+
+/*
+ * Picks the next ID on a socket which is not in use there; the caller
+ * makes sure that the socket has one free.  Called with the lock held.
+ */
+static isc_uint16_t
+qid_next(threadinfo_t *tinfo, unsigned int socknum)
+{
+	isc_uint16_t qid;
+
+	do {
+		qid = tinfo->sock_next_qid[socknum]++;
+	} while (qid_lookup(tinfo, socknum, qid) != NULL);
+	return qid;
+}
+
 typedef enum {
 	prepend_unused,
 	append_unused,
 	prepend_outstanding,
 } query_move_op;
 
+/*
+ * Moves a query between the lists, entering it in the ID table while it
+ * is outstanding.
+ */
 static inline void
 query_move(threadinfo_t *tinfo, query_info *q, query_move_op op)
 {
+	if (q->list == &tinfo->outstanding_queries)
+		qid_remove(tinfo, q);
 	ISC_LIST_UNLINK(*q->list, q, link);
 	switch (op) {
 	case prepend_unused:
@@ -583,6 +1624,7 @@ query_move(threadinfo_t *tinfo, query_info *q, query_move_op op)
 	case prepend_outstanding:
 		q->list = &tinfo->outstanding_queries;
 		ISC_LIST_PREPEND(tinfo->outstanding_queries, q, link);
+		qid_insert(tinfo, q);
 		break;
 	}
 }
@@ -602,243 +1644,1260 @@ wait_for_start(void)
 	UNLOCK(&start_lock);
 }
 
-static isc_boolean_t
-find_working_tcp_connection(int *socknum, threadinfo_t *tinfo) 
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * Each uring request records what it is for, and the socket and its
+ * generation, so that completions for a connection which has since been
+ * replaced can be recognised and dropped.
+ */
+#define URING_SEND		0
+#define URING_RECV		1
+#define URING_POLLIN		2
+#define URING_POLLOUT		3
+#define URING_PIPE		4
+
+#define URING_DATA(gen, op, socket) \
+	(((isc_uint64_t)(gen) << 32) | ((op) << 24) | (socket))
+#define URING_GEN(data)		((isc_uint32_t)((data) >> 32))
+#define URING_OP(data)		((unsigned int)((data) >> 24) & 0xff)
+#define URING_SOCKET(data)	((unsigned int)(data) & 0xffffff)
+#define URING_MAX_SOCKETS	(1 << 24)
+
+static void
+uring_watch_read(threadinfo_t *tinfo, unsigned int socket)
 {
-	int i;
-	for (i = 0; i < tinfo->nsocks; i++, (*socknum)++) {
-		if (*socknum == tinfo->nsocks)
-			(*socknum) = 0;
-		if (tinfo->socks[*socknum] == -1 ||
-		    tinfo->tcp_conn_state[*socknum] == TCP_CLOSED ||
-		    tinfo->tcp_conn_state[*socknum] == TCP_SENT_MAX)
-			continue;
-		if (tinfo->tcp_conn_state[*socknum] == TCP_IN_HANDSHAKE) {
-			if (perf_os_waituntilwriteable(tinfo->socks[*socknum], 0)
-			                                  != ISC_R_SUCCESS)
-				continue;
-			LOCK(&tinfo->lock);
-			tinfo->tcp_conn_state[*socknum] = TCP_OK;
-			UNLOCK(&tinfo->lock);
-		}
-		int error = 0;
-		socklen_t len = (socklen_t)sizeof(error);
-		getsockopt(tinfo->socks[*socknum], SOL_SOCKET, SO_ERROR, 
-		           (void*)&error, &len);
-		if (error == EINPROGRESS || error == EWOULDBLOCK || error == EAGAIN) {
-			continue;
-		} else if (error != 0) {
-			/* TODO: Need to reset the connection again */
-			perf_log_warning("Error: cannot use connection %i, fd %d: %s", 
-			               *socknum, tinfo->socks[*socknum], strerror(error));
-			continue;
+	isc_uint32_t gen = tinfo->sock_gen[socket];
+
+	if (tinfo->config->usetcp == ISC_TRUE)
+		perf_uring_poll(tinfo->recv_ring, tinfo->socks[socket],
+				PERF_OS_EVENT_READ, ISC_TRUE,
+				URING_DATA(gen, URING_POLLIN, socket));
+	else
+		perf_uring_recv_multishot(tinfo->recv_ring,
+					  tinfo->socks[socket],
+					  URING_DATA(gen, URING_RECV, socket));
+}
+
+static void
+uring_watch_write(threadinfo_t *tinfo, unsigned int socket)
+{
+	perf_uring_poll(tinfo->recv_ring, tinfo->socks[socket],
+			PERF_OS_EVENT_WRITE, ISC_FALSE,
+			URING_DATA(tinfo->sock_gen[socket], URING_POLLOUT,
+				   socket));
+}
+#endif
+
+/*
+ * Starts reporting on a socket; 'what' is PERF_OS_EVENT_READ, optionally
+ * with PERF_OS_EVENT_WRITE to be told once when it becomes writable.
+ */
+static void
+watch_socket(threadinfo_t *tinfo, unsigned int socket, unsigned int what)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tinfo->recv_ring != NULL) {
+		uring_watch_read(tinfo, socket);
+		if ((what & PERF_OS_EVENT_WRITE) != 0)
+			uring_watch_write(tinfo, socket);
+		perf_uring_submit(tinfo->recv_ring);
+		return;
+	}
+#endif
+	perf_os_events_add(tinfo->events, tinfo->socks[socket], socket, what);
+}
+
+/* Asks to be told (once) when a socket is writable, or stops asking. */
+static void
+watch_writable(threadinfo_t *tinfo, unsigned int socket, isc_boolean_t on)
+{
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tinfo->recv_ring != NULL) {
+		/* Write interest is one-shot here anyway. */
+		if (on) {
+			uring_watch_write(tinfo, socket);
+			perf_uring_submit(tinfo->recv_ring);
 		}
-		return ISC_TRUE;
+		return;
 	}
-	return ISC_FALSE;
+#endif
+	perf_os_events_modify(tinfo->events, tinfo->socks[socket], socket,
+			      on ? PERF_OS_EVENT_READ | PERF_OS_EVENT_WRITE :
+				   PERF_OS_EVENT_READ);
 }
 
-static void *
-do_send(void *arg)
+/* Stops reporting on a socket which is about to be closed. */
+static void
+unwatch_socket(threadinfo_t *tinfo, unsigned int socket)
 {
-	threadinfo_t *tinfo;
-	const config_t *config;
-	const times_t *times;
-	stats_t *stats;
-	unsigned int max_packet_size;
-	isc_buffer_t msg;
-	isc_uint64_t now, run_time, req_time;
-	char input_data[MAX_INPUT_DATA];
-	isc_buffer_t lines;
-	isc_region_t used;
-	query_info *q;
-	int qid;
-	unsigned char packet_buffer[MAX_EDNS_PACKET];
-	unsigned char *base;
-	unsigned int length;
-	int n;
-	isc_result_t result;
-	unsigned char pkt_tcp_payload[2];
-	int socknum;
-	
-	tinfo = (threadinfo_t *) arg;
-	config = tinfo->config;
-	times = tinfo->times;
-	stats = &tinfo->stats;
-	max_packet_size = config->edns ? MAX_EDNS_PACKET : MAX_UDP_PACKET;
-	isc_buffer_init(&msg, packet_buffer, max_packet_size);
-	isc_buffer_init(&lines, input_data, sizeof(input_data));
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tinfo->recv_ring != NULL) {
+		isc_uint32_t gen = tinfo->sock_gen[socket]++;
+
+		/* Only connections are ever closed early. */
+		perf_uring_poll_remove(tinfo->recv_ring,
+				       URING_DATA(gen, URING_POLLIN, socket));
+		perf_uring_poll_remove(tinfo->recv_ring,
+				       URING_DATA(gen, URING_POLLOUT, socket));
+		perf_uring_submit(tinfo->recv_ring);
+		return;
+	}
+#endif
+	perf_os_events_remove(tinfo->events, tinfo->socks[socket], socket);
+}
 
-	wait_for_start();
-	now = get_time();
-	while (!interrupted && now < times->stop_time) {
-		/* Avoid flooding the network too quickly. */
-		if (stats->num_sent < tinfo->max_outstanding &&
-		    stats->num_sent % 2 == 1)
-		{
-			if (stats->num_completed == 0)
-				usleep(1000);
-			else
-				sleep(0);
-			now = get_time();
-		}
+/*
+ * Keeps the set of open connections, from which the sender picks, in
+ * step with a connection's state, so that finding one does not mean
+ * looking through every connection.  Called with the lock held.
+ */
+static void
+update_open_set(threadinfo_t *tinfo, unsigned int socket)
+{
+	unsigned int index, last;
 
-		/* Rate limiting */
-		if (tinfo->max_qps > 0) {
-			run_time = now - times->start_time;
-			req_time = (MILLION * stats->num_sent) /
-				   tinfo->max_qps;
-			if (req_time > run_time) {
-				usleep(req_time - run_time);
-				now = get_time();
-				continue;
-			}
+	index = tinfo->open_index[socket];
+	if (tinfo->tcp_conn_state[socket] == TCP_OPEN) {
+		if (index == UINT_MAX) {
+			tinfo->open_index[socket] = tinfo->nopen;
+			tinfo->open_socks[tinfo->nopen++] = socket;
 		}
+	} else if (index != UINT_MAX) {
+		last = tinfo->open_socks[--tinfo->nopen];
+		tinfo->open_socks[index] = last;
+		tinfo->open_index[last] = index;
+		tinfo->open_index[socket] = UINT_MAX;
+	}
+}
 
-		LOCK(&tinfo->lock);
+/*
+ * Called with the lock held whenever a connection changes state.  A slot
+ * left without an open connection promotes its standby one, if it has
+ * one ready; the time a slot spends with nothing usable is totted up.
+ * An idle connection is simply open once it is ready.
+ */
+static void
+update_tcp_slot(threadinfo_t *tinfo, unsigned int socket)
+{
+	unsigned int slot, i;
+	isc_boolean_t usable;
+	isc_uint64_t now;
 
-		/* Limit in-flight queries */
-		if (num_outstanding(stats) >= tinfo->max_outstanding) {
-			TIMEDWAIT(&tinfo->cond, &tinfo->lock,
-				  &times->stop_time_ns, NULL);
-			UNLOCK(&tinfo->lock);
-			now = get_time();
-			continue;
+	if (socket >= tinfo->nactive) {
+		if (tinfo->tcp_conn_state[socket] == TCP_STANDBY)
+			tinfo->tcp_conn_state[socket] = TCP_OPEN;
+		return;
+	}
+
+	slot = socket % tinfo->nslots;
+	usable = ISC_FALSE;
+	for (i = slot; i < tinfo->nactive; i += tinfo->nslots) {
+		if (tinfo->tcp_conn_state[i] == TCP_OPEN)
+			usable = ISC_TRUE;
+	}
+	for (i = slot; !usable && i < tinfo->nactive; i += tinfo->nslots) {
+		if (tinfo->tcp_conn_state[i] == TCP_STANDBY) {
+			tinfo->tcp_conn_state[i] = TCP_OPEN;
+			usable = ISC_TRUE;
 		}
+	}
+	for (i = slot; i < tinfo->nactive; i += tinfo->nslots)
+		update_open_set(tinfo, i);
 
-		UNLOCK(&tinfo->lock);
+	if (!usable && tinfo->slot_down_since[slot] == 0) {
+		tinfo->slot_down_since[slot] = get_time();
+	} else if (usable && tinfo->slot_down_since[slot] != 0) {
+		now = get_time();
+		tinfo->stats.tcp_downtime +=
+			now - tinfo->slot_down_since[slot];
+		tinfo->slot_down_since[slot] = 0;
+	}
+}
 
-		socknum = tinfo->current_sock++ % tinfo->nsocks;
-		if (tinfo->config->usetcp == ISC_TRUE && 
-		    !find_working_tcp_connection(&socknum, tinfo)) {
-			now = get_time();
-			continue;
-		}
+/*
+ * Lets the receiver have the connection the sender was using back; it is
+ * asked to look at it again if it was lost in the meantime.
+ */
+static void
+release_tcp_connection(threadinfo_t *tinfo)
+{
+	if (tinfo->send_sock == -1)
+		return;
+	LOCK(&tinfo->lock);
+	if (TCP_CONN_LOST(tinfo->tcp_conn_state[tinfo->send_sock]))
+		watch_writable(tinfo, tinfo->send_sock, ISC_TRUE);
+	tinfo->send_sock = -1;
+	UNLOCK(&tinfo->lock);
+}
 
-		LOCK(&tinfo->lock);
+/*
+ * The client, of those of the thread, which sends the name with this
+ * hash.  The input is sharded on the same hash, so the part of it which
+ * picked the thread is left out.
+ */
+static inline unsigned int
+pin_client(const threadinfo_t *tinfo, isc_uint32_t hash)
+{
+	return (hash / tinfo->config->threads) % tinfo->nslots;
+}
 
-		q = ISC_LIST_HEAD(tinfo->unused_queries);
-		query_move(tinfo, q, prepend_outstanding);
-		q->timestamp = ISC_UINT64_MAX;
-		q->sock = tinfo->socks[socknum];
+/*
+ * Picks the next open connection in turn, and stores it in *socknum.
+ * The receiver will not close it until the sender releases it, so that
+ * its descriptor cannot be reused for a new connection part way through
+ * a batch.
+ */
+static isc_boolean_t
+find_working_tcp_connection(int *socknum, threadinfo_t *tinfo) 
+{
+	isc_boolean_t found = ISC_FALSE;
 
-		UNLOCK(&tinfo->lock);
+	release_tcp_connection(tinfo);
+	LOCK(&tinfo->lock);
+	if (tinfo->nopen > 0) {
+		*socknum = tinfo->open_socks[tinfo->open_next++ %
+					     tinfo->nopen];
+		tinfo->send_sock = *socknum;
+		found = ISC_TRUE;
+	}
+	UNLOCK(&tinfo->lock);
+	return found;
+}
 
-		isc_buffer_clear(&lines);
-		result = perf_datafile_next(input, &lines, config->updates);
-		if (result != ISC_R_SUCCESS) {
-			if (result == ISC_R_INVALIDFILE)
-				perf_log_fatal("input file contains no data");
+/*
+ * Finds the open connection of the client with the name hash 'hash', as
+ * find_working_tcp_connection() does, for each name to be sent by only
+ * one client.  The thread's share of the hash goes to pick the thread.
+ */
+static isc_boolean_t
+find_pinned_tcp_connection(int *socknum, threadinfo_t *tinfo,
+			   isc_uint32_t hash)
+{
+	isc_boolean_t found = ISC_FALSE;
+	unsigned int i;
+
+	release_tcp_connection(tinfo);
+	LOCK(&tinfo->lock);
+	for (i = pin_client(tinfo, hash); i < tinfo->nactive;
+	     i += tinfo->nslots)
+	{
+		if (tinfo->tcp_conn_state[i] == TCP_OPEN) {
+			*socknum = i;
+			tinfo->send_sock = i;
+			found = ISC_TRUE;
 			break;
 		}
+	}
+	UNLOCK(&tinfo->lock);
+	return found;
+}
 
-		qid = q - tinfo->queries;
-		isc_buffer_usedregion(&lines, &used);
-		isc_buffer_clear(&msg);
-		result = perf_dns_buildrequest(tinfo->dnsctx,
-					       (isc_textregion_t *) &used,
-					       qid, config->edns,
-					       config->dnssec, config->tsigkey,
-					       &msg);
-		if (result != ISC_R_SUCCESS) {
-			LOCK(&tinfo->lock);
-			query_move(tinfo, q, prepend_unused);
-			UNLOCK(&tinfo->lock);
-			now = get_time();
+#ifdef HAVE_LINUX_IO_URING_H
+/* The datagrams queued on the uring engine from one half of a batch. */
+typedef struct {
+	unsigned int queued;
+	unsigned int done;		/* ... how many have completed */
+	unsigned int failed;		/* ... the first which failed */
+	int error;
+	isc_uint64_t when;		/* ... and when they were sent */
+} send_flight_t;
+#endif
+
+/*
+ * Queries that have been built but not yet handed to the kernel.  All
+ * queries in a batch go out on the same socket, so a full batch costs a
+ * single sendmmsg() where that is available, or a single writev() on a
+ * TCP connection.  TCP queries are built with their length prefix in
+ * place, so each slot can be written out as it is.
+ *
+ * The uring engine does not wait for datagrams to be sent: it has two
+ * sets of buffers, and the arrays point to the half being filled while
+ * the kernel sends from the other.
+ */
+typedef struct {
+	unsigned int count;
+	unsigned int size;
+	unsigned int nhalves;
+	unsigned int bytes;
+	int socknum;
+	isc_uint64_t deadline;		/* when to stop waiting for room */
+	query_info **queries;
+	unsigned char *packets;
+	unsigned int *lengths;
+	struct iovec *iovs;
+#ifdef SEND_MSGHDRS
+	struct mmsghdr *msgs;
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+	struct msghdr stream_msg;
+	unsigned int half;
+	send_flight_t flights[2];
+#endif
+#ifdef HAVE_LIBSSL
+	unsigned char *tls_buf;
+#endif
+} send_batch_t;
+
+static void
+send_batch_init(send_batch_t *batch, const config_t *config)
+{
+	unsigned int i, n;
+
+	memset(batch, 0, sizeof(*batch));
+	batch->size = config->send_batch;
+	batch->nhalves = 1;
+#ifdef HAVE_LINUX_IO_URING_H
+	if (config->uring && config->usetcp != ISC_TRUE)
+		batch->nhalves = 2;
+#endif
+	n = batch->nhalves * batch->size;
+
+	batch->queries = isc_mem_get(mctx, n * sizeof(query_info *));
+	batch->packets = isc_mem_get(mctx, n * SEND_SLOT_SIZE);
+	batch->lengths = isc_mem_get(mctx, n * sizeof(unsigned int));
+	batch->iovs = isc_mem_get(mctx, n * sizeof(struct iovec));
+	if (batch->queries == NULL || batch->packets == NULL ||
+	    batch->lengths == NULL || batch->iovs == NULL)
+		perf_log_fatal("out of memory");
+	for (i = 0; i < n; i++)
+		batch->iovs[i].iov_base = batch->packets + i * SEND_SLOT_SIZE;
+
+#ifdef SEND_MSGHDRS
+	batch->msgs = isc_mem_get(mctx, n * sizeof(struct mmsghdr));
+	if (batch->msgs == NULL)
+		perf_log_fatal("out of memory");
+	memset(batch->msgs, 0, n * sizeof(struct mmsghdr));
+	for (i = 0; i < n; i++) {
+		batch->msgs[i].msg_hdr.msg_name =
+			(void *)&config->server_addr.type.sa;
+		batch->msgs[i].msg_hdr.msg_namelen =
+			config->server_addr.length;
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+	batch->stream_msg.msg_iov = batch->iovs;
+#endif
+#ifdef HAVE_LIBSSL
+	if (config->usetls) {
+		batch->tls_buf = isc_mem_get(mctx, batch->size * SEND_SLOT_SIZE);
+		if (batch->tls_buf == NULL)
+			perf_log_fatal("out of memory");
+	}
+#endif
+}
+
+#ifdef HAVE_LINUX_IO_URING_H
+/* Points the batch's arrays at one half of its buffers. */
+static void
+send_batch_sethalf(send_batch_t *batch, unsigned int half)
+{
+	int offset;
+
+	offset = ((int)half - (int)batch->half) * (int)batch->size;
+	batch->queries += offset;
+	batch->packets += offset * SEND_SLOT_SIZE;
+	batch->lengths += offset;
+	batch->iovs += offset;
+	batch->msgs += offset;
+	batch->half = half;
+}
+#endif
+
+static void
+send_batch_cleanup(send_batch_t *batch)
+{
+	unsigned int n;
+
+#ifdef HAVE_LINUX_IO_URING_H
+	send_batch_sethalf(batch, 0);
+#endif
+	n = batch->nhalves * batch->size;
+	isc_mem_put(mctx, batch->queries, n * sizeof(query_info *));
+	isc_mem_put(mctx, batch->packets, n * SEND_SLOT_SIZE);
+	isc_mem_put(mctx, batch->lengths, n * sizeof(unsigned int));
+	isc_mem_put(mctx, batch->iovs, n * sizeof(struct iovec));
+#ifdef SEND_MSGHDRS
+	isc_mem_put(mctx, batch->msgs, n * sizeof(struct mmsghdr));
+#endif
+#ifdef HAVE_LIBSSL
+	if (batch->tls_buf != NULL)
+		isc_mem_put(mctx, batch->tls_buf, batch->size * SEND_SLOT_SIZE);
+#endif
+}
+
+/*
+ * Each of these hands the batch to the kernel and returns how many of its
+ * queries, from the start, were sent; errno describes the first failure.
+ */
+static unsigned int
+send_batch_syscalls(threadinfo_t *tinfo, send_batch_t *batch, int sock)
+{
+	const config_t *config;
+	unsigned char *base;
+	unsigned int nsent;
+	int n;
+
+	config = tinfo->config;
+	nsent = 0;
+	while (nsent < batch->count) {
+#ifdef HAVE_SENDMMSG
+		if (batch->count - nsent > 1) {
+			n = sendmmsg(sock, &batch->msgs[nsent],
+				     batch->count - nsent, 0);
+			if (n <= 0)
+				break;
+			nsent += n;
 			continue;
 		}
+#endif
+		base = batch->packets + nsent * SEND_SLOT_SIZE;
+		n = sendto(sock, base, batch->lengths[nsent], 0,
+			   &config->server_addr.type.sa,
+			   config->server_addr.length);
+		if (n < 0 || (unsigned int) n != batch->lengths[nsent])
+			break;
+		nsent++;
+	}
+	return nsent;
+}
+
+/*
+ * Waits for a connection that a batch is being written to to take more
+ * or, with 'readable', for the data a TLS write is waiting on.  A server
+ * which stops reading must not hold the sender, and with it the
+ * connection, beyond the end of the run or the queries' timeout, so
+ * this returns ISC_FALSE, with errno set to ETIMEDOUT, once 'deadline'
+ * has passed, or when the run is interrupted.
+ */
+static isc_boolean_t
+wait_to_send(int sock, isc_boolean_t readable, isc_uint64_t deadline)
+{
+	isc_uint64_t now, timeout;
+
+	if (interrupted)
+		return ISC_FALSE;
+	now = get_time();
+	if (now >= deadline) {
+		errno = ETIMEDOUT;
+		return ISC_FALSE;
+	}
+	timeout = deadline - now;
+	if (timeout > TIMEOUT_CHECK_TIME)
+		timeout = TIMEOUT_CHECK_TIME;
+	if (readable)
+		perf_os_waituntilreadable(sock, -1, timeout);
+	else
+		perf_os_waituntilwriteable(sock, timeout);
+	return ISC_TRUE;
+}
 
-		if (tinfo->config->usetcp == ISC_TRUE){
-			/* TODO: Better to use writev for TCP instead
-			   tcp needs two bytes for dns payload length */
-			memmove(msg.base + 2, msg.base, msg.used);
-			uint8_t * my_pointer = (uint8_t *) msg.base;
-			my_pointer[0] = 0x00;
-			my_pointer[1] = msg.used;
-			msg.used += 2;
+/*
+ * Writes the batch to a TCP connection as one stream of framed queries,
+ * starting 'written' bytes in, and waits for room whenever the socket
+ * buffer fills so that a query is never left half sent, until the
+ * batch's deadline.  Queries not completely written by then are failed.
+ */
+static unsigned int
+send_batch_stream(send_batch_t *batch, int sock, size_t written)
+{
+	struct iovec saved;
+	size_t offset;
+	unsigned int i, nsent;
+	ssize_t n;
+
+	for (;;) {
+		/* Find the first query not completely written. */
+		offset = 0;
+		for (i = 0; i < batch->count; i++) {
+			if (written < offset + batch->lengths[i])
+				break;
+			offset += batch->lengths[i];
 		}
+		if (i == batch->count)
+			return batch->count;
+		nsent = i;
+
+		saved = batch->iovs[i];
+		batch->iovs[i].iov_base = (unsigned char *)saved.iov_base +
+					  (written - offset);
+		batch->iovs[i].iov_len = saved.iov_len - (written - offset);
+		n = writev(sock, &batch->iovs[i], batch->count - i);
+		batch->iovs[i] = saved;
+
+		if (n > 0) {
+			written += n;
+		} else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+				     errno == EINPROGRESS) &&
+			   wait_to_send(sock, ISC_FALSE, batch->deadline))
+		{
+			/* EINPROGRESS: a Fast Open SYN went out without data. */
+			continue;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else {
+			return nsent;
+		}
+	}
+}
 
-		base = isc_buffer_base(&msg);
-		length = isc_buffer_usedlength(&msg);
+#ifdef HAVE_LIBSSL
+/*
+ * Writes the batch to a TLS session.  The queries are gathered first, so
+ * that they share as few records as possible; like send_batch_stream(),
+ * this waits for room rather than leave a query half sent, until the
+ * batch's deadline.  A write may also wait for something from the
+ * server, such as a key update, to be read first.
+ */
+static unsigned int
+send_batch_tls(threadinfo_t *tinfo, send_batch_t *batch, int socknum)
+{
+	size_t len, written, offset, early;
+	unsigned int i, nsent, status;
+	ssize_t n;
+
+	len = 0;
+	for (i = 0; i < batch->count; i++) {
+		memcpy(batch->tls_buf + len, batch->iovs[i].iov_base,
+		       batch->lengths[i]);
+		len += batch->lengths[i];
+	}
 
-		now = get_time();
-		if (config->verbose) {
-			q->desc = strdup(lines.base);
-			if (q->desc == NULL)
-				perf_log_fatal("out of memory");
+	early = perf_tls_early_sent(tinfo->tls[socknum]);
+	written = 0;
+	while (written < len) {
+		n = perf_tls_write(tinfo->tls[socknum],
+				   batch->tls_buf + written, len - written);
+		if (n > 0) {
+			written += n;
+		} else if (n < 0 && errno == EAGAIN) {
+			/* Wait in whichever direction OpenSSL is waiting on. */
+			status = perf_tls_status(tinfo->tls[socknum]);
+			if (!wait_to_send(tinfo->socks[socknum],
+					  ISC_TF((status &
+						  PERF_TLS_WRITE_WANTS_READ) != 0),
+					  batch->deadline))
+				break;
+		} else if (n < 0 && errno == EINTR) {
+			continue;
+		} else {
+			break;
 		}
-		q->timestamp = now;
-		n = sendto(q->sock, base, length, 0,
-			   &config->server_addr.type.sa,
-			   config->server_addr.length);
-		if (n < 0 || (unsigned int) n != length) {
-			perf_log_warning("failed to send packet: %s",
-					 strerror(errno));
-			LOCK(&tinfo->lock);
+	}
+
+	/* Note which queries went out in early data, in case it is rejected. */
+	early = perf_tls_early_sent(tinfo->tls[socknum]) - early;
+	offset = 0;
+	LOCK(&tinfo->lock);
+	for (nsent = 0; nsent < batch->count; nsent++) {
+		offset += batch->lengths[nsent];
+		if (offset > written)
+			break;
+		batch->queries[nsent]->early = ISC_TF(offset <= early);
+	}
+	UNLOCK(&tinfo->lock);
+	return nsent;
+}
+#endif
+
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+/*
+ * Makes each query in the batch a request of its own, then writes them
+ * out together.  The queries are built for TCP, so the length prefix is
+ * skipped.  If they cannot all be written out by the batch's deadline,
+ * the whole batch fails.
+ */
+static unsigned int
+send_batch_doh(threadinfo_t *tinfo, send_batch_t *batch, int socknum)
+{
+	perf_doh_t *doh = tinfo->doh[socknum];
+	isc_result_t result;
+	unsigned int nsent, status;
+
+	for (nsent = 0; nsent < batch->count; nsent++) {
+		if (perf_doh_submit(doh,
+				    (unsigned char *)batch->iovs[nsent].iov_base
+				    + 2, batch->lengths[nsent] - 2) !=
+		    ISC_R_SUCCESS)
+			break;
+	}
+	for (;;) {
+		result = perf_doh_flush(doh);
+		if (result != ISC_R_WOULDBLOCK)
+			break;
+		status = perf_tls_status(tinfo->tls[socknum]);
+		if (!wait_to_send(tinfo->socks[socknum],
+				  ISC_TF((status &
+					  PERF_TLS_WRITE_WANTS_READ) != 0),
+				  batch->deadline))
+			return 0;
+	}
+	if (result != ISC_R_SUCCESS) {
+		errno = EPIPE;
+		return 0;
+	}
+	if (nsent < batch->count)
+		errno = EPROTO;
+	return nsent;
+}
+#endif
+
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+/*
+ * Puts each query in the batch on a stream of its own.  DNS over QUIC
+ * keeps the length prefix used on TCP.  Queries beyond the connection's
+ * stream limit are queued on it, and go out as earlier ones are
+ * answered.
+ */
+static unsigned int
+send_batch_doq(threadinfo_t *tinfo, send_batch_t *batch, int socknum)
+{
+	unsigned int i;
+
+	for (i = 0; i < batch->count; i++)
+		perf_doq_submit(tinfo->doq[socknum],
+				batch->iovs[i].iov_base, batch->lengths[i]);
+	return batch->count;
+}
+#endif
+
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * Undoes the sends of a half of the batch which the kernel failed, once
+ * all of its completions are in: the queries are returned to the unused
+ * list, unless they have timed out in the meantime, and are no longer
+ * counted as sent.
+ */
+static void
+uring_sends_settle(threadinfo_t *tinfo, send_batch_t *batch,
+		   unsigned int half)
+{
+	send_flight_t *flight = &batch->flights[half];
+	stats_t *stats = &tinfo->stats;
+	query_info **queries;
+	unsigned int *lengths;
+	unsigned int i;
+	int offset;
+
+	if (flight->failed < flight->queued) {
+		perf_log_warning("failed to send packet: %s",
+				 strerror(flight->error));
+		offset = ((int)half - (int)batch->half) * (int)batch->size;
+		queries = batch->queries + offset;
+		lengths = batch->lengths + offset;
+		LOCK(&tinfo->lock);
+		for (i = flight->failed; i < flight->queued; i++) {
+			query_info *q = queries[i];
+
+			if (q->list != &tinfo->outstanding_queries ||
+			    q->timestamp != flight->when)
+				continue;
 			query_move(tinfo, q, prepend_unused);
-			UNLOCK(&tinfo->lock);
+			if (q->desc != NULL) {
+				free(q->desc);
+				q->desc = NULL;
+			}
+			stats->num_sent--;
+			stats->total_request_size -= lengths[i];
+		}
+		UNLOCK(&tinfo->lock);
+	}
+	flight->queued = 0;
+	flight->done = 0;
+}
+
+/*
+ * Takes in send completions, for either half of the batch, until every
+ * send from this half has completed; usually they all have, and no
+ * system call is needed.
+ */
+static void
+uring_reap_sends(threadinfo_t *tinfo, send_batch_t *batch, unsigned int half)
+{
+	perf_uring_cqe_t cqe;
+	send_flight_t *flight;
+	unsigned int i, length;
+
+	while (batch->flights[half].done < batch->flights[half].queued) {
+		if (!perf_uring_peek(tinfo->send_ring, &cqe)) {
+			perf_uring_wait(tinfo->send_ring,
+					batch->flights[half].queued -
+					batch->flights[half].done, -1);
 			continue;
 		}
+		flight = &batch->flights[URING_GEN(cqe.data)];
+		i = URING_SOCKET(cqe.data);
+		length = batch->lengths[((int)URING_GEN(cqe.data) -
+					 (int)batch->half) *
+					(int)batch->size + (int)i];
+		/* Sends after a failed one are cancelled. */
+		if ((cqe.res < 0 || (unsigned int)cqe.res != length) &&
+		    i < flight->failed)
+		{
+			flight->failed = i;
+			flight->error = cqe.res < 0 ? -cqe.res : EMSGSIZE;
+		}
+		flight->done++;
+		perf_uring_seen(tinfo->send_ring);
+	}
+	uring_sends_settle(tinfo, batch, half);
+}
 
-		if (tinfo->config->usetcp == ISC_TRUE) {
-			LOCK(&tinfo->lock);
-			tinfo->sock_num_sent[socknum]++;
-			if (tinfo->config->max_tcp_q != 0 &&  /* A limit is set */
-				tinfo->sock_num_sent[socknum] !=0 &&
-				tinfo->sock_num_sent[socknum] == tinfo->config->max_tcp_q) {
-				tinfo->tcp_conn_state[socknum] = TCP_SENT_MAX;
-			}
-			UNLOCK(&tinfo->lock);
+/*
+ * The sends are linked so that they go out in order and stop at the
+ * first failure, as a single sendmmsg() would.  Datagrams are counted as
+ * sent as soon as they are queued: their buffers are left alone until the
+ * batch comes back to this half, and any failure is dealt with then.  A
+ * connection must know how much of its stream was written, so waits.
+ */
+static unsigned int
+send_batch_uring(threadinfo_t *tinfo, send_batch_t *batch, int sock)
+{
+	perf_uring_cqe_t cqe;
+	send_flight_t *flight;
+	unsigned int i;
+
+	/* A connection takes the whole batch in one gathered write. */
+	if (tinfo->config->usetcp == ISC_TRUE) {
+		batch->stream_msg.msg_iovlen = batch->count;
+		perf_uring_sendmsg(tinfo->send_ring, sock, &batch->stream_msg,
+				   ISC_FALSE, URING_DATA(0, URING_SEND, 0));
+		while (perf_uring_wait(tinfo->send_ring, 1, -1) !=
+		       ISC_R_SUCCESS)
+			;
+		perf_uring_peek(tinfo->send_ring, &cqe);
+		perf_uring_seen(tinfo->send_ring);
+		if (cqe.res == -EINPROGRESS || cqe.res == -EAGAIN)
+			return send_batch_stream(batch, sock, 0);
+		if (cqe.res < 0) {
+			errno = -cqe.res;
+			return 0;
 		}
-		stats->num_sent++;
-		stats->total_request_size += length;
+		return send_batch_stream(batch, sock, cqe.res);
 	}
-	tinfo->done_send_time = get_time();
-	tinfo->done_sending = ISC_TRUE;
-	write(mainpipe[1], "", 1);
-	return NULL;
+
+	for (i = 0; i < batch->count; i++)
+		perf_uring_sendmsg(tinfo->send_ring, sock,
+				   &batch->msgs[i].msg_hdr,
+				   ISC_TF(i + 1 < batch->count),
+				   URING_DATA(batch->half, URING_SEND, i));
+	perf_uring_submit(tinfo->send_ring);
+
+	flight = &batch->flights[batch->half];
+	flight->queued = batch->count;
+	flight->done = 0;
+	flight->failed = batch->count;
+	flight->error = 0;
+	flight->when = batch->queries[0]->timestamp;
+	return batch->count;
 }
+#endif
 
+/*
+ * Timestamps and sends every query in the batch.  Queries which could not
+ * be sent are returned to the unused list; the rest are counted as sent.
+ */
 static void
-process_timeouts(threadinfo_t *tinfo, isc_uint64_t now)
+send_batch_flush(threadinfo_t *tinfo, send_batch_t *batch)
 {
-	struct query_info *q;
 	const config_t *config;
+	stats_t *stats;
+	isc_uint64_t now;
+	unsigned int i, nsent;
+	int sock, socknum;
 
-	config = tinfo->config;
-
-	/* Avoid locking unless we need to. */
-	q = ISC_LIST_TAIL(tinfo->outstanding_queries);
-	if (q == NULL || q->timestamp > now ||
-	    now - q->timestamp < config->timeout)
+	if (batch->count == 0) {
+		release_tcp_connection(tinfo);
 		return;
+	}
 
-	LOCK(&tinfo->lock);
+	config = tinfo->config;
+	stats = &tinfo->stats;
+	socknum = batch->socknum;
+	sock = tinfo->socks[socknum];
 
-	do {
-		query_move(tinfo, q, append_unused);
+	now = get_time();
+	for (i = 0; i < batch->count; i++)
+		batch->queries[i]->timestamp = now;
+	batch->deadline = now + config->timeout;
+	if (batch->deadline > tinfo->times->stop_time)
+		batch->deadline = tinfo->times->stop_time;
+
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+	if (config->usedoh)
+		nsent = send_batch_doh(tinfo, batch, socknum);
+	else
+#endif
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+	if (config->usedoq)
+		nsent = send_batch_doq(tinfo, batch, socknum);
+	else
+#endif
+#ifdef HAVE_LIBSSL
+	/* With kTLS, the kernel encrypts whatever is written to the socket. */
+	if (config->usetls &&
+	    (perf_tls_status(tinfo->tls[socknum]) & PERF_TLS_KTLS_SEND) == 0)
+		nsent = send_batch_tls(tinfo, batch, socknum);
+	else
+#endif
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tinfo->send_ring != NULL)
+		nsent = send_batch_uring(tinfo, batch, sock);
+	else
+#endif
+	if (config->usetcp == ISC_TRUE)
+		nsent = send_batch_stream(batch, sock, 0);
+	else
+		nsent = send_batch_syscalls(tinfo, batch, sock);
 
-		tinfo->stats.num_timedout++;
+	if (nsent < batch->count) {
+		/* Connections closed by the server are counted instead. */
+		if (config->usetcp != ISC_TRUE ||
+		    (errno != EPIPE && errno != ECONNRESET))
+			perf_log_warning("failed to send packet: %s",
+					 strerror(errno));
+		LOCK(&tinfo->lock);
+		for (i = nsent; i < batch->count; i++) {
+			query_info *q = batch->queries[i];
 
-		if (q->desc != NULL) {
-			perf_log_printf("> T %s", q->desc);
-		} else {
-			perf_log_printf("[Timeout] %s timed out: msg id %u",
-					config->updates ? "Update" : "Query",
-					(unsigned int)(q - tinfo->queries));
+			query_move(tinfo, q, prepend_unused);
+			if (q->desc != NULL) {
+				free(q->desc);
+				q->desc = NULL;
+			}
 		}
-		q = ISC_LIST_TAIL(tinfo->outstanding_queries);
-	} while (q != NULL && q->timestamp < now &&
-		 now - q->timestamp >= config->timeout);
+		UNLOCK(&tinfo->lock);
+	}
 
-	UNLOCK(&tinfo->lock);
+	if (config->usetcp == ISC_TRUE) {
+		LOCK(&tinfo->lock);
+		tinfo->sock_num_sent[socknum] += nsent;
+		if (nsent < batch->count) {
+			/* The stream is broken; the receiver will reconnect. */
+			tinfo->tcp_conn_state[socknum] = TCP_ERROR;
+			update_tcp_slot(tinfo, socknum);
+		} else if (config->max_tcp_q != 0 &&  /* A limit is set */
+		    tinfo->sock_num_sent[socknum] >= config->max_tcp_q) {
+			tinfo->tcp_conn_state[socknum] = TCP_DRAINING;
+			update_tcp_slot(tinfo, socknum);
+			/*
+			 * Every response may already have arrived, so have
+			 * the receiver look at the connection again.
+			 */
+			watch_writable(tinfo, socknum, ISC_TRUE);
+		}
+		UNLOCK(&tinfo->lock);
+	}
+
+	for (i = 0; i < nsent; i++)
+		stats->total_request_size += batch->lengths[i];
+	stats->num_sent += nsent;
+	batch->count = 0;
+	batch->bytes = 0;
+#ifdef HAVE_LINUX_IO_URING_H
+	/* Fill the other half while these are sent. */
+	if (batch->nhalves > 1) {
+		send_batch_sethalf(batch, batch->half ^ 1);
+		uring_reap_sends(tinfo, batch, batch->half);
+	}
+#endif
+	release_tcp_connection(tinfo);
 }
 
-typedef struct {
-	int sock;
-	isc_uint16_t qid;
-	isc_uint16_t rcode;
-	unsigned int size;
+static void
+record_batch_init(record_batch_t *records)
+{
+	isc_buffer_init(&records->lines, records->data,
+			sizeof(records->data));
+	records->count = 0;
+	records->next = 0;
+}
+
+/*
+ * Returns the thread's next input record, and the hash of its name when
+ * the input is sharded by name.
+ */
+static isc_result_t
+next_record(threadinfo_t *tinfo, record_batch_t *records,
+	    isc_region_t *record, isc_uint32_t *hashp)
+{
+	const config_t *config = tinfo->config;
+	isc_result_t result;
+
+	if (records->next == records->count) {
+		isc_buffer_clear(&records->lines);
+		records->count = INPUT_BATCH_SIZE;
+		if (config->shard != perf_shard_none)
+			result = perf_datafile_nextshard(input,
+							 tinfo - threads,
+							 &records->lines,
+							 records->records,
+							 records->hashes,
+							 &records->count);
+		else
+			result = perf_datafile_nextbatch(input,
+							 &records->lines,
+							 records->records,
+							 &records->count,
+							 config->updates);
+		if (result != ISC_R_SUCCESS) {
+			if (result == ISC_R_INVALIDFILE)
+				perf_log_fatal("input file contains no data");
+			return result;
+		}
+		records->next = 0;
+	}
+	*hashp = config->shard != perf_shard_none ?
+		 records->hashes[records->next] : 0;
+	*record = records->records[records->next++];
+	return ISC_R_SUCCESS;
+}
+
+static isc_result_t
+build_record(threadinfo_t *tinfo, const isc_region_t *record,
+	     isc_uint16_t qid, isc_buffer_t *msg)
+{
+	const config_t *config = tinfo->config;
+
+	if (config->compiled)
+		return perf_dns_copyrequest(record, qid, config->edns,
+					    config->dnssec, config->tsigkey,
+					    msg);
+	return perf_dns_buildrequest(tinfo->dnsctx,
+				     (const isc_textregion_t *)record, qid,
+				     config->edns, config->dnssec,
+				     config->tsigkey, msg);
+}
+
+static char *
+describe_record(const config_t *config, const isc_region_t *record)
+{
+	char buf[DNS_NAME_FORMATSIZE + DNS_RDATATYPE_FORMATSIZE];
+	char *desc;
+
+	if (config->compiled) {
+		perf_dns_describe(record, buf, sizeof(buf));
+		desc = strdup(buf);
+	} else {
+		desc = strdup((const char *)record->base);
+	}
+	if (desc == NULL)
+		perf_log_fatal("out of memory");
+	return desc;
+}
+
+static inline isc_boolean_t
+ring_empty(threadinfo_t *tinfo)
+{
+	return ISC_TF(__atomic_load_n(&tinfo->ring_tail, __ATOMIC_ACQUIRE) ==
+		      tinfo->ring_head);
+}
+
+/*
+ * Moves the oldest query in the ring, which must not be empty, into the
+ * message, giving it the ID of 'q'.
+ */
+static void
+take_built_query(threadinfo_t *tinfo, query_info *q, isc_buffer_t *msg)
+{
+	built_query_t *built;
+	unsigned char *base;
+	unsigned int head;
+
+	head = tinfo->ring_head;
+	built = &tinfo->ring[head % BUILD_RING_SIZE];
+	tinfo->stats.ring_fill_sum += __atomic_load_n(&tinfo->ring_tail,
+						      __ATOMIC_ACQUIRE) - head;
+	tinfo->stats.num_ring_taken++;
+
+	base = isc_buffer_used(msg);
+	isc_buffer_putmem(msg, built->data, built->length);
+	base[0] = (q->qid >> 8) & 0xff;
+	base[1] = q->qid & 0xff;
+	q->desc = built->desc;
+	built->desc = NULL;
+
+	__atomic_store_n(&tinfo->ring_head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Builds queries ahead of the sender, with ID 0 for the sender to
+ * replace.  A TSIG record signed here remains valid, since it carries
+ * the ID it was signed with.
+ */
+static void *
+do_build(void *arg)
+{
+	threadinfo_t *tinfo;
+	const config_t *config;
+	const times_t *times;
+	unsigned int max_packet_size, tail;
+	record_batch_t records;
+	isc_region_t record;
+	isc_uint32_t hash;
+	isc_buffer_t msg;
+	built_query_t *built;
+
+	tinfo = arg;
+	config = tinfo->config;
+	times = tinfo->times;
+	max_packet_size = config->edns ? MAX_EDNS_PACKET : MAX_UDP_PACKET;
+	record_batch_init(&records);
+	tail = tinfo->ring_tail;
+
+	wait_for_start();
+	while (!interrupted &&
+	       !__atomic_load_n(&tinfo->build_stop, __ATOMIC_RELAXED) &&
+	       get_time() < times->stop_time)
+	{
+		if (tail - __atomic_load_n(&tinfo->ring_head,
+					   __ATOMIC_ACQUIRE) ==
+		    BUILD_RING_SIZE)
+		{
+			tinfo->stats.num_ring_full++;
+			usleep(100);
+			continue;
+		}
+
+		if (next_record(tinfo, &records, &record, &hash) !=
+		    ISC_R_SUCCESS)
+			break;
+		built = &tinfo->ring[tail % BUILD_RING_SIZE];
+		isc_buffer_init(&msg, built->data, max_packet_size);
+		if (build_record(tinfo, &record, 0, &msg) != ISC_R_SUCCESS)
+			continue;
+		built->length = isc_buffer_usedlength(&msg);
+		built->hash = hash;
+		if (config->verbose)
+			built->desc = describe_record(config, &record);
+
+		__atomic_store_n(&tinfo->ring_tail, ++tail, __ATOMIC_RELEASE);
+	}
+	__atomic_store_n(&tinfo->build_done, ISC_TRUE, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+static void *
+do_send(void *arg)
+{
+	threadinfo_t *tinfo;
+	const config_t *config;
+	const times_t *times;
+	stats_t *stats;
+	unsigned int max_packet_size;
+	isc_buffer_t msg;
+	isc_uint64_t now, run_time, req_time, num_queued;
+	record_batch_t records;
+	isc_region_t used;
+	isc_boolean_t have_record;
+	isc_uint32_t hash;
+	query_info *q;
+	send_batch_t batch;
+	unsigned char *slot;
+	isc_result_t result;
+	int socknum;
+	
+	tinfo = (threadinfo_t *) arg;
+	config = tinfo->config;
+	times = tinfo->times;
+	stats = &tinfo->stats;
+	max_packet_size = config->edns ? MAX_EDNS_PACKET : MAX_UDP_PACKET;
+	record_batch_init(&records);
+	have_record = ISC_FALSE;
+	send_batch_init(&batch, config);
+
+	wait_for_start();
+	now = get_time();
+	while (!interrupted && now < times->stop_time) {
+		/* Queries waiting in the batch count as sent for pacing. */
+		num_queued = stats->num_sent + batch.count;
+
+		/* Avoid flooding the network too quickly. */
+		if (num_queued < tinfo->max_outstanding &&
+		    num_queued % 2 == 1)
+		{
+			send_batch_flush(tinfo, &batch);
+			if (stats->num_completed == 0)
+				usleep(1000);
+			else
+				sleep(0);
+			now = get_time();
+		}
+
+		/* Rate limiting */
+		if (tinfo->max_qps > 0) {
+			run_time = now - times->start_time;
+			req_time = (MILLION * num_queued) /
+				   tinfo->max_qps;
+			if (req_time > run_time) {
+				send_batch_flush(tinfo, &batch);
+				usleep(req_time - run_time);
+				now = get_time();
+				continue;
+			}
+		}
+
+		LOCK(&tinfo->lock);
+
+		/* Limit in-flight queries */
+		if (num_outstanding(stats) + batch.count >=
+		    tinfo->max_outstanding)
+		{
+			if (batch.count > 0) {
+				UNLOCK(&tinfo->lock);
+				send_batch_flush(tinfo, &batch);
+				continue;
+			}
+			TIMEDWAIT(&tinfo->cond, &tinfo->lock,
+				  &times->stop_time_ns, NULL);
+			UNLOCK(&tinfo->lock);
+			now = get_time();
+			continue;
+		}
+
+		UNLOCK(&tinfo->lock);
+
+		/* Wait for the builder to have a query ready. */
+		if (tinfo->ring != NULL && ring_empty(tinfo)) {
+			if (__atomic_load_n(&tinfo->build_done,
+					    __ATOMIC_ACQUIRE) &&
+			    ring_empty(tinfo))
+				break;
+			stats->num_ring_empty++;
+			send_batch_flush(tinfo, &batch);
+			sleep(0);
+			now = get_time();
+			continue;
+		}
+
+		/*
+		 * The record is taken before the socket, which may depend on
+		 * its name, and kept until it is sent.
+		 */
+		if (tinfo->ring != NULL) {
+			hash = tinfo->ring[tinfo->ring_head %
+					   BUILD_RING_SIZE].hash;
+		} else if (!have_record) {
+			result = next_record(tinfo, &records, &used, &hash);
+			if (result != ISC_R_SUCCESS)
+				break;
+			have_record = ISC_TRUE;
+		}
+		if (config->shard_pin && batch.count > 0 &&
+		    batch.socknum % tinfo->nslots != pin_client(tinfo, hash))
+			send_batch_flush(tinfo, &batch);
+
+		if (batch.count == 0) {
+			if (config->shard_pin)
+				socknum = pin_client(tinfo, hash);
+			else
+				socknum = tinfo->current_sock++ %
+					  tinfo->nactive;
+			if (tinfo->config->usetcp == ISC_TRUE &&
+			    !(config->shard_pin ?
+			      find_pinned_tcp_connection(&socknum, tinfo,
+							 hash) :
+			      find_working_tcp_connection(&socknum, tinfo))) {
+				/* Every connection is busy or reconnecting. */
+				sleep(0);
+				now = get_time();
+				continue;
+			}
+			batch.socknum = socknum;
+		}
+
+		LOCK(&tinfo->lock);
+
+		/* Wait for one of the socket's query IDs to come free. */
+		if (tinfo->sock_outstanding[batch.socknum] >= NQIDS) {
+			UNLOCK(&tinfo->lock);
+			send_batch_flush(tinfo, &batch);
+			LOCK(&tinfo->lock);
+			if (tinfo->sock_outstanding[batch.socknum] >= NQIDS)
+				TIMEDWAIT(&tinfo->cond, &tinfo->lock,
+					  &times->stop_time_ns, NULL);
+			UNLOCK(&tinfo->lock);
+			now = get_time();
+			continue;
+		}
+
+		q = ISC_LIST_HEAD(tinfo->unused_queries);
+		q->socknum = batch.socknum;
+		q->qid = qid_next(tinfo, batch.socknum);
+		query_move(tinfo, q, prepend_outstanding);
+		q->timestamp = ISC_UINT64_MAX;
+		q->early = ISC_FALSE;
+
+		UNLOCK(&tinfo->lock);
+
+		slot = batch.packets + batch.count * SEND_SLOT_SIZE;
+		/* Leave room for the length prefix on TCP. */
+		if (config->usetcp == ISC_TRUE)
+			isc_buffer_init(&msg, slot + 2, max_packet_size);
+		else
+			isc_buffer_init(&msg, slot, max_packet_size);
+		if (tinfo->ring != NULL) {
+			take_built_query(tinfo, q, &msg);
+		} else {
+			have_record = ISC_FALSE;
+			result = build_record(tinfo, &used, q->qid, &msg);
+			if (result != ISC_R_SUCCESS) {
+				LOCK(&tinfo->lock);
+				query_move(tinfo, q, prepend_unused);
+				UNLOCK(&tinfo->lock);
+				now = get_time();
+				continue;
+			}
+			if (config->verbose)
+				q->desc = describe_record(config, &used);
+		}
+
+		batch.lengths[batch.count] = isc_buffer_usedlength(&msg);
+		if (config->usetcp == ISC_TRUE) {
+			slot[0] = (msg.used >> 8) & 0xff;
+			slot[1] = msg.used & 0xff;
+			batch.lengths[batch.count] += 2;
+		}
+
+		batch.queries[batch.count] = q;
+		batch.iovs[batch.count].iov_len = batch.lengths[batch.count];
+		batch.bytes += batch.lengths[batch.count];
+		batch.count++;
+		/*
+		 * Send the batch once it is full, or big enough, or holds
+		 * every query its connection may still carry.
+		 */
+		if (batch.count == batch.size ||
+		    (config->send_batch_bytes != 0 &&
+		     batch.bytes >= config->send_batch_bytes) ||
+		    (config->usetcp == ISC_TRUE && config->max_tcp_q != 0 &&
+		     tinfo->sock_num_sent[batch.socknum] + batch.count >=
+		     config->max_tcp_q))
+			send_batch_flush(tinfo, &batch);
+
+		now = get_time();
+	}
+	if (!interrupted)
+		send_batch_flush(tinfo, &batch);
+#ifdef HAVE_LINUX_IO_URING_H
+	if (batch.nhalves > 1)
+		uring_reap_sends(tinfo, &batch, batch.half ^ 1);
+#endif
+	release_tcp_connection(tinfo);
+	send_batch_cleanup(&batch);
+	tinfo->done_send_time = get_time();
+	tinfo->done_sending = ISC_TRUE;
+	write(mainpipe[1], "", 1);
+	return NULL;
+}
+
+typedef struct {
+	unsigned int socknum;
+	isc_uint16_t qid;
+	isc_uint16_t rcode;
+	unsigned int size;
 	isc_uint64_t when;
 	isc_uint64_t sent;
 	isc_boolean_t unexpected;
@@ -846,141 +2905,1217 @@ typedef struct {
 	char *desc;
 } received_query_t;
 
+/*
+ * Responses collected by one pass of the receiver, along with the
+ * buffers they were read into.
+ */
+typedef struct {
+	unsigned int size;
+	received_query_t *recvd;
+	unsigned char *packets;
+#ifdef HAVE_RECVMMSG
+	struct iovec *iovs;
+	struct mmsghdr *msgs;
+#endif
+} recv_batch_t;
+
+static void
+recv_batch_init(recv_batch_t *batch, const config_t *config)
+{
+	unsigned int i;
+
+	memset(batch, 0, sizeof(*batch));
+	batch->size = config->recv_batch;
+
+	batch->recvd = isc_mem_get(mctx,
+				   batch->size * sizeof(received_query_t));
+	batch->packets = isc_mem_get(mctx, batch->size * MAX_EDNS_PACKET);
+	if (batch->recvd == NULL || batch->packets == NULL)
+		perf_log_fatal("out of memory");
+
+#ifdef HAVE_RECVMMSG
+	batch->iovs = isc_mem_get(mctx, batch->size * sizeof(struct iovec));
+	batch->msgs = isc_mem_get(mctx, batch->size * sizeof(struct mmsghdr));
+	if (batch->iovs == NULL || batch->msgs == NULL)
+		perf_log_fatal("out of memory");
+	memset(batch->msgs, 0, batch->size * sizeof(struct mmsghdr));
+	for (i = 0; i < batch->size; i++) {
+		batch->iovs[i].iov_base = batch->packets + i * MAX_EDNS_PACKET;
+		batch->iovs[i].iov_len = MAX_EDNS_PACKET;
+		batch->msgs[i].msg_hdr.msg_iov = &batch->iovs[i];
+		batch->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+#else
+	(void)i;
+#endif
+}
+
+static void
+recv_batch_cleanup(recv_batch_t *batch)
+{
+	isc_mem_put(mctx, batch->recvd,
+		    batch->size * sizeof(received_query_t));
+	isc_mem_put(mctx, batch->packets, batch->size * MAX_EDNS_PACKET);
+#ifdef HAVE_RECVMMSG
+	isc_mem_put(mctx, batch->iovs, batch->size * sizeof(struct iovec));
+	isc_mem_put(mctx, batch->msgs, batch->size * sizeof(struct mmsghdr));
+#endif
+}
+
+static void
+parse_response(received_query_t *recvd, unsigned int socknum,
+	       unsigned char *packet_buffer, unsigned int n, isc_uint64_t now)
+{
+	isc_uint16_t *packet_header;
+
+	packet_header = (isc_uint16_t *) packet_buffer;
+
+	recvd->socknum = socknum;
+	recvd->qid = ntohs(packet_header[0]);
+	recvd->rcode = ntohs(packet_header[1]) & 0xF;
+	recvd->size = n;
+	recvd->when = now;
+	recvd->sent = 0;
+	recvd->unexpected = ISC_FALSE;
+	recvd->short_response = ISC_TF(n < 4);
+	recvd->desc = NULL;
+}
+
 static isc_boolean_t
 recv_one(threadinfo_t *tinfo, int which_sock,
 	 unsigned char *packet_buffer, unsigned int packet_size,
 	 received_query_t *recvd, int *saved_errnop)
 {
-	isc_uint16_t *packet_header;
-	int s;
-	isc_uint64_t now;
-	int n;
-	uint8_t tcplength[2];
-	int bytes_read = 0;
-	int p_bytes_read = 0;
-	int avbytes = 0;
+	int s;
+	isc_uint64_t now;
+	int n;
+
+	s = tinfo->socks[which_sock];
+	n = recv(s, packet_buffer, packet_size, 0);
+	now = get_time();
+	if (n < 0) {
+		*saved_errnop = errno;
+		return ISC_FALSE;
+	}
+	parse_response(recvd, which_sock, packet_buffer, n, now);
+	return ISC_TRUE;
+}
+
+/*
+ * Makes room in a connection's buffer for at least 'needed' unparsed
+ * bytes plus whatever else can be read.
+ */
+static void
+tcp_buffer_reserve(tcp_buffer_t *buf, unsigned int needed)
+{
+	unsigned char *base;
+	unsigned int size;
+
+	if (buf->start > 0) {
+		memmove(buf->base, buf->base + buf->start,
+			buf->end - buf->start);
+		buf->end -= buf->start;
+		buf->start = 0;
+	}
+	if (buf->size >= needed && buf->end < buf->size)
+		return;
+
+	size = buf->size != 0 ? buf->size : TCP_RECV_BUFFER_SIZE;
+	while (size < needed)
+		size *= 2;
+	if (size > MAX_TCP_FRAME + TCP_RECV_BUFFER_SIZE)
+		size = MAX_TCP_FRAME + TCP_RECV_BUFFER_SIZE;
+	if (size == buf->size)
+		return;
+	base = isc_mem_get(mctx, size);
+	if (base == NULL)
+		perf_log_fatal("out of memory");
+	if (buf->base != NULL) {
+		memcpy(base, buf->base, buf->end);
+		isc_mem_put(mctx, buf->base, buf->size);
+	}
+	buf->base = base;
+	buf->size = size;
+}
+
+/*
+ * A connection only holds a buffer while it has data waiting to be
+ * parsed, so that idle connections cost no buffer space.  The receiver
+ * keeps a spare, which saves allocating one for each read.
+ */
+static void
+tcp_buffer_take(threadinfo_t *tinfo, tcp_buffer_t *buf)
+{
+	if (buf->base != NULL || tinfo->spare_buf.base == NULL)
+		return;
+	*buf = tinfo->spare_buf;
+	memset(&tinfo->spare_buf, 0, sizeof(tinfo->spare_buf));
+}
+
+static void
+tcp_buffer_release(threadinfo_t *tinfo, tcp_buffer_t *buf)
+{
+	if (buf->base == NULL)
+		return;
+	if (tinfo->spare_buf.base == NULL)
+		tinfo->spare_buf = *buf;
+	else
+		isc_mem_put(mctx, buf->base, buf->size);
+	memset(buf, 0, sizeof(*buf));
+	tinfo->spare_buf.start = tinfo->spare_buf.end = 0;
+}
+
+/* Reads from a connection, through its TLS session if it has one. */
+static ssize_t
+tcp_read(threadinfo_t *tinfo, unsigned int socket, void *buf, size_t len)
+{
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+	if (tinfo->doh != NULL)
+		return perf_doh_read(tinfo->doh[socket], buf, len);
+#endif
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+	if (tinfo->doq != NULL)
+		return perf_doq_read(tinfo->doq[socket], buf, len);
+#endif
+#ifdef HAVE_LIBSSL
+	if (tinfo->tls != NULL)
+		return perf_tls_read(tinfo->tls[socket], buf, len);
+#endif
+	return read(tinfo->socks[socket], buf, len);
+}
+
+static void
+set_tcp_state(threadinfo_t *tinfo, unsigned int socket,
+	      tcp_conn_state_t state)
+{
+	LOCK(&tinfo->lock);
+	tinfo->tcp_conn_state[socket] = state;
+	update_tcp_slot(tinfo, socket);
+	UNLOCK(&tinfo->lock);
+}
+
+/*
+ * Parses up to 'max' length-prefixed responses from a TCP connection into
+ * the batch, reading as much as the connection has available each time
+ * the buffered data runs out.  A partial frame is kept for the next call.
+ * A connection found closed or broken is marked lost, for the caller to
+ * deal with once the responses read from it have been matched.
+ */
+static unsigned int
+recv_tcp(threadinfo_t *tinfo, int which_sock, recv_batch_t *batch,
+	 unsigned int start, unsigned int max, int *saved_errnop)
+{
+	tcp_buffer_t *buf;
+	isc_uint64_t now;
+	unsigned int avail, len, i;
+	int n;
+
+	buf = &tinfo->tcp_bufs[which_sock];
+	now = get_time();
+	i = 0;
+	while (i < max) {
+		avail = buf->end - buf->start;
+		len = 0;
+		if (avail >= 2) {
+			len = (buf->base[buf->start] << 8) |
+			      buf->base[buf->start + 1];
+			if (len == 0) {
+				perf_log_warning("length was 0");
+				set_tcp_state(tinfo, which_sock, TCP_ERROR);
+				*saved_errnop = EAGAIN;
+				break;
+			}
+			if (avail >= 2 + len) {
+				parse_response(&batch->recvd[start + i],
+					       which_sock,
+					       buf->base + buf->start + 2,
+					       len, now);
+				buf->start += 2 + len;
+				i++;
+				continue;
+			}
+		}
+
+		tcp_buffer_take(tinfo, buf);
+		tcp_buffer_reserve(buf, 2 + len);
+		n = tcp_read(tinfo, which_sock, buf->base + buf->end,
+			     buf->size - buf->end);
+		if (n == 0) {
+			set_tcp_state(tinfo, which_sock, TCP_PEER_CLOSED);
+			*saved_errnop = EAGAIN;
+			break;
+		}
+		if (n < 0) {
+			*saved_errnop = errno;
+			if (errno == ECONNRESET) {
+				/* Reset by the server, not a local failure. */
+				set_tcp_state(tinfo, which_sock,
+					      TCP_PEER_CLOSED);
+				*saved_errnop = EAGAIN;
+			} else if (errno != EAGAIN && errno != EWOULDBLOCK &&
+				   errno != EINTR)
+			{
+				perf_log_warning("connection %u failed: %s",
+						 which_sock, strerror(errno));
+				set_tcp_state(tinfo, which_sock, TCP_ERROR);
+				*saved_errnop = EAGAIN;
+			}
+			break;
+		}
+		buf->end += n;
+		now = get_time();
+	}
+	if (buf->start == buf->end)
+		tcp_buffer_release(tinfo, buf);
+	return i;
+}
+
+/*
+ * Reads up to 'max' queued responses from one socket into the batch,
+ * starting at slot 'start'.  Returns the number read; if that is less
+ * than 'max', *saved_errnop says why the socket stopped yielding data.
+ */
+static unsigned int
+recv_socket(threadinfo_t *tinfo, int which_sock, recv_batch_t *batch,
+	    unsigned int start, unsigned int max, int *saved_errnop)
+{
+	unsigned int i;
+#ifdef HAVE_RECVMMSG
+	isc_uint64_t now;
+	int s, n;
+
+	if (tinfo->config->usetcp != ISC_TRUE) {
+		s = tinfo->socks[which_sock];
+		n = recvmmsg(s, &batch->msgs[start], max, MSG_DONTWAIT, NULL);
+		if (n < 0) {
+			*saved_errnop = errno;
+			return 0;
+		}
+		now = get_time();
+		for (i = 0; i < (unsigned int) n; i++) {
+			parse_response(&batch->recvd[start + i], which_sock,
+				       batch->iovs[start + i].iov_base,
+				       batch->msgs[start + i].msg_len, now);
+		}
+		/* A short read means the socket has been drained. */
+		if ((unsigned int) n < max)
+			*saved_errnop = EAGAIN;
+		return n;
+	}
+#endif
+
+	if (tinfo->config->usetcp == ISC_TRUE)
+		return recv_tcp(tinfo, which_sock, batch, start, max,
+				saved_errnop);
+
+	for (i = 0; i < max; i++) {
+		if (!recv_one(tinfo, which_sock,
+			      batch->packets + (start + i) * MAX_EDNS_PACKET,
+			      MAX_EDNS_PACKET, &batch->recvd[start + i],
+			      saved_errnop))
+			break;
+	}
+	return i;
+}
+
+/*
+ * Closes a connection and ends its TLS session, if any, counting which TCP
+ * options were in effect on it.
+ */
+static void
+close_tcp_connection(threadinfo_t *tinfo, stats_t *stats, unsigned int socket,
+		     int fd)
+{
+	unsigned int used;
+
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+	if (tinfo->doh != NULL && tinfo->doh[socket] != NULL) {
+		stats->num_doh_failed += perf_doh_failed(tinfo->doh[socket]);
+		perf_doh_destroy(&tinfo->doh[socket]);
+	}
+#endif
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+	if (tinfo->doq != NULL && tinfo->doq[socket] != NULL) {
+		stats->num_doq_failed += perf_doq_failed(tinfo->doq[socket]);
+		perf_doq_destroy(&tinfo->doq[socket]);
+	}
+#endif
+#ifdef HAVE_LIBSSL
+	if (tinfo->tls != NULL && tinfo->tls[socket] != NULL)
+		perf_tls_destroy(&tinfo->tls[socket]);
+#else
+	(void)socket;
+#endif
+	used = perf_net_closesocket(fd, tinfo->config->tcpopts);
+	if ((used & PERF_NET_TCP_NODELAY) != 0)
+		stats->num_tcp_nodelay++;
+	if ((used & PERF_NET_TCP_FASTOPEN) != 0)
+		stats->num_tcp_fastopen++;
+	if ((used & PERF_NET_TCP_RESET) != 0)
+		stats->num_tcp_reset++;
+}
+
+/*
+ * Fails the queries still outstanding on a connection which has been
+ * lost, or only those it sent in early data, if that was rejected; they
+ * are counted as lost.  Returns how many there were.  Called with the
+ * lock held.
+ */
+static unsigned int
+fail_tcp_queries(threadinfo_t *tinfo, stats_t *stats, unsigned int socket,
+		 isc_boolean_t early)
+{
+	query_info *q, *next;
+	unsigned int nfailed = 0;
+
+	for (q = ISC_LIST_HEAD(tinfo->sock_queries[socket]); q != NULL;
+	     q = next)
+	{
+		next = ISC_LIST_NEXT(q, sock_link);
+		if (q->timestamp == ISC_UINT64_MAX || (early && !q->early))
+			continue;
+		query_move(tinfo, q, append_unused);
+		nfailed++;
+		stats->num_timedout++;
+		stats->num_tcp_failed++;
+		if (q->desc != NULL) {
+			perf_log_printf("> F %s", q->desc);
+			free(q->desc);
+			q->desc = NULL;
+		}
+	}
+	return nfailed;
+}
+
+/* Has retry_tcp_connections() open a connection at the given time. */
+static void
+defer_tcp_connection(threadinfo_t *tinfo, unsigned int socket,
+		     isc_uint64_t when)
+{
+	tinfo->tcp_retry[socket] = when;
+	tinfo->tcp_nbackoff++;
+	if (when < tinfo->tcp_next_retry)
+		tinfo->tcp_next_retry = when;
+	set_tcp_state(tinfo, socket, TCP_BACKOFF);
+}
+
+/* Schedules another attempt at a connection, waiting longer each time. */
+static void
+backoff_tcp_connection(threadinfo_t *tinfo, unsigned int socket)
+{
+	isc_uint64_t backoff;
+
+	backoff = tinfo->tcp_backoff[socket] * 2;
+	if (backoff < TCP_BACKOFF_MIN)
+		backoff = TCP_BACKOFF_MIN;
+	if (backoff > TCP_BACKOFF_MAX)
+		backoff = TCP_BACKOFF_MAX;
+	tinfo->tcp_backoff[socket] = backoff;
+	defer_tcp_connection(tinfo, socket, get_time() + backoff);
+}
+
+/*
+ * Counts a failure to bind a connection's local endpoint, which with a
+ * pool of endpoints may happen for every connection once the pool is
+ * exhausted, so only the first of the run is logged.
+ */
+static void
+count_bind_failure(stats_t *stats, int error)
+{
+	if (error == EADDRINUSE)
+		stats->num_bind_inuse++;
+	else if (error == EADDRNOTAVAIL)
+		stats->num_bind_notavail++;
+	else
+		stats->num_bind_other++;
+	if (!__atomic_exchange_n(&bind_warned, ISC_TRUE, __ATOMIC_RELAXED))
+		perf_log_warning("bind: %s (further failures are only "
+				 "counted)", strerror(error));
+}
+
+/*
+ * Opens a connection from the next endpoint in this thread's share of the
+ * local endpoint pool, if there is one.  A DNS over QUIC connection is a
+ * connected UDP socket, which is ready at once.
+ */
+static int
+open_tcp_socket(threadinfo_t *tinfo, stats_t *stats, unsigned int offset)
+{
+	const config_t *config = tinfo->config;
+	isc_sockaddr_t local;
+	int fd;
+
+	if (!config->use_local_pool) {
+		local = config->local_addr;
+	} else {
+		perf_net_localpool_get(&config->local_pool,
+				       tinfo->local_first + tinfo->local_next,
+				       &local);
+		tinfo->local_next = (tinfo->local_next + 1) %
+				    tinfo->local_count;
+		offset = 0;
+	}
+	fd = perf_net_opensocket(&config->server_addr, &local, offset,
+				 config->bufsize,
+				 config->usedoq ? SOCK_DGRAM : SOCK_STREAM,
+				 config->tcpopts);
+	if (fd == PERF_NET_EBIND) {
+		count_bind_failure(stats, errno);
+		return -1;
+	}
+	if (fd != -1 && config->usedoq &&
+	    connect(fd, &config->server_addr.type.sa,
+		    config->server_addr.length) == -1)
+	{
+		perf_log_warning("Error connecting to socket: %s",
+				 strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static void
+start_tcp_connection(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	int fd;
+
+	/*
+	 * The -x port may still be in TIME_WAIT, so without a pool of
+	 * local endpoints let the kernel choose one.
+	 */
+	fd = open_tcp_socket(tinfo, stats, UINT_MAX);
+	if (fd == -1) {
+		backoff_tcp_connection(tinfo, socket);
+		return;
+	}
+	if (socket < tinfo->nactive)
+		stats->num_tcp_conns++;
+	else
+		stats->num_idle_opened++;
+	tinfo->tcp_open_time[socket] = get_time();
+	LOCK(&tinfo->lock);
+	tinfo->socks[socket] = fd;
+	tinfo->tcp_conn_state[socket] = TCP_CONNECTING;
+	update_tcp_slot(tinfo, socket);
+	UNLOCK(&tinfo->lock);
+	watch_socket(tinfo, socket, PERF_OS_EVENT_READ | PERF_OS_EVENT_WRITE);
+}
+
+/*
+ * Opens a connection, or with -O conn-rate, has it wait its turn.  Time
+ * not used by the connections of one second does not carry over to the
+ * next.
+ */
+static void
+open_tcp_connection(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	isc_uint64_t now, when;
+
+	if (tinfo->conn_rate > 0) {
+		now = get_time();
+		when = tinfo->next_conn_time > now ? tinfo->next_conn_time :
+						     now;
+		tinfo->next_conn_time = when + MILLION / tinfo->conn_rate;
+		if (when > now) {
+			defer_tcp_connection(tinfo, socket, when);
+			return;
+		}
+	}
+	start_tcp_connection(tinfo, stats, socket);
+}
+
+/* Closes a connection, failing anything still outstanding on it. */
+static void
+shut_tcp_connection(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	int fd;
+
+	fd = tinfo->socks[socket];
+	unwatch_socket(tinfo, socket);
+	LOCK(&tinfo->lock);
+	tinfo->tcp_conn_state[socket] = TCP_CLOSED;
+	update_tcp_slot(tinfo, socket);
+	(void)fail_tcp_queries(tinfo, stats, socket, ISC_FALSE);
+	tinfo->socks[socket] = -1;
+	tinfo->sock_num_sent[socket] = 0;
+	tinfo->sock_num_recv[socket] = 0;
+	UNLOCK(&tinfo->lock);
+	close_tcp_connection(tinfo, stats, socket, fd);
+	tcp_buffer_release(tinfo, &tinfo->tcp_bufs[socket]);
+}
+
+/* An idle connection is ready, and counts as held until it is lost. */
+static void
+idle_established(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	tinfo->idle_up[socket - tinfo->nactive] = get_time();
+	tinfo->idle_sent[socket - tinfo->nactive] = 0;
+	stats->num_idle_established++;
+	LOCK(&idle_lock);
+	if (++idle_held > idle_peak)
+		idle_peak = idle_held;
+	UNLOCK(&idle_lock);
+}
+
+/*
+ * Records when an idle connection which had been established was lost,
+ * and how long it had been held.
+ */
+static void
+idle_lost(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	isc_uint64_t now, up, age;
+
+	up = tinfo->idle_up[socket - tinfo->nactive];
+	if (up == 0)
+		return;
+	tinfo->idle_up[socket - tinfo->nactive] = 0;
+	now = get_time();
+	age = now - up;
+	if (tinfo->tcp_conn_state[socket] == TCP_PEER_CLOSED)
+		stats->num_idle_closed++;
+	else
+		stats->num_idle_lost++;
+	if (stats->num_idle_closed + stats->num_idle_lost == 1)
+		stats->idle_close_first = now - tinfo->times->start_time;
+	stats->idle_close_last = now - tinfo->times->start_time;
+	stats->idle_age_hist[hist_bucket(age)]++;
+	if (age > stats->idle_age_max)
+		stats->idle_age_max = age;
+	LOCK(&idle_lock);
+	idle_held--;
+	UNLOCK(&idle_lock);
+}
+
+/*
+ * Moves a connection on once every query it may carry has been answered
+ * or has timed out, or once it has been lost.  A lost connection is
+ * replaced straight away if it had been answering, as when a server
+ * closes connections it considers idle or has served enough; otherwise
+ * the server may be down or refusing connections, so each further
+ * attempt waits longer.  Nothing
+ * is reopened once the sender has finished, and idle connections are
+ * never reopened.
+ */
+static void
+check_tcp_connection(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	isc_boolean_t answered;
+	unsigned int outstanding;
+
+	if (tinfo->socks[socket] == -1)
+		return;
+	switch (tinfo->tcp_conn_state[socket]) {
+	case TCP_DRAINING:
+		if (tinfo->done_sending)
+			return;
+		/* Answered or timed out, every query is done with. */
+		LOCK(&tinfo->lock);
+		outstanding = tinfo->sock_outstanding[socket];
+		UNLOCK(&tinfo->lock);
+		if (outstanding > 0)
+			return;
+		shut_tcp_connection(tinfo, stats, socket);
+		open_tcp_connection(tinfo, stats, socket);
+		break;
+	case TCP_PEER_CLOSED:
+	case TCP_ERROR:
+		if (socket >= tinfo->nactive) {
+			idle_lost(tinfo, stats, socket);
+			shut_tcp_connection(tinfo, stats, socket);
+			return;
+		}
+		/* The sender will hand it back shortly. */
+		LOCK(&tinfo->lock);
+		if (tinfo->send_sock == (int)socket) {
+			UNLOCK(&tinfo->lock);
+			return;
+		}
+		UNLOCK(&tinfo->lock);
+		answered = ISC_TF(tinfo->sock_num_recv[socket] > 0);
+		shut_tcp_connection(tinfo, stats, socket);
+		if (tinfo->done_sending)
+			return;
+		stats->num_tcp_reconnects++;
+		if (answered) {
+			tinfo->tcp_backoff[socket] = 0;
+			open_tcp_connection(tinfo, stats, socket);
+		} else {
+			backoff_tcp_connection(tinfo, socket);
+		}
+		break;
+	default:
+		break;
+	}
+}
+
+/*
+ * Reopens connections whose backoff has expired, and returns how long
+ * the receiver may wait before the next one is due.
+ */
+static isc_uint64_t
+retry_tcp_connections(threadinfo_t *tinfo, stats_t *stats, isc_uint64_t now)
+{
+	isc_uint64_t wait;
+	unsigned int i;
+
+	/* Only look through the connections when one is due. */
+	if (now < tinfo->tcp_next_retry)
+		return tinfo->tcp_next_retry - now;
+	tinfo->tcp_next_retry = ISC_UINT64_MAX;
+
+	wait = TIMEOUT_CHECK_TIME;
+	for (i = 0; i < tinfo->nsocks && tinfo->tcp_nbackoff > 0; i++) {
+		if (tinfo->tcp_conn_state[i] != TCP_BACKOFF)
+			continue;
+		if (tinfo->tcp_retry[i] > now) {
+			if (tinfo->tcp_retry[i] - now < wait)
+				wait = tinfo->tcp_retry[i] - now;
+			continue;
+		}
+		tinfo->tcp_nbackoff--;
+		set_tcp_state(tinfo, i, TCP_CLOSED);
+		if (!tinfo->done_sending)
+			start_tcp_connection(tinfo, stats, i);
+	}
+	if (now + wait < tinfo->tcp_next_retry)
+		tinfo->tcp_next_retry = now + wait;
+	return wait;
+}
+
+/*
+ * Writes the keepalive query, or what is left of it, to an idle
+ * connection.  If only part of it fits, the rest is written once the
+ * connection is writable again; one with no room at all is passed over
+ * until its next turn.  Only a connection the server has closed is
+ * given up on; any other error is left for the receiver to find.
+ */
+static void
+send_keepalive(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	const config_t *config = tinfo->config;
+	unsigned int *sent = &tinfo->idle_sent[socket - tinfo->nactive];
+	isc_boolean_t wants_read = ISC_FALSE;
+	ssize_t n;
+
+#ifdef HAVE_LIBSSL
+	if (tinfo->tls != NULL) {
+		n = perf_tls_write(tinfo->tls[socket],
+				   config->idle_query + *sent,
+				   config->idle_query_len - *sent);
+		wants_read = ISC_TF((perf_tls_status(tinfo->tls[socket]) &
+				     PERF_TLS_WRITE_WANTS_READ) != 0);
+	} else
+#endif
+		n = write(tinfo->socks[socket], config->idle_query + *sent,
+			  config->idle_query_len - *sent);
+	if (n > 0) {
+		*sent += n;
+		if (*sent == config->idle_query_len) {
+			*sent = 0;
+			stats->num_idle_keepalives++;
+			return;
+		}
+	} else if (n == 0 || errno == EPIPE || errno == ECONNRESET) {
+		set_tcp_state(tinfo, socket, TCP_PEER_CLOSED);
+		check_tcp_connection(tinfo, stats, socket);
+		return;
+	}
+	/*
+	 * Unless TLS must read first, finish it as soon as there is room;
+	 * failing that, on its next turn.
+	 */
+	if (*sent > 0 && !wants_read)
+		watch_writable(tinfo, socket, ISC_TRUE);
+}
+
+/*
+ * Opens the idle connections at the -O idle-rate, and sends keepalives
+ * on those which are open, visiting each in turn once every
+ * -O idle-interval.  Returns how long the receiver may wait before
+ * either is next due.
+ */
+static isc_uint64_t
+service_idle_connections(threadinfo_t *tinfo, stats_t *stats,
+			 isc_uint64_t now)
+{
+	const config_t *config = tinfo->config;
+	isc_uint64_t wait, step;
+	unsigned int socket, n;
+
+	if (tinfo->done_sending)
+		return TIMEOUT_CHECK_TIME;
+	wait = TIMEOUT_CHECK_TIME;
+
+	while (tinfo->idle_next < tinfo->nidle &&
+	       tinfo->idle_open_time <= now)
+	{
+		start_tcp_connection(tinfo, stats,
+				     tinfo->nactive + tinfo->idle_next++);
+		tinfo->idle_open_time += MILLION / tinfo->idle_rate;
+	}
+	if (tinfo->idle_next < tinfo->nidle &&
+	    tinfo->idle_open_time - now < wait)
+		wait = tinfo->idle_open_time - now;
+
+	if (config->idle_interval == 0)
+		return wait;
+	step = config->idle_interval / tinfo->nidle;
+	if (step == 0)
+		step = 1;
+	/* Time lost to a busy receiver does not carry over. */
+	if (tinfo->idle_keepalive_time + config->idle_interval < now)
+		tinfo->idle_keepalive_time = now;
+	for (n = 0; n < tinfo->nidle && tinfo->idle_keepalive_time <= now;
+	     n++)
+	{
+		socket = tinfo->nactive + tinfo->idle_cursor;
+		tinfo->idle_cursor = (tinfo->idle_cursor + 1) % tinfo->nidle;
+		tinfo->idle_keepalive_time += step;
+		if (tinfo->tcp_conn_state[socket] == TCP_OPEN)
+			send_keepalive(tinfo, stats, socket);
+	}
+	if (tinfo->idle_keepalive_time > now &&
+	    tinfo->idle_keepalive_time - now < wait)
+		wait = tinfo->idle_keepalive_time - now;
+	return wait;
+}
+
+/*
+ * Records how long a connection took to set up, from the connect to the
+ * end of any TLS handshake, apart from query latency.  With TCP Fast
+ * Open, connect() returns at once and the socket is writable before the
+ * handshake has finished, so only a TLS handshake can be timed.
+ */
+static void
+record_tcp_setup(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	isc_uint64_t setup;
+
+	setup = get_time() - tinfo->tcp_open_time[socket];
+	tinfo->tcp_open_time[socket] = 0;
+	if ((tinfo->config->tcpopts & PERF_NET_TCP_FASTOPEN) == 0 ||
+	    tinfo->config->usetls)
+	{
+		stats->num_tcp_setups++;
+		stats->setup_sum += setup;
+		stats->setup_sum_squares += setup * setup;
+		if (setup < stats->setup_min || stats->num_tcp_setups == 1)
+			stats->setup_min = setup;
+		if (setup > stats->setup_max)
+			stats->setup_max = setup;
+		stats->setup_hist[hist_bucket(setup)]++;
+	}
+	if (socket >= tinfo->nactive)
+		idle_established(tinfo, stats, socket);
+}
+
+/* A connection is ready for queries. */
+static void
+tcp_connected(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	record_tcp_setup(tinfo, stats, socket);
+	/* Update the slot, which promotes it if need be. */
+	set_tcp_state(tinfo, socket, TCP_STANDBY);
+}
+
+#ifdef HAVE_LIBSSL
+static void
+count_tls_session(stats_t *stats, unsigned int status)
+{
+	if ((status & PERF_TLS_RESUMED) != 0)
+		stats->num_tls_resumed++;
+	if ((status & (PERF_TLS_EARLY_ACCEPTED |
+		       PERF_TLS_EARLY_REJECTED)) != 0)
+		stats->num_tls_early++;
+	if ((status & PERF_TLS_EARLY_REJECTED) != 0)
+		stats->num_tls_early_rejected++;
+	if ((status & PERF_TLS_KTLS_SEND) != 0)
+		stats->num_ktls_send++;
+	if ((status & PERF_TLS_KTLS_RECV) != 0)
+		stats->num_ktls_recv++;
+	if ((status & (PERF_TLS_KTLS_SEND | PERF_TLS_KTLS_RECV)) == 0)
+		stats->num_ktls_none++;
+}
+
+/*
+ * A session sending early data is in use before its handshake is done;
+ * once a read has completed the handshake, its setup is recorded.  The
+ * server discards early data it rejects, so the queries sent in it are
+ * failed at once, rather than left to time out.  Returns whether they
+ * were, in which case the connection should be checked.
+ */
+static isc_boolean_t
+tls_early_progress(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	unsigned int status, nfailed;
+
+	status = perf_tls_status(tinfo->tls[socket]);
+	if ((status & PERF_TLS_ESTABLISHED) == 0)
+		return ISC_FALSE;
+	record_tcp_setup(tinfo, stats, socket);
+	count_tls_session(stats, status);
+	if ((status & PERF_TLS_EARLY_REJECTED) == 0)
+		return ISC_FALSE;
+	/*
+	 * The server discarded the queries sent early; it is up, though,
+	 * so they count as answered should the connection be lost.
+	 */
+	LOCK(&tinfo->lock);
+	nfailed = fail_tcp_queries(tinfo, stats, socket, ISC_TRUE);
+	UNLOCK(&tinfo->lock);
+	tinfo->sock_num_recv[socket] += nfailed;
+	return ISC_TRUE;
+}
+
+/*
+ * Takes a TLS handshake as far as it will go without blocking.  Returns
+ * whether it failed, in which case the connection should be checked.
+ */
+static isc_boolean_t
+tls_handshake(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	unsigned int what;
+
+	switch (perf_tls_handshake(tinfo->tls[socket], &what)) {
+	case ISC_R_SUCCESS:
+		count_tls_session(stats, perf_tls_status(tinfo->tls[socket]));
+		tcp_connected(tinfo, stats, socket);
+		return ISC_FALSE;
+	case ISC_R_WOULDBLOCK:
+		if (what == PERF_OS_EVENT_WRITE)
+			watch_writable(tinfo, socket, ISC_TRUE);
+		return ISC_FALSE;
+	default:
+		set_tcp_state(tinfo, socket, TCP_ERROR);
+		return ISC_TRUE;
+	}
+}
+#endif
+
+/*
+ * Gives up on connections which have not become usable within the query
+ * timeout, such as a TLS handshake with a server which is not speaking
+ * TLS.  They are then retried like any other failed connection.
+ */
+static void
+expire_tcp_setups(threadinfo_t *tinfo, stats_t *stats, isc_uint64_t now)
+{
+	unsigned int i;
 
-	packet_header = (isc_uint16_t *) packet_buffer;
+	if (now < tinfo->tcp_setup_check)
+		return;
+	tinfo->tcp_setup_check = now + TIMEOUT_CHECK_TIME;
+	for (i = 0; i < tinfo->nsocks; i++) {
+		if ((tinfo->tcp_conn_state[i] != TCP_CONNECTING &&
+		     tinfo->tcp_conn_state[i] != TCP_HANDSHAKE) ||
+		    /* It may have been opened since 'now' was taken. */
+		    tinfo->tcp_open_time[i] + tinfo->config->timeout > now)
+			continue;
+		perf_log_warning("connection %u timed out during setup", i);
+		set_tcp_state(tinfo, i, TCP_ERROR);
+		check_tcp_connection(tinfo, stats, i);
+	}
+}
 
-	s = tinfo->socks[which_sock];
+/*
+ * Connections are watched for writability in four cases.  A connection
+ * in progress becomes writable when the connect finishes, successfully or
+ * not, and a TLS handshake may need to wait for room to send, as may the
+ * rest of a keepalive query on an idle connection.  The sender
+ * also asks for a look at a connection once it has sent its last query,
+ * in case it can be recycled straight away, and when it hands back a
+ * connection which was lost while it was in use.  Returns whether the
+ * connection should be checked, which must wait until any responses
+ * already read from it have been matched.
+ */
+static isc_boolean_t
+tcp_writable(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+{
+	socklen_t len;
+	int error;
 
-	if (tinfo->config->usetcp != ISC_TRUE) {
-		n = recv(s, packet_buffer, packet_size, 0);
-	} else {
-		/* check if there are enough bytes available to read the length */
-		if (ioctl(s, FIONREAD, &avbytes) == -1){
-			*saved_errnop = errno;
-			return ISC_FALSE;
-		}
-		if (avbytes >= 2) {
-			/* first just peek at the length */
-			if ( (bytes_read = recv(s, tcplength, 2, MSG_PEEK)) == -1) {
-				*saved_errnop = errno;
-				return ISC_FALSE;
-			}
-		} else {
-			*saved_errnop = EAGAIN;
-			return ISC_FALSE;
-		}
-		n = ((uint16_t)tcplength[0] << 8) | tcplength[1];
-		if( n == 0 ) {
-			perf_log_warning("length was 0");
-			*saved_errnop = EBADMSG; /* return bad message */
-			return ISC_FALSE;
+	if (tinfo->socks[socket] == -1)
+		return ISC_FALSE;
+	watch_writable(tinfo, socket, ISC_FALSE);
+	if (tinfo->tcp_conn_state[socket] == TCP_CONNECTING) {
+		error = 0;
+		len = sizeof(error);
+		getsockopt(tinfo->socks[socket], SOL_SOCKET, SO_ERROR,
+			   (void *)&error, &len);
+		if (error != 0) {
+			perf_log_warning("cannot connect connection %u: %s",
+					 socket, strerror(error));
+			set_tcp_state(tinfo, socket, TCP_ERROR);
+			return ISC_TRUE;
 		}
-		/* check if there are enough bytes available */
-		if (ioctl(s, FIONREAD, &avbytes) == -1){
-			*saved_errnop = errno;
+		if (!tinfo->config->usetls) {
+			tcp_connected(tinfo, stats, socket);
 			return ISC_FALSE;
 		}
-		if (avbytes >= (2 + n)) {
-			/* drain the length bytes */
-			if ( (bytes_read = read(s, tcplength, 2)) == -1) {
-				*saved_errnop = errno;
-				return ISC_FALSE;
-			}
-			/* now read the DNS payload */
-			if ( (p_bytes_read = read(s, packet_buffer, n)) == -1) {
-				*saved_errnop = errno;
-				return ISC_FALSE;
-			}
-		} else {
-			*saved_errnop = EAGAIN;
+#ifdef HAVE_LIBSSL
+		tinfo->tls[socket] = perf_tls_create(tinfo->config->tlsctx,
+						     tinfo->socks[socket]);
+#ifdef HAVE_LIBNGHTTP2
+		if (tinfo->doh != NULL)
+			tinfo->doh[socket] =
+				perf_doh_create(mctx, tinfo->tls[socket],
+						tinfo->config->doh_method,
+						tinfo->config->doh_path,
+						tinfo->config->doh_authority);
+#endif
+#ifdef HAVE_OSSL_QUIC_CLIENT_METHOD
+		if (tinfo->doq != NULL)
+			tinfo->doq[socket] =
+				perf_doq_create(mctx, tinfo->tls[socket],
+						tinfo->config->doq_streams);
+#endif
+		if (perf_tls_early(tinfo->tls[socket])) {
+			set_tcp_state(tinfo, socket, TCP_STANDBY);
 			return ISC_FALSE;
 		}
+		set_tcp_state(tinfo, socket, TCP_HANDSHAKE);
+#endif
 	}
-	
-	now = get_time();
-	if (n < 0) {
-		*saved_errnop = errno;
+#ifdef HAVE_LIBSSL
+	if (tinfo->tcp_conn_state[socket] == TCP_HANDSHAKE)
+		return tls_handshake(tinfo, stats, socket);
+#endif
+	if (socket >= tinfo->nactive &&
+	    tinfo->tcp_conn_state[socket] == TCP_OPEN &&
+	    tinfo->idle_sent[socket - tinfo->nactive] > 0)
+	{
+		send_keepalive(tinfo, stats, socket);
 		return ISC_FALSE;
 	}
-	recvd->sock = s;
-	recvd->qid = ntohs(packet_header[0]);
-	recvd->rcode = ntohs(packet_header[1]) & 0xF;
-	recvd->size = n;
-	recvd->when = now;
-	recvd->sent = 0;
-	recvd->unexpected = ISC_FALSE;
-	recvd->short_response = ISC_TF(n < 4);
-	recvd->desc = NULL;
 	return ISC_TRUE;
 }
 
-static inline void
-bit_set(unsigned char *bits, unsigned int bit)
+#ifdef HAVE_LINUX_IO_URING_H
+/* Whether a receive which stopped with 'error' is worth restarting. */
+static isc_boolean_t
+uring_transient(int error)
+{
+	switch (error) {
+	case ENOBUFS:
+	case EINTR:
+	case EAGAIN:
+	case ECONNREFUSED:
+	case EHOSTUNREACH:
+	case EHOSTDOWN:
+	case ENETUNREACH:
+	case ENETDOWN:
+		return ISC_TRUE;
+	default:
+		return ISC_FALSE;
+	}
+}
+
+/*
+ * Consumes uring completions.  Datagrams arrive already read, and are
+ * parsed straight into the batch; connections only report readiness, and
+ * are then read as usual.  Completions which do not fit are left queued.
+ */
+static void
+uring_reap(threadinfo_t *tinfo, recv_batch_t *batch, unsigned int *nrecvdp,
+	   perf_os_event_t *ready, unsigned int *nreadyp, isc_uint64_t timeout)
 {
-	unsigned int shift, mask;
+	perf_uring_t *ring;
+	perf_uring_cqe_t cqe;
+	unsigned int socket, nrecvd, nready;
+	isc_uint64_t now;
+
+	ring = tinfo->recv_ring;
+	nrecvd = *nrecvdp;
+	nready = 0;
+	perf_uring_wait(ring, 1, timeout);
+	now = get_time();
+	while (nrecvd < batch->size && nready < tinfo->nsocks &&
+	       perf_uring_peek(ring, &cqe))
+	{
+		perf_uring_seen(ring);
+		socket = URING_SOCKET(cqe.data);
+		if (URING_OP(cqe.data) == URING_PIPE ||
+		    socket >= tinfo->nsocks ||
+		    URING_GEN(cqe.data) != tinfo->sock_gen[socket])
+		{
+			if ((cqe.flags & PERF_URING_BUFFER) != 0)
+				perf_uring_recycle_buffer(ring, cqe.buffer);
+			continue;
+		}
 
-	shift = 7 - (bit % 8);
-	mask = 1 << shift;
+		switch (URING_OP(cqe.data)) {
+		case URING_RECV:
+			if (cqe.res > 0 &&
+			    (cqe.flags & PERF_URING_BUFFER) != 0)
+				parse_response(&batch->recvd[nrecvd++],
+					       socket,
+					       perf_uring_buffer(ring,
+								 cqe.buffer),
+					       cqe.res, now);
+			if ((cqe.flags & PERF_URING_BUFFER) != 0)
+				perf_uring_recycle_buffer(ring, cqe.buffer);
+			break;
+		case URING_POLLIN:
+			if (cqe.res < 0)
+				break;
+			ready[nready].id = socket;
+			ready[nready].what = PERF_OS_EVENT_READ;
+			if ((cqe.res & (POLLERR | POLLHUP)) != 0)
+				ready[nready].what |= PERF_OS_EVENT_ERROR;
+			nready++;
+			break;
+		case URING_POLLOUT:
+			if (cqe.res < 0)
+				break;
+			ready[nready].id = socket;
+			ready[nready].what = PERF_OS_EVENT_WRITE;
+			nready++;
+			break;
+		}
 
-	bits[bit / 8] |= mask;
+		/*
+		 * Multishot requests stop when the kernel runs short of
+		 * buffers or completion slots, or a datagram socket reports
+		 * an error from the network; start them again.  Any other
+		 * error would only recur.
+		 */
+		if ((URING_OP(cqe.data) == URING_RECV ||
+		     URING_OP(cqe.data) == URING_POLLIN) &&
+		    (cqe.flags & PERF_URING_MORE) == 0)
+		{
+			if (cqe.res < 0 && !uring_transient(-cqe.res))
+				perf_log_fatal("io_uring %s failed: %s; "
+					       "try -O engine=poll",
+					       URING_OP(cqe.data) ==
+					       URING_RECV ? "receive" : "poll",
+					       strerror(-cqe.res));
+			uring_watch_read(tinfo, socket);
+		}
+	}
+	*nrecvdp = nrecvd;
+	*nreadyp = nready;
 }
+#endif
 
-static inline isc_boolean_t
-bit_check(unsigned char *bits, unsigned int bit)
+/*
+ * Waits up to 'timeout' microseconds for sockets to have something to
+ * report; with the uring engine, received datagrams may also be added to
+ * the batch.
+ */
+static void
+wait_for_events(threadinfo_t *tinfo, recv_batch_t *batch,
+		unsigned int *nrecvdp, perf_os_event_t *ready,
+		unsigned int *nreadyp, isc_uint64_t timeout)
 {
-	unsigned int shift;
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tinfo->recv_ring != NULL) {
+		uring_reap(tinfo, batch, nrecvdp, ready, nreadyp, timeout);
+		return;
+	}
+#endif
+	(void)batch;
+	(void)nrecvdp;
+	perf_os_events_wait(tinfo->events, ready, tinfo->nsocks, nreadyp,
+			    timeout);
+}
 
-	shift = 7 - (bit % 8);
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+/*
+ * QUIC connections have timers to keep, and may take in what the server
+ * sent while they are being written to, leaving the socket with nothing
+ * to report.  So every so often each connection not already reported is
+ * serviced as if it were readable.  'listed' is scratch space for each
+ * socket.
+ */
+static void
+add_doq_service(threadinfo_t *tinfo, perf_os_event_t *ready,
+		unsigned int *nreadyp, unsigned char *listed)
+{
+	isc_uint64_t now;
+	unsigned int i, nready;
 
-	if ((bits[bit / 8] >> shift) & 0x01)
-		return ISC_TRUE;
-	return ISC_FALSE;
+	now = get_time();
+	if (now < tinfo->doq_service)
+		return;
+	tinfo->doq_service = now + DOQ_SERVICE_TIME;
+
+	nready = *nreadyp;
+	memset(listed, 0, tinfo->nsocks);
+	for (i = 0; i < nready; i++)
+		listed[ready[i].id] = 1;
+	for (i = 0; i < tinfo->nsocks; i++) {
+		if (listed[i] || tinfo->socks[i] == -1 ||
+		    tinfo->tcp_conn_state[i] == TCP_CLOSED ||
+		    tinfo->tcp_conn_state[i] == TCP_CONNECTING ||
+		    tinfo->tcp_conn_state[i] == TCP_BACKOFF ||
+		    TCP_CONN_LOST(tinfo->tcp_conn_state[i]))
+			continue;
+		ready[nready].id = i;
+		ready[nready].what = PERF_OS_EVENT_READ;
+		nready++;
+	}
+	*nreadyp = nready;
 }
+#endif
 
-static isc_boolean_t
-check_tcp_connection(threadinfo_t *tinfo, stats_t *stats, unsigned int socket)
+/*
+ * Times out queries.  A draining connection whose last query this was
+ * is checked, so that it is recycled rather than left waiting.
+ */
+static void
+process_timeouts(threadinfo_t *tinfo, stats_t *stats, isc_uint64_t now)
 {
-	if (tinfo->done_sending)
-		return ISC_TRUE;
-	if (tinfo->socks[socket] ==  -1)
-		return ISC_FALSE;
-	if (tinfo->tcp_conn_state[socket] == TCP_SENT_MAX &&
-	    tinfo->sock_num_recv[socket] >= tinfo->config->max_tcp_q) {
-		close(tinfo->socks[socket]);
-		LOCK(&tinfo->lock);
-		tinfo->socks[socket] = -1;
-		tinfo->sock_num_sent[socket] = 0;
-		tinfo->sock_num_recv[socket] = 0;
-		tinfo->tcp_conn_state[socket] = TCP_CLOSED;
-		UNLOCK(&tinfo->lock);
-		/* We can't easily re-open the same port because we have
-		the TIME_WAIT state, so for now disregard the -x option here*/
-		int fd = perf_net_opensocket(&tinfo->config->server_addr,
-					      &tinfo->config->local_addr,
-					      UINT_MAX,
-					      tinfo->config->bufsize, SOCK_STREAM);
-		if (fd == -1)
-			return ISC_FALSE;
-		stats->num_tcp_conns++;
+	struct query_info *q;
+	const config_t *config;
+	unsigned int socket;
+	isc_boolean_t drained;
+
+	config = tinfo->config;
+
+	for (;;) {
+		/* Avoid locking unless we need to. */
+		q = ISC_LIST_TAIL(tinfo->outstanding_queries);
+		if (q == NULL || q->timestamp > now ||
+		    now - q->timestamp < config->timeout)
+			return;
+
 		LOCK(&tinfo->lock);
-		tinfo->socks[socket] = fd;
-		tinfo->tcp_conn_state[socket] = TCP_IN_HANDSHAKE;
+
+		drained = ISC_FALSE;
+		do {
+			socket = q->socknum;
+			query_move(tinfo, q, append_unused);
+
+			stats->num_timedout++;
+
+			if (q->desc != NULL) {
+				perf_log_printf("> T %s", q->desc);
+			} else {
+				perf_log_printf("[Timeout] %s timed out: "
+						"msg id %u",
+						config->updates ? "Update"
+								: "Query",
+						(unsigned int)q->qid);
+			}
+			if (config->usetcp == ISC_TRUE &&
+			    tinfo->tcp_conn_state[socket] == TCP_DRAINING &&
+			    tinfo->sock_outstanding[socket] == 0)
+			{
+				drained = ISC_TRUE;
+				break;
+			}
+			q = ISC_LIST_TAIL(tinfo->outstanding_queries);
+		} while (q != NULL && q->timestamp < now &&
+			 now - q->timestamp >= config->timeout);
+
 		UNLOCK(&tinfo->lock);
+
+		if (!drained)
+			return;
+		check_tcp_connection(tinfo, stats, socket);
 	}
-	return ISC_TRUE;
 }
 
 static void *
@@ -988,24 +4123,44 @@ do_recv(void *arg)
 {
 	threadinfo_t *tinfo;
 	stats_t *stats;
-	unsigned char packet_buffer[MAX_EDNS_PACKET];
-	received_query_t recvd[RECV_BATCH_SIZE];
-	unsigned int nrecvd;
+	recv_batch_t batch;
+	received_query_t *recvd;
+	unsigned int nrecvd, n;
 	int saved_errno;
-	unsigned char socketbits[MAX_SOCKETS / 8];
 	isc_uint64_t now, latency;
 	query_info *q;
-	unsigned int current_socket, last_socket;
-	unsigned int i, j;
+	perf_os_event_t *ready;
+	unsigned int nready, next_ready;
+	unsigned int *touched, ntouched;
+	unsigned int current_socket;
+	isc_uint64_t timeout, wait;
+	unsigned int i;
+	isc_boolean_t rejected;
+	unsigned char *listed = NULL;
 
 	tinfo = (threadinfo_t *) arg;
 	stats = &tinfo->stats;
+	recv_batch_init(&batch, tinfo->config);
+	recvd = batch.recvd;
+	ready = isc_mem_get(mctx, tinfo->nsocks * sizeof(*ready));
+	/* A socket may be both writable and read in the same pass. */
+	touched = isc_mem_get(mctx, 2 * tinfo->nsocks * sizeof(*touched));
+	if (ready == NULL || touched == NULL)
+		perf_log_fatal("out of memory");
+	if (tinfo->config->usedoq) {
+		listed = isc_mem_get(mctx, tinfo->nsocks);
+		if (listed == NULL)
+			perf_log_fatal("out of memory");
+	}
 
 	wait_for_start();
 	now = get_time();
-	last_socket = 0;
+	nready = 0;
+	next_ready = 0;
 	while (!interrupted) {
-		process_timeouts(tinfo, now);
+		process_timeouts(tinfo, stats, now);
+		if (tinfo->config->usetcp == ISC_TRUE)
+			expire_tcp_setups(tinfo, stats, now);
 
 		/*
 		 * If we're done sending and either all responses have been
@@ -1014,39 +4169,112 @@ do_recv(void *arg)
 		if (tinfo->done_sending && num_outstanding(stats) == 0)
 			break;
 
+		saved_errno = 0;
+		nrecvd = 0;
+		ntouched = 0;
+
 		/*
-		 * Try to receive a few packets, so that we can process them
-		 * atomically.
+		 * Once every socket reported ready has been serviced, wait
+		 * for the kernel to report more.
 		 */
-		saved_errno = 0;
-		memset(socketbits, 0, sizeof(socketbits));
-		for (i = 0; i < RECV_BATCH_SIZE; i++) {
-			for (j = 0; j < tinfo->nsocks; j++) {
-				current_socket = (j + last_socket) %
-					tinfo->nsocks;
-				if (tinfo->config->usetcp == ISC_TRUE &&
-					!check_tcp_connection(tinfo, stats, current_socket))
-					continue;
-				if (bit_check(socketbits, current_socket))
-					continue;
-				if (recv_one(tinfo, current_socket,
-					     packet_buffer,
-					     sizeof(packet_buffer),
-					      &recvd[i], &saved_errno))
-				{
-					last_socket = (current_socket + 1);
-					if (tinfo->config->usetcp == ISC_TRUE)
-						tinfo->sock_num_recv[current_socket]++;
-					break;
-				}
-				bit_set(socketbits, current_socket);
-				if (!(saved_errno == EAGAIN || saved_errno == EWOULDBLOCK))
+		if (next_ready == nready) {
+			timeout = TIMEOUT_CHECK_TIME;
+			if (tinfo->tcp_nbackoff > 0)
+				timeout = retry_tcp_connections(tinfo, stats,
+								now);
+			if (tinfo->nidle > 0) {
+				wait = service_idle_connections(tinfo, stats,
+								now);
+				if (wait < timeout)
+					timeout = wait;
+			}
+			if (listed != NULL && timeout > DOQ_SERVICE_TIME)
+				timeout = DOQ_SERVICE_TIME;
+			wait_for_events(tinfo, &batch, &nrecvd, ready, &nready,
+					timeout);
+			next_ready = 0;
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+			if (listed != NULL)
+				add_doq_service(tinfo, ready, &nready, listed);
+#endif
+		}
+
+		/*
+		 * Drain the ready sockets in turn until the batch is full, so
+		 * that the whole batch can be processed atomically.  A socket
+		 * which filled the batch stays at the head of the ready list.
+		 */
+		while (next_ready < nready && nrecvd < batch.size) {
+			current_socket = ready[next_ready].id;
+			if (tinfo->config->usetcp == ISC_TRUE &&
+			    (ready[next_ready].what & PERF_OS_EVENT_WRITE) != 0 &&
+			    tcp_writable(tinfo, stats, current_socket))
+				touched[ntouched++] = current_socket;
+			if ((ready[next_ready].what &
+			     (PERF_OS_EVENT_READ | PERF_OS_EVENT_ERROR)) == 0 ||
+			    tinfo->socks[current_socket] == -1)
+			{
+				next_ready++;
+				continue;
+			}
+#ifdef HAVE_LIBSSL
+			/*
+			 * Nothing but handshake messages is due before the
+			 * session is up; a connect in progress is finished
+			 * when it becomes writable.
+			 */
+			if (tinfo->config->usetls &&
+			    (tinfo->tcp_conn_state[current_socket] ==
+			     TCP_CONNECTING ||
+			     tinfo->tcp_conn_state[current_socket] ==
+			     TCP_HANDSHAKE))
+			{
+				if (tinfo->tcp_conn_state[current_socket] ==
+				    TCP_HANDSHAKE &&
+				    tls_handshake(tinfo, stats, current_socket))
+					touched[ntouched++] = current_socket;
+				next_ready++;
+				continue;
+			}
+#endif
+			/* Already lost; still waiting for the sender. */
+			if (tinfo->config->usetcp == ISC_TRUE &&
+			    TCP_CONN_LOST(tinfo->tcp_conn_state[current_socket]))
+			{
+				touched[ntouched++] = current_socket;
+				next_ready++;
+				continue;
+			}
+			n = recv_socket(tinfo, current_socket, &batch, nrecvd,
+					batch.size - nrecvd, &saved_errno);
+			rejected = ISC_FALSE;
+#ifdef HAVE_LIBSSL
+			if (tinfo->config->usetls &&
+			    tinfo->tcp_open_time[current_socket] != 0)
+				rejected = tls_early_progress(tinfo, stats,
+							      current_socket);
+#endif
+			/* Answers to keepalives are only counted. */
+			if (current_socket >= tinfo->nactive) {
+				stats->num_idle_answers += n;
+				n = 0;
+			}
+			if (tinfo->config->usetcp == ISC_TRUE &&
+			    (n > 0 || rejected ||
+			     TCP_CONN_LOST(tinfo->tcp_conn_state[current_socket])))
+			{
+				tinfo->sock_num_recv[current_socket] += n;
+				touched[ntouched++] = current_socket;
+			}
+			nrecvd += n;
+			if (nrecvd < batch.size) {
+				next_ready++;
+				if (!(saved_errno == EAGAIN ||
+				      saved_errno == EWOULDBLOCK))
 					break;
+				saved_errno = 0;
 			}
-			if (j == tinfo->nsocks)
-				break;
 		}
-		nrecvd = i;
 
 		/* Do all of the processing that requires the lock */
 		LOCK(&tinfo->lock);
@@ -1054,11 +4282,8 @@ do_recv(void *arg)
 			if (recvd[i].short_response)
 				continue;
 
-			q = &tinfo->queries[recvd[i].qid];
-			if (q->list != &tinfo->outstanding_queries ||
-			    q->timestamp == ISC_UINT64_MAX ||
-			    q->sock != recvd[i].sock)
-			{
+			q = qid_lookup(tinfo, recvd[i].socknum, recvd[i].qid);
+			if (q == NULL || q->timestamp == ISC_UINT64_MAX) {
 				recvd[i].unexpected = ISC_TRUE;
 				continue;
 			}
@@ -1070,6 +4295,13 @@ do_recv(void *arg)
 		SIGNAL(&tinfo->cond);
 		UNLOCK(&tinfo->lock);
 
+		/*
+		 * Connections which have answered everything can be reused,
+		 * and lost ones replaced, now that their responses are in.
+		 */
+		for (i = 0; i < ntouched; i++)
+			check_tcp_connection(tinfo, stats, touched[i]);
+
 		/* Now do the rest of the processing unlocked */
 		for (i = 0; i < nrecvd; i++) {
 			if (recvd[i].short_response) {
@@ -1109,27 +4341,20 @@ do_recv(void *arg)
 			tinfo->last_recv = recvd[nrecvd - 1].when;
 
 		/*
-		 * If there was an error, handle it (by either ignoring it,
-		 * blocking, or exiting).
+		 * If there was an error, handle it (by either ignoring it or
+		 * exiting).
 		 */
-		if (nrecvd < RECV_BATCH_SIZE) {
-			if (saved_errno == EINTR) {
-				continue;
-			} else if (saved_errno == EAGAIN) {
-				perf_os_waituntilanyreadable(
-							tinfo->socks,
-							tinfo->nsocks,
-							threadpipe[0],
-							TIMEOUT_CHECK_TIME);
-				now = get_time();
-				continue;
-			} else {
-				perf_log_fatal("failed to receive packet: %s",
-					       strerror(saved_errno));
-			}
-		}
+		if (saved_errno != 0 && saved_errno != EINTR)
+			perf_log_fatal("failed to receive packet: %s",
+				       strerror(saved_errno));
+		now = get_time();
 	}
 
+	isc_mem_put(mctx, touched, 2 * tinfo->nsocks * sizeof(*touched));
+	isc_mem_put(mctx, ready, tinfo->nsocks * sizeof(*ready));
+	if (listed != NULL)
+		isc_mem_put(mctx, listed, tinfo->nsocks);
+	recv_batch_cleanup(&batch);
 	return NULL;
 }
 
@@ -1141,13 +4366,20 @@ do_interval_stats(void *arg)
 	isc_uint64_t now;
 	isc_uint64_t last_interval_time;
 	isc_uint64_t last_completed;
+	isc_uint64_t last_latency_sum;
 	isc_uint64_t interval_time;
 	isc_uint64_t num_completed;
+	isc_uint64_t latency_avg, held;
+	isc_uint64_t last_ring_taken, last_ring_fill;
+	char ring[32];
 	double qps;
 
 	tinfo = arg;
 	last_interval_time = tinfo->times->start_time;
 	last_completed = 0;
+	last_latency_sum = 0;
+	last_ring_taken = 0;
+	last_ring_fill = 0;
 
 	wait_for_start();
 	while (perf_os_waituntilreadable(threadpipe[0], threadpipe[0],
@@ -1159,11 +4391,42 @@ do_interval_stats(void *arg)
 		interval_time = now - last_interval_time;
 		num_completed = total.num_completed - last_completed;
 		qps = num_completed / (((double)interval_time) / MILLION);
-		perf_log_printf("%u.%06u: %.6lf",
-				(unsigned int)(now / MILLION),
-				(unsigned int)(now % MILLION), qps);
+		ring[0] = 0;
+		if (tinfo->config->builder)
+			snprintf(ring, sizeof(ring), " (build ring %.2lf%% full)",
+				 SAFE_DIV(100.0 * (total.ring_fill_sum -
+						   last_ring_fill),
+					  (double)(total.num_ring_taken -
+						   last_ring_taken) *
+					  BUILD_RING_SIZE));
+		if (tinfo->config->idle_conns == 0) {
+			perf_log_printf("%u.%06u: %.6lf%s",
+					(unsigned int)(now / MILLION),
+					(unsigned int)(now % MILLION), qps,
+					ring);
+		} else {
+			/* The latency seen as the idle connections mount. */
+			latency_avg = SAFE_DIV(total.latency_sum -
+					       last_latency_sum,
+					       num_completed);
+			LOCK(&idle_lock);
+			held = idle_held;
+			UNLOCK(&idle_lock);
+			perf_log_printf("%u.%06u: %.6lf (RTT %u.%06u, %"
+					ISC_PRINT_QUADFORMAT "u idle held, %"
+					ISC_PRINT_QUADFORMAT "u closed)%s",
+					(unsigned int)(now / MILLION),
+					(unsigned int)(now % MILLION), qps,
+					(unsigned int)(latency_avg / MILLION),
+					(unsigned int)(latency_avg % MILLION),
+					held, total.num_idle_closed +
+					total.num_idle_lost, ring);
+		}
 		last_interval_time = now;
 		last_completed = total.num_completed;
+		last_latency_sum = total.latency_sum;
+		last_ring_taken = total.num_ring_taken;
+		last_ring_fill = total.ring_fill_sum;
 	}
 
 	return NULL;
@@ -1203,25 +4466,72 @@ per_thread(isc_uint32_t total, isc_uint32_t nthreads, unsigned int offset)
 	return value;
 }
 
+#ifdef HAVE_LINUX_IO_URING_H
+/*
+ * The sender and receiver each get a ring of their own.  Datagram
+ * responses are received into a pool of buffers big enough for several
+ * batches.
+ */
+static void
+uring_init(threadinfo_t *tinfo)
+{
+	const config_t *config = tinfo->config;
+	unsigned int nbufs;
+	isc_result_t result;
+
+	nbufs = MIN_URING_BUFFERS;
+	while (nbufs < 4 * config->recv_batch && nbufs < MAX_URING_BUFFERS)
+		nbufs <<= 1;
+
+	/* Two batches of datagrams may be in flight at once. */
+	tinfo->send_ring = perf_uring_create(mctx, config->send_batch,
+					     2 * config->send_batch,
+					     config->uring_sqpoll);
+	if (tinfo->send_ring == NULL)
+		perf_log_fatal("cannot use io_uring: %s", strerror(errno));
+	tinfo->recv_ring = perf_uring_create(mctx, 2 * tinfo->nsocks + 1,
+					     nbufs + 2 * tinfo->nsocks,
+					     config->uring_sqpoll);
+	if (tinfo->recv_ring == NULL)
+		perf_log_fatal("cannot use io_uring: %s", strerror(errno));
+	if (config->usetcp != ISC_TRUE) {
+		result = perf_uring_provide_buffers(tinfo->recv_ring, nbufs,
+						    MAX_EDNS_PACKET);
+		if (result != ISC_R_SUCCESS)
+			perf_log_fatal("cannot use io_uring: %s",
+				       isc_result_totext(result));
+	}
+
+	tinfo->sock_gen = isc_mem_get(mctx,
+				      tinfo->nsocks * sizeof(isc_uint32_t));
+	if (tinfo->sock_gen == NULL)
+		perf_log_fatal("out of memory");
+	memset(tinfo->sock_gen, 0, tinfo->nsocks * sizeof(isc_uint32_t));
+
+	perf_uring_poll(tinfo->recv_ring, threadpipe[0], PERF_OS_EVENT_READ,
+			ISC_FALSE, URING_DATA(0, URING_PIPE, 0));
+}
+
+static void
+uring_cleanup(threadinfo_t *tinfo)
+{
+	perf_uring_destroy(&tinfo->send_ring);
+	perf_uring_destroy(&tinfo->recv_ring);
+	isc_mem_put(mctx, tinfo->sock_gen,
+		    tinfo->nsocks * sizeof(isc_uint32_t));
+}
+#endif
+
 static void
 threadinfo_init(threadinfo_t *tinfo, const config_t *config,
 		const times_t *times)
 {
-	unsigned int offset, socket_offset, i;
+	unsigned int offset, socket_offset, pool_size, size, i;
 
 	memset(tinfo, 0, sizeof(*tinfo));
 	MUTEX_INIT(&tinfo->lock);
 	COND_INIT(&tinfo->cond);
 
-	ISC_LIST_INIT(tinfo->outstanding_queries);
-	ISC_LIST_INIT(tinfo->unused_queries);
-	for (i = 0; i < NQIDS; i++) {
-		ISC_LINK_INIT(&tinfo->queries[i], link);
-		ISC_LIST_APPEND(tinfo->unused_queries,
-				&tinfo->queries[i], link);
-		tinfo->queries[i].list = &tinfo->unused_queries;
-	}
-
 	offset = tinfo - threads;
 
 	tinfo->dnsctx = perf_dns_createctx(config->updates);
@@ -1235,20 +4545,80 @@ threadinfo_init(threadinfo_t *tinfo, const config_t *config,
 	tinfo->max_outstanding = per_thread(config->max_outstanding,
 					    config->threads, offset);
 	tinfo->max_qps = per_thread(config->max_qps, config->threads, offset);
-	tinfo->nsocks = per_thread(config->clients, config->threads, offset);
+	tinfo->conn_rate = per_thread(config->conn_rate, config->threads,
+				      offset);
+	if (config->conn_rate > 0 && tinfo->conn_rate == 0)
+		tinfo->conn_rate = 1;
+	tinfo->nsocks = per_thread(config->clients, config->threads, offset) *
+			config->doq_conns;
 
 	/*
-	 * We can't have more than 64k outstanding queries per thread.
+	 * We can't have more than 64k outstanding queries per client
+	 * socket.
 	 */
-	if (tinfo->max_outstanding > NQIDS)
-		tinfo->max_outstanding = NQIDS;
-
-	if (tinfo->nsocks > MAX_SOCKETS)
-		tinfo->nsocks = MAX_SOCKETS;
+	if (tinfo->max_outstanding > (isc_uint64_t)tinfo->nsocks * NQIDS)
+		tinfo->max_outstanding = tinfo->nsocks * NQIDS;
+
+	tinfo->nqueries = tinfo->max_outstanding > 0 ?
+			  tinfo->max_outstanding : 1;
+	tinfo->queries = isc_mem_get(mctx,
+				     tinfo->nqueries * sizeof(query_info));
+	if (tinfo->queries == NULL)
+		perf_log_fatal("out of memory");
+	memset(tinfo->queries, 0, tinfo->nqueries * sizeof(query_info));
+	ISC_LIST_INIT(tinfo->outstanding_queries);
+	ISC_LIST_INIT(tinfo->unused_queries);
+	for (i = 0; i < tinfo->nqueries; i++) {
+		ISC_LINK_INIT(&tinfo->queries[i], link);
+		ISC_LINK_INIT(&tinfo->queries[i], sock_link);
+		ISC_LIST_APPEND(tinfo->unused_queries,
+				&tinfo->queries[i], link);
+		tinfo->queries[i].list = &tinfo->unused_queries;
+	}
+	for (size = 16; size < 2 * tinfo->nqueries; size *= 2)
+		;
+	tinfo->qid_table = isc_mem_get(mctx, size * sizeof(unsigned int));
+	if (tinfo->qid_table == NULL)
+		perf_log_fatal("out of memory");
+	for (i = 0; i < size; i++)
+		tinfo->qid_table[i] = QID_EMPTY;
+	tinfo->qid_mask = size - 1;
+
+	tinfo->nslots = tinfo->nsocks;
+	if (config->tcp_open_first)
+		tinfo->nsocks = tinfo->nslots * 2;
+	tinfo->nactive = tinfo->nsocks;
+	tinfo->nidle = per_thread(config->idle_conns, config->threads, offset);
+	tinfo->nsocks += tinfo->nidle;
+	tinfo->idle_rate = per_thread(config->idle_rate, config->threads,
+				      offset);
+	if (tinfo->idle_rate == 0)
+		tinfo->idle_rate = 1;
+	tinfo->idle_open_time = times->start_time;
+	tinfo->idle_keepalive_time = times->start_time + config->idle_interval;
+#ifdef HAVE_LINUX_IO_URING_H
+	if (config->uring && tinfo->nsocks > URING_MAX_SOCKETS)
+		perf_log_fatal("the uring engine supports at most %u sockets "
+			       "per thread", URING_MAX_SOCKETS);
+#endif
 
 	tinfo->socks = isc_mem_get(mctx, tinfo->nsocks * sizeof(int));
 	if (tinfo->socks == NULL)
 		perf_log_fatal("out of memory");
+	tinfo->sock_next_qid = isc_mem_get(mctx, tinfo->nsocks *
+						 sizeof(isc_uint16_t));
+	tinfo->sock_outstanding = isc_mem_get(mctx, tinfo->nsocks *
+						    sizeof(unsigned int));
+	tinfo->sock_queries = isc_mem_get(mctx, tinfo->nsocks *
+						sizeof(query_list));
+	if (tinfo->sock_next_qid == NULL || tinfo->sock_outstanding == NULL ||
+	    tinfo->sock_queries == NULL)
+		perf_log_fatal("out of memory");
+	memset(tinfo->sock_next_qid, 0, tinfo->nsocks * sizeof(isc_uint16_t));
+	memset(tinfo->sock_outstanding, 0,
+	       tinfo->nsocks * sizeof(unsigned int));
+	for (i = 0; i < tinfo->nsocks; i++)
+		ISC_LIST_INIT(tinfo->sock_queries[i]);
 
 	/* If we are using TCP create a counter for each socket to record number of queries sent */
 	if (tinfo->config->usetcp == ISC_TRUE) {
@@ -1261,6 +4631,94 @@ threadinfo_init(threadinfo_t *tinfo, const config_t *config,
 		tinfo->tcp_conn_state= isc_mem_get(mctx, tinfo->nsocks * sizeof(int));
 		if (tinfo->tcp_conn_state == NULL)
 			perf_log_fatal("out of memory");
+		tinfo->tcp_backoff = isc_mem_get(mctx, tinfo->nsocks *
+						       sizeof(isc_uint64_t));
+		tinfo->tcp_retry = isc_mem_get(mctx, tinfo->nsocks *
+						     sizeof(isc_uint64_t));
+		tinfo->tcp_open_time = isc_mem_get(mctx, tinfo->nsocks *
+							 sizeof(isc_uint64_t));
+		if (tinfo->tcp_backoff == NULL || tinfo->tcp_retry == NULL ||
+		    tinfo->tcp_open_time == NULL)
+			perf_log_fatal("out of memory");
+		memset(tinfo->tcp_backoff, 0,
+		       tinfo->nsocks * sizeof(isc_uint64_t));
+		/* Every slot is down until its first handshake completes. */
+		tinfo->slot_down_since = isc_mem_get(mctx, tinfo->nslots *
+							   sizeof(isc_uint64_t));
+		if (tinfo->slot_down_since == NULL)
+			perf_log_fatal("out of memory");
+		for (i = 0; i < tinfo->nslots; i++)
+			tinfo->slot_down_since[i] = times->start_time;
+		tinfo->tcp_bufs = isc_mem_get(mctx, tinfo->nsocks *
+						    sizeof(tcp_buffer_t));
+		if (tinfo->tcp_bufs == NULL)
+			perf_log_fatal("out of memory");
+		memset(tinfo->tcp_bufs, 0, tinfo->nsocks * sizeof(tcp_buffer_t));
+		tinfo->open_socks = isc_mem_get(mctx, tinfo->nsocks *
+						      sizeof(unsigned int));
+		tinfo->open_index = isc_mem_get(mctx, tinfo->nsocks *
+						      sizeof(unsigned int));
+		if (tinfo->open_socks == NULL || tinfo->open_index == NULL)
+			perf_log_fatal("out of memory");
+		for (i = 0; i < tinfo->nsocks; i++)
+			tinfo->open_index[i] = UINT_MAX;
+		if (tinfo->nidle > 0) {
+			tinfo->idle_up = isc_mem_get(mctx, tinfo->nidle *
+							   sizeof(isc_uint64_t));
+			if (tinfo->idle_up == NULL)
+				perf_log_fatal("out of memory");
+			memset(tinfo->idle_up, 0,
+			       tinfo->nidle * sizeof(isc_uint64_t));
+			tinfo->idle_sent = isc_mem_get(mctx, tinfo->nidle *
+							     sizeof(unsigned int));
+			if (tinfo->idle_sent == NULL)
+				perf_log_fatal("out of memory");
+			memset(tinfo->idle_sent, 0,
+			       tinfo->nidle * sizeof(unsigned int));
+		}
+#ifdef HAVE_LIBSSL
+		if (config->usetls) {
+			tinfo->tls = isc_mem_get(mctx, tinfo->nsocks *
+						       sizeof(perf_tls_t *));
+			if (tinfo->tls == NULL)
+				perf_log_fatal("out of memory");
+			memset(tinfo->tls, 0,
+			       tinfo->nsocks * sizeof(perf_tls_t *));
+		}
+#endif
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+		if (config->usedoh) {
+			tinfo->doh = isc_mem_get(mctx, tinfo->nsocks *
+						       sizeof(perf_doh_t *));
+			if (tinfo->doh == NULL)
+				perf_log_fatal("out of memory");
+			memset(tinfo->doh, 0,
+			       tinfo->nsocks * sizeof(perf_doh_t *));
+		}
+#endif
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+		if (config->usedoq) {
+			tinfo->doq = isc_mem_get(mctx, tinfo->nsocks *
+						       sizeof(perf_doq_t *));
+			if (tinfo->doq == NULL)
+				perf_log_fatal("out of memory");
+			memset(tinfo->doq, 0,
+			       tinfo->nsocks * sizeof(perf_doq_t *));
+		}
+#endif
+	}
+
+	/* Each thread rotates over its own share of the local endpoints. */
+	if (config->use_local_pool) {
+		pool_size = perf_net_localpool_size(&config->local_pool);
+		tinfo->local_first = (isc_uint64_t)pool_size * offset /
+				     config->threads;
+		tinfo->local_count = (isc_uint64_t)pool_size * (offset + 1) /
+				     config->threads - tinfo->local_first;
+		if (tinfo->local_count == 0) {
+			tinfo->local_first = offset % pool_size;
+			tinfo->local_count = 1;
+		}
 	}
 
 	socket_offset = 0;
@@ -1270,20 +4728,71 @@ threadinfo_init(threadinfo_t *tinfo, const config_t *config,
 	for (i = 0; i < tinfo->nsocks; i++) {
 		if (tinfo->config->usetcp == ISC_TRUE) {
 			sock_type = SOCK_STREAM;
-			tinfo->stats.num_tcp_conns++;
 			tinfo->sock_num_sent[i] = 0;
 			tinfo->sock_num_recv[i] = 0;
 			tinfo->tcp_conn_state[i] = TCP_CLOSED;
+			/* Idle connections are opened by the receiver. */
+			if (i >= tinfo->nactive) {
+				tinfo->socks[i] = -1;
+				continue;
+			}
+			tinfo->socks[i] = open_tcp_socket(tinfo,
+							  &tinfo->stats,
+							  socket_offset++);
+		} else {
+			tinfo->socks[i] = perf_net_opensocket(
+						&config->server_addr,
+						&config->local_addr,
+						socket_offset++,
+						config->bufsize, sock_type,
+						config->tcpopts);
+		}
+		if (tinfo->config->usetcp == ISC_TRUE) {
+			if (tinfo->socks[i] == -1) {
+				backoff_tcp_connection(tinfo, i);
+				continue;
+			}
+			tinfo->stats.num_tcp_conns++;
+			tinfo->tcp_open_time[i] = get_time();
+			tinfo->tcp_conn_state[i] = TCP_CONNECTING;
 		}
-		tinfo->socks[i] = perf_net_opensocket(&config->server_addr,
-						      &config->local_addr,
-						      socket_offset++,
-						      config->bufsize, sock_type);
-		if (tinfo->config->usetcp == ISC_TRUE && tinfo->socks[i] != -1)
-			tinfo->tcp_conn_state[i] = TCP_IN_HANDSHAKE;
 	}
 	tinfo->current_sock = 0;
+	tinfo->send_sock = -1;
+
+	/*
+	 * Register every socket for readiness notification once; the
+	 * receiver then only services sockets with something to report.
+	 * Connections still in their handshake are also watched for
+	 * writability, which signals that the connect has completed.
+	 */
+#ifdef HAVE_LINUX_IO_URING_H
+	if (config->uring)
+		uring_init(tinfo);
+	else
+#endif
+		tinfo->events = perf_os_events_create(mctx, tinfo->nsocks,
+						      threadpipe[0]);
+	for (i = 0; i < tinfo->nsocks; i++) {
+		if (tinfo->socks[i] == -1)
+			continue;
+		if (tinfo->config->usetcp == ISC_TRUE)
+			watch_socket(tinfo, i, PERF_OS_EVENT_READ |
+					       PERF_OS_EVENT_WRITE);
+		else
+			watch_socket(tinfo, i, PERF_OS_EVENT_READ);
+	}
 
+	if (config->builder) {
+		tinfo->ring = isc_mem_get(mctx,
+					  BUILD_RING_SIZE *
+					  sizeof(built_query_t));
+		if (tinfo->ring == NULL)
+			perf_log_fatal("out of memory");
+		for (i = 0; i < BUILD_RING_SIZE; i++)
+			tinfo->ring[i].desc = NULL;
+		THREAD(&tinfo->builder, do_build, tinfo);
+	}
 	THREAD(&tinfo->receiver, do_recv, tinfo);
 	THREAD(&tinfo->sender, do_send, tinfo);
 }
@@ -1293,6 +4802,11 @@ threadinfo_stop(threadinfo_t *tinfo)
 {
 	SIGNAL(&tinfo->cond);
 	JOIN(tinfo->sender, NULL);
+	if (tinfo->ring != NULL) {
+		__atomic_store_n(&tinfo->build_stop, ISC_TRUE,
+				 __ATOMIC_RELAXED);
+		JOIN(tinfo->builder, NULL);
+	}
 	JOIN(tinfo->receiver, NULL);
 }
 
@@ -1303,14 +4817,95 @@ threadinfo_cleanup(threadinfo_t *tinfo, times_t *times)
 
 	if (interrupted)
 		cancel_queries(tinfo);
-	for (i = 0; i < tinfo->nsocks; i++)
-		close(tinfo->socks[i]);
+	for (i = 0; i < tinfo->nsocks; i++) {
+		if (tinfo->socks[i] == -1)
+			continue;
+		if (tinfo->config->usetcp == ISC_TRUE)
+			close_tcp_connection(tinfo, &tinfo->stats, i,
+					     tinfo->socks[i]);
+		else
+			close(tinfo->socks[i]);
+	}
 	if (tinfo->config->usetcp == ISC_TRUE) {
 		isc_mem_put(mctx, tinfo->sock_num_recv, tinfo->nsocks * sizeof(isc_uint64_t));
 		isc_mem_put(mctx, tinfo->tcp_conn_state, tinfo->nsocks * sizeof(int));
+		isc_mem_put(mctx, tinfo->tcp_backoff,
+			    tinfo->nsocks * sizeof(isc_uint64_t));
+		isc_mem_put(mctx, tinfo->tcp_retry,
+			    tinfo->nsocks * sizeof(isc_uint64_t));
+		isc_mem_put(mctx, tinfo->tcp_open_time,
+			    tinfo->nsocks * sizeof(isc_uint64_t));
+#ifdef HAVE_LIBSSL
+		if (tinfo->tls != NULL)
+			isc_mem_put(mctx, tinfo->tls,
+				    tinfo->nsocks * sizeof(perf_tls_t *));
+#endif
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+		if (tinfo->doh != NULL)
+			isc_mem_put(mctx, tinfo->doh,
+				    tinfo->nsocks * sizeof(perf_doh_t *));
+#endif
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+		if (tinfo->doq != NULL)
+			isc_mem_put(mctx, tinfo->doq,
+				    tinfo->nsocks * sizeof(perf_doq_t *));
+#endif
+		/* Time spent down after the last query went out is moot. */
+		for (i = 0; i < tinfo->nslots; i++) {
+			if (tinfo->slot_down_since[i] != 0 &&
+			    tinfo->slot_down_since[i] < tinfo->done_send_time)
+				tinfo->stats.tcp_downtime +=
+					tinfo->done_send_time -
+					tinfo->slot_down_since[i];
+		}
+		isc_mem_put(mctx, tinfo->slot_down_since,
+			    tinfo->nslots * sizeof(isc_uint64_t));
 		isc_mem_put(mctx, tinfo->sock_num_sent, tinfo->nsocks * sizeof(isc_uint64_t));
+		for (i = 0; i < tinfo->nsocks; i++) {
+			if (tinfo->tcp_bufs[i].base != NULL)
+				isc_mem_put(mctx, tinfo->tcp_bufs[i].base,
+					    tinfo->tcp_bufs[i].size);
+		}
+		isc_mem_put(mctx, tinfo->tcp_bufs,
+			    tinfo->nsocks * sizeof(tcp_buffer_t));
+		if (tinfo->spare_buf.base != NULL)
+			isc_mem_put(mctx, tinfo->spare_buf.base,
+				    tinfo->spare_buf.size);
+		isc_mem_put(mctx, tinfo->open_socks,
+			    tinfo->nsocks * sizeof(unsigned int));
+		isc_mem_put(mctx, tinfo->open_index,
+			    tinfo->nsocks * sizeof(unsigned int));
+		if (tinfo->idle_up != NULL) {
+			isc_mem_put(mctx, tinfo->idle_up,
+				    tinfo->nidle * sizeof(isc_uint64_t));
+			isc_mem_put(mctx, tinfo->idle_sent,
+				    tinfo->nidle * sizeof(unsigned int));
+		}
 	}
 	isc_mem_put(mctx, tinfo->socks, tinfo->nsocks * sizeof(int));
+	isc_mem_put(mctx, tinfo->sock_next_qid,
+		    tinfo->nsocks * sizeof(isc_uint16_t));
+	isc_mem_put(mctx, tinfo->sock_outstanding,
+		    tinfo->nsocks * sizeof(unsigned int));
+	isc_mem_put(mctx, tinfo->sock_queries,
+		    tinfo->nsocks * sizeof(query_list));
+	isc_mem_put(mctx, tinfo->qid_table,
+		    (tinfo->qid_mask + 1) * sizeof(unsigned int));
+	isc_mem_put(mctx, tinfo->queries,
+		    tinfo->nqueries * sizeof(query_info));
+#ifdef HAVE_LINUX_IO_URING_H
+	if (tinfo->recv_ring != NULL)
+		uring_cleanup(tinfo);
+	else
+#endif
+		perf_os_events_destroy(&tinfo->events);
+	if (tinfo->ring != NULL) {
+		for (i = 0; i < BUILD_RING_SIZE; i++)
+			if (tinfo->ring[i].desc != NULL)
+				free(tinfo->ring[i].desc);
+		isc_mem_put(mctx, tinfo->ring,
+			    BUILD_RING_SIZE * sizeof(built_query_t));
+	}
 	perf_dns_destroyctx(&tinfo->dnsctx);
 	if (tinfo->last_recv > times->end_time)
 		times->end_time = tinfo->last_recv;
@@ -1337,10 +4932,19 @@ main(int argc, char **argv)
 
 	perf_datafile_setpipefd(input, threadpipe[0]);
 
+	if (config.compile_file != NULL) {
+		compile_input(&config);
+		cleanup(&config);
+		return (0);
+	}
+
 	perf_os_blocksignal(SIGINT, ISC_TRUE);
+	/* A connection closed by the server must not end the run. */
+	perf_os_handlesignal(SIGPIPE, SIG_IGN);
 
 	print_initial_status(&config);
 
+	(void)getrusage(RUSAGE_SELF, &start_usage);
 	threads = isc_mem_get(mctx, config.threads * sizeof(threadinfo_t));
 	if (threads == NULL)
 		perf_log_fatal("out of memory");
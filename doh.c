@@ -0,0 +1,508 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <nghttp2/nghttp2.h>
+
+#include <isc/list.h>
+#include <isc/mem.h>
+#include <isc/result.h>
+#include <isc/types.h>
+
+#include "doh.h"
+#include "log.h"
+#include "util.h"
+
+#define MAX_DNS_MSG		65535
+
+/* Large enough windows that flow control never holds responses back. */
+#define STREAM_WINDOW		(1 << 24)
+#define CONNECTION_WINDOW	(1 << 30)
+
+/* How much of the session's output is gathered into each write. */
+#define WRITE_CHUNK		16384
+
+typedef struct {
+	unsigned char *base;
+	size_t start;
+	size_t len;
+	size_t size;
+} doh_buffer_t;
+
+/*
+ * A request in flight.  For a POST, the DNS message follows the
+ * structure, and is read out as the body.
+ */
+typedef struct doh_stream {
+	ISC_LINK(struct doh_stream) link;
+	size_t size;
+	size_t msglen;
+	size_t offset;
+	int status;
+	doh_buffer_t body;
+} doh_stream_t;
+
+struct perf_doh {
+	isc_mem_t *mctx;
+	pthread_mutex_t lock;
+	perf_tls_t *tls;
+	nghttp2_session *session;
+	perf_doh_method_t method;
+	const char *path;
+	const char *authority;
+
+	doh_buffer_t output;		/* to be written to the TLS session */
+	doh_buffer_t responses;		/* length-prefixed, for reading */
+	isc_uint64_t nfailed;
+
+	/* nghttp2 does not hand back streams still open when it is freed. */
+	ISC_LIST(doh_stream_t) streams;
+};
+
+static void
+buffer_append(isc_mem_t *mctx, doh_buffer_t *b, const void *data, size_t len)
+{
+	unsigned char *base;
+	size_t size;
+
+	if (b->start + b->len + len > b->size) {
+		if (b->len + len <= b->size) {
+			memmove(b->base, b->base + b->start, b->len);
+		} else {
+			size = b->size != 0 ? b->size : 512;
+			while (size < b->len + len)
+				size *= 2;
+			base = isc_mem_get(mctx, size);
+			if (base == NULL)
+				perf_log_fatal("out of memory");
+			if (b->len != 0)
+				memcpy(base, b->base + b->start, b->len);
+			if (b->base != NULL)
+				isc_mem_put(mctx, b->base, b->size);
+			b->base = base;
+			b->size = size;
+		}
+		b->start = 0;
+	}
+	memcpy(b->base + b->start + b->len, data, len);
+	b->len += len;
+}
+
+static void
+buffer_consume(doh_buffer_t *b, size_t len)
+{
+	b->start += len;
+	b->len -= len;
+	if (b->len == 0)
+		b->start = 0;
+}
+
+static void
+buffer_free(isc_mem_t *mctx, doh_buffer_t *b)
+{
+	if (b->base != NULL)
+		isc_mem_put(mctx, b->base, b->size);
+	b->base = NULL;
+	b->start = b->len = b->size = 0;
+}
+
+static void
+stream_free(perf_doh_t *doh, doh_stream_t *stream)
+{
+	ISC_LIST_UNLINK(doh->streams, stream, link);
+	buffer_free(doh->mctx, &stream->body);
+	isc_mem_put(doh->mctx, stream, stream->size);
+}
+
+static ssize_t
+doh_read_body(nghttp2_session *session, int32_t stream_id, uint8_t *buf,
+	      size_t length, uint32_t *data_flags, nghttp2_data_source *source,
+	      void *user_data)
+{
+	doh_stream_t *stream = source->ptr;
+	size_t n;
+
+	(void)session;
+	(void)stream_id;
+	(void)user_data;
+
+	n = stream->msglen - stream->offset;
+	if (n > length)
+		n = length;
+	memcpy(buf, (unsigned char *)(stream + 1) + stream->offset, n);
+	stream->offset += n;
+	if (stream->offset == stream->msglen)
+		*data_flags |= NGHTTP2_DATA_FLAG_EOF;
+	return (n);
+}
+
+static int
+doh_on_header(nghttp2_session *session, const nghttp2_frame *frame,
+	      const uint8_t *name, size_t namelen, const uint8_t *value,
+	      size_t valuelen, uint8_t flags, void *user_data)
+{
+	doh_stream_t *stream;
+	size_t i;
+
+	(void)flags;
+	(void)user_data;
+
+	if (frame->hd.type != NGHTTP2_HEADERS ||
+	    namelen != 7 || memcmp(name, ":status", 7) != 0)
+		return (0);
+	stream = nghttp2_session_get_stream_user_data(session,
+						      frame->hd.stream_id);
+	if (stream == NULL)
+		return (0);
+	stream->status = 0;
+	for (i = 0; i < valuelen && value[i] >= '0' && value[i] <= '9'; i++)
+		stream->status = stream->status * 10 + value[i] - '0';
+	return (0);
+}
+
+static int
+doh_on_data(nghttp2_session *session, uint8_t flags, int32_t stream_id,
+	    const uint8_t *data, size_t len, void *user_data)
+{
+	perf_doh_t *doh = user_data;
+	doh_stream_t *stream;
+
+	(void)flags;
+
+	stream = nghttp2_session_get_stream_user_data(session, stream_id);
+	if (stream == NULL)
+		return (0);
+	/* Anything too large for a DNS message is thrown away. */
+	if (stream->body.len + len > MAX_DNS_MSG) {
+		stream->status = -1;
+		return (0);
+	}
+	buffer_append(doh->mctx, &stream->body, data, len);
+	return (0);
+}
+
+/*
+ * Passes on the response to a finished request as though it had been
+ * read from a DNS over TCP connection.
+ */
+static int
+doh_on_stream_close(nghttp2_session *session, int32_t stream_id,
+		    uint32_t error_code, void *user_data)
+{
+	perf_doh_t *doh = user_data;
+	doh_stream_t *stream;
+	unsigned char prefix[2];
+
+	stream = nghttp2_session_get_stream_user_data(session, stream_id);
+	if (stream == NULL)
+		return (0);
+	if (error_code == NGHTTP2_NO_ERROR && stream->status == 200 &&
+	    stream->body.len != 0)
+	{
+		prefix[0] = stream->body.len >> 8;
+		prefix[1] = stream->body.len & 0xff;
+		buffer_append(doh->mctx, &doh->responses, prefix, 2);
+		buffer_append(doh->mctx, &doh->responses,
+			      stream->body.base + stream->body.start,
+			      stream->body.len);
+	} else {
+		doh->nfailed++;
+	}
+	nghttp2_session_set_stream_user_data(session, stream_id, NULL);
+	stream_free(doh, stream);
+	return (0);
+}
+
+perf_doh_t *
+perf_doh_create(isc_mem_t *mctx, perf_tls_t *tls, perf_doh_method_t method,
+		const char *path, const char *authority)
+{
+	nghttp2_session_callbacks *callbacks;
+	nghttp2_settings_entry settings[2];
+	perf_doh_t *doh;
+
+	doh = isc_mem_get(mctx, sizeof(*doh));
+	if (doh == NULL)
+		perf_log_fatal("out of memory");
+	memset(doh, 0, sizeof(*doh));
+	doh->mctx = mctx;
+	MUTEX_INIT(&doh->lock);
+	doh->tls = tls;
+	doh->method = method;
+	doh->path = path;
+	doh->authority = authority;
+	ISC_LIST_INIT(doh->streams);
+
+	if (nghttp2_session_callbacks_new(&callbacks) != 0)
+		perf_log_fatal("out of memory");
+	nghttp2_session_callbacks_set_on_header_callback(callbacks,
+							 doh_on_header);
+	nghttp2_session_callbacks_set_on_data_chunk_recv_callback(callbacks,
+								  doh_on_data);
+	nghttp2_session_callbacks_set_on_stream_close_callback(callbacks,
+						doh_on_stream_close);
+	if (nghttp2_session_client_new(&doh->session, callbacks, doh) != 0)
+		perf_log_fatal("out of memory");
+	nghttp2_session_callbacks_del(callbacks);
+
+	settings[0].settings_id = NGHTTP2_SETTINGS_ENABLE_PUSH;
+	settings[0].value = 0;
+	settings[1].settings_id = NGHTTP2_SETTINGS_INITIAL_WINDOW_SIZE;
+	settings[1].value = STREAM_WINDOW;
+	nghttp2_submit_settings(doh->session, NGHTTP2_FLAG_NONE, settings, 2);
+	nghttp2_session_set_local_window_size(doh->session, NGHTTP2_FLAG_NONE,
+					      0, CONNECTION_WINDOW);
+
+	return (doh);
+}
+
+void
+perf_doh_destroy(perf_doh_t **dohp)
+{
+	perf_doh_t *doh = *dohp;
+
+	nghttp2_session_del(doh->session);
+	while (!ISC_LIST_EMPTY(doh->streams))
+		stream_free(doh, ISC_LIST_HEAD(doh->streams));
+	buffer_free(doh->mctx, &doh->output);
+	buffer_free(doh->mctx, &doh->responses);
+	MUTEX_DESTROY(&doh->lock);
+	isc_mem_put(doh->mctx, doh, sizeof(*doh));
+	*dohp = NULL;
+}
+
+/* Encodes without padding, as RFC 8484 requires. */
+static size_t
+base64url(const unsigned char *in, size_t len, char *out)
+{
+	static const char alphabet[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+		"0123456789-_";
+	size_t i, n = 0;
+	unsigned int v;
+
+	for (i = 0; i + 2 < len; i += 3) {
+		v = (in[i] << 16) | (in[i + 1] << 8) | in[i + 2];
+		out[n++] = alphabet[(v >> 18) & 0x3f];
+		out[n++] = alphabet[(v >> 12) & 0x3f];
+		out[n++] = alphabet[(v >> 6) & 0x3f];
+		out[n++] = alphabet[v & 0x3f];
+	}
+	if (i < len) {
+		v = in[i] << 16;
+		if (i + 1 < len)
+			v |= in[i + 1] << 8;
+		out[n++] = alphabet[(v >> 18) & 0x3f];
+		out[n++] = alphabet[(v >> 12) & 0x3f];
+		if (i + 1 < len)
+			out[n++] = alphabet[(v >> 6) & 0x3f];
+	}
+	out[n] = 0;
+	return (n);
+}
+
+#define NV(n, v, vlen) \
+	{ (uint8_t *)(n), (uint8_t *)(v), sizeof(n) - 1, (vlen), \
+	  NGHTTP2_NV_FLAG_NONE }
+
+isc_result_t
+perf_doh_submit(perf_doh_t *doh, const unsigned char *msg, size_t len)
+{
+	static const char type[] = "application/dns-message";
+	char target[1024 + (MAX_DNS_MSG + 2) / 3 * 4];
+	char length[16];
+	nghttp2_nv nva[] = {
+		NV(":method", "POST", 4),
+		NV(":scheme", "https", 5),
+		NV(":authority", doh->authority, strlen(doh->authority)),
+		NV(":path", doh->path, strlen(doh->path)),
+		NV("accept", type, sizeof(type) - 1),
+		NV("content-type", type, sizeof(type) - 1),
+		NV("content-length", length, 0),
+	};
+	size_t nvlen = sizeof(nva) / sizeof(nva[0]);
+	nghttp2_data_provider body, *bodyp = NULL;
+	doh_stream_t *stream;
+	size_t size, tlen;
+	int32_t id;
+
+	size = sizeof(*stream);
+	if (doh->method == perf_doh_post)
+		size += len;
+	stream = isc_mem_get(doh->mctx, size);
+	if (stream == NULL)
+		perf_log_fatal("out of memory");
+	memset(stream, 0, sizeof(*stream));
+	ISC_LINK_INIT(stream, link);
+	stream->size = size;
+
+	if (doh->method == perf_doh_post) {
+		memcpy(stream + 1, msg, len);
+		stream->msglen = len;
+		nva[6].valuelen = snprintf(length, sizeof(length), "%u",
+					   (unsigned int)len);
+		body.source.ptr = stream;
+		body.read_callback = doh_read_body;
+		bodyp = &body;
+	} else {
+		tlen = snprintf(target, 1024, "%s%cdns=", doh->path,
+				strchr(doh->path, '?') != NULL ? '&' : '?');
+		if (tlen >= 1024)
+			tlen = 1023;
+		tlen += base64url(msg, len, target + tlen);
+		nva[0].value = (uint8_t *)"GET";
+		nva[0].valuelen = 3;
+		nva[3].value = (uint8_t *)target;
+		nva[3].valuelen = tlen;
+		/* No body, so no content headers. */
+		nvlen -= 2;
+	}
+
+	LOCK(&doh->lock);
+	id = nghttp2_submit_request(doh->session, NULL, nva, nvlen, bodyp,
+				    stream);
+	if (id >= 0)
+		ISC_LIST_APPEND(doh->streams, stream, link);
+	UNLOCK(&doh->lock);
+
+	if (id < 0) {
+		perf_log_warning("HTTP/2 request failed: %s",
+				 nghttp2_strerror(id));
+		isc_mem_put(doh->mctx, stream, stream->size);
+		return (ISC_R_FAILURE);
+	}
+	return (ISC_R_SUCCESS);
+}
+
+/* Called with the lock held. */
+static isc_result_t
+doh_flush(perf_doh_t *doh)
+{
+	const uint8_t *data;
+	ssize_t n;
+
+	for (;;) {
+		/* Gather frames, so that each write carries several. */
+		while (doh->output.len < WRITE_CHUNK) {
+			n = nghttp2_session_mem_send(doh->session, &data);
+			if (n < 0) {
+				perf_log_warning("HTTP/2 session failed: %s",
+						 nghttp2_strerror(n));
+				return (ISC_R_FAILURE);
+			}
+			if (n == 0)
+				break;
+			buffer_append(doh->mctx, &doh->output, data, n);
+		}
+		if (doh->output.len == 0)
+			return (ISC_R_SUCCESS);
+		n = perf_tls_write(doh->tls,
+				   doh->output.base + doh->output.start,
+				   doh->output.len);
+		if (n > 0)
+			buffer_consume(&doh->output, n);
+		else if (n < 0 && errno == EAGAIN)
+			return (ISC_R_WOULDBLOCK);
+		else if (n < 0 && errno == EINTR)
+			continue;
+		else
+			return (ISC_R_FAILURE);
+	}
+}
+
+isc_result_t
+perf_doh_flush(perf_doh_t *doh)
+{
+	isc_result_t result;
+
+	LOCK(&doh->lock);
+	result = doh_flush(doh);
+	UNLOCK(&doh->lock);
+
+	return (result);
+}
+
+ssize_t
+perf_doh_read(perf_doh_t *doh, void *buf, size_t len)
+{
+	unsigned char input[16384];
+	ssize_t n = -1, ret;
+	int saved_errno = EAGAIN;
+
+	LOCK(&doh->lock);
+	while (doh->responses.len == 0) {
+		n = perf_tls_read(doh->tls, input, sizeof(input));
+		if (n <= 0) {
+			saved_errno = errno;
+			break;
+		}
+		ret = nghttp2_session_mem_recv(doh->session, input, n);
+		if (ret < 0) {
+			perf_log_warning("HTTP/2 session failed: %s",
+					 nghttp2_strerror(ret));
+			n = -1;
+			saved_errno = EPROTO;
+			break;
+		}
+	}
+	/*
+	 * Acknowledge settings and pings and open windows straight away;
+	 * anything that does not fit goes out with the next requests.
+	 */
+	if (n != -1 || saved_errno == EAGAIN)
+		(void)doh_flush(doh);
+
+	if (doh->responses.len != 0) {
+		ret = doh->responses.len < len ? doh->responses.len : len;
+		memcpy(buf, doh->responses.base + doh->responses.start, ret);
+		buffer_consume(&doh->responses, ret);
+		saved_errno = 0;
+	} else if (n == 0 || (!nghttp2_session_want_read(doh->session) &&
+			      !nghttp2_session_want_write(doh->session)))
+	{
+		/* The server closed the connection, or sent GOAWAY. */
+		ret = 0;
+		saved_errno = 0;
+	} else {
+		ret = -1;
+	}
+	UNLOCK(&doh->lock);
+
+	errno = saved_errno;
+	return (ret);
+}
+
+isc_uint64_t
+perf_doh_failed(perf_doh_t *doh)
+{
+	isc_uint64_t nfailed;
+
+	LOCK(&doh->lock);
+	nfailed = doh->nfailed;
+	UNLOCK(&doh->lock);
+
+	return (nfailed);
+}
+
+#endif
@@ -0,0 +1,84 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef PERF_DOH_H
+#define PERF_DOH_H 1
+
+#if defined(HAVE_LIBSSL) && defined(HAVE_LIBNGHTTP2)
+
+#include <sys/types.h>
+
+#include "tls.h"
+
+/*
+ * DNS over HTTPS [RFC8484] client connections: an HTTP/2 session over a
+ * TLS session, carrying each query on a stream of its own.  Like the TLS
+ * session below it, a connection may be written by one thread while
+ * another reads from it.
+ */
+typedef struct perf_doh perf_doh_t;
+
+typedef enum {
+	perf_doh_post,
+	perf_doh_get
+} perf_doh_method_t;
+
+/*
+ * Starts an HTTP/2 session on an established (or early data) TLS
+ * session.  Requests are made for 'path' on 'authority', both of which
+ * must remain valid for the lifetime of the connection.
+ */
+perf_doh_t *
+perf_doh_create(isc_mem_t *mctx, perf_tls_t *tls, perf_doh_method_t method,
+		const char *path, const char *authority);
+
+void
+perf_doh_destroy(perf_doh_t **dohp);
+
+/*
+ * Queues a request for the DNS message 'msg', a POST of the message, or
+ * a GET with the message in the 'dns' parameter.  Nothing is sent until
+ * perf_doh_flush() is called.
+ */
+isc_result_t
+perf_doh_submit(perf_doh_t *doh, const unsigned char *msg, size_t len);
+
+/*
+ * Writes out as much of what the session has to send as the socket
+ * takes.  Returns ISC_R_SUCCESS once it has all been written,
+ * ISC_R_WOULDBLOCK if the socket must become writable first, and
+ * ISC_R_FAILURE if the connection failed.
+ */
+isc_result_t
+perf_doh_flush(perf_doh_t *doh);
+
+/*
+ * Behaves like read() on a DNS over TCP connection: the responses are
+ * returned as a stream of DNS messages, each preceded by its length.
+ * Streams that end without a successful response are counted instead.
+ */
+ssize_t
+perf_doh_read(perf_doh_t *doh, void *buf, size_t len);
+
+/* The number of streams which ended without a successful response. */
+isc_uint64_t
+perf_doh_failed(perf_doh_t *doh);
+
+#endif
+
+#endif
@@ -0,0 +1,346 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <isc/list.h>
+#include <isc/mem.h>
+#include <isc/result.h>
+#include <isc/types.h>
+
+#include "doq.h"
+#include "log.h"
+#include "util.h"
+
+/*
+ * A query, waiting for a stream, in flight on one, or answered and
+ * waiting to be read.  The query follows the structure.
+ */
+typedef struct doq_stream {
+	ISC_LINK(struct doq_stream) link;
+	size_t size;
+	perf_tls_t *tls;
+	size_t msglen;
+	size_t written;
+	isc_boolean_t concluded;
+	isc_uint16_t qid;		/* sent as 0, as RFC 9250 requires */
+
+	unsigned char prefix[2];
+	unsigned char *response;	/* with its length prefix */
+	size_t resplen;
+	size_t nread;
+	size_t offset;			/* how much has been read out */
+} doq_stream_t;
+
+typedef ISC_LIST(doq_stream_t) doq_streamlist_t;
+
+typedef enum {
+	doq_stream_more,
+	doq_stream_done,
+	doq_stream_failed
+} doq_streamstate_t;
+
+struct perf_doq {
+	isc_mem_t *mctx;
+	pthread_mutex_t lock;
+	perf_tls_t *tls;
+	unsigned int max_streams;
+	unsigned int nopen;
+
+	doq_streamlist_t pending;
+	doq_streamlist_t open;
+	doq_streamlist_t done;
+	isc_uint64_t nfailed;
+};
+
+static void
+stream_free(perf_doq_t *doq, doq_streamlist_t *list, doq_stream_t *stream)
+{
+	ISC_LIST_UNLINK(*list, stream, link);
+	if (stream->tls != NULL)
+		perf_tls_destroy(&stream->tls);
+	if (stream->response != NULL)
+		isc_mem_put(doq->mctx, stream->response, stream->resplen);
+	isc_mem_put(doq->mctx, stream, stream->size);
+}
+
+/*
+ * Writes as much of the query as the stream takes, ending the stream
+ * once it is all written.  Returns whether the stream is still usable.
+ */
+static isc_boolean_t
+stream_write(doq_stream_t *stream)
+{
+	ssize_t n;
+
+	while (stream->written < stream->msglen) {
+		n = perf_tls_write(stream->tls,
+				   (unsigned char *)(stream + 1) +
+				   stream->written,
+				   stream->msglen - stream->written);
+		if (n > 0)
+			stream->written += n;
+		else if (n < 0 && errno == EAGAIN)
+			return (ISC_TRUE);
+		else
+			return (ISC_FALSE);
+	}
+	if (!stream->concluded) {
+		if (perf_tls_conclude(stream->tls) != ISC_R_SUCCESS)
+			return (ISC_FALSE);
+		stream->concluded = ISC_TRUE;
+	}
+	return (ISC_TRUE);
+}
+
+/*
+ * Reads what has arrived of the response: its length, then the message.
+ * It is complete once the server ends the stream straight after it.
+ */
+static doq_streamstate_t
+stream_read(perf_doq_t *doq, doq_stream_t *stream)
+{
+	unsigned char extra, *buf;
+	size_t want;
+	ssize_t n;
+
+	for (;;) {
+		if (stream->nread < 2) {
+			buf = stream->prefix + stream->nread;
+			want = 2 - stream->nread;
+		} else {
+			if (stream->response == NULL) {
+				stream->resplen = 2 + (stream->prefix[0] << 8 |
+						       stream->prefix[1]);
+				stream->response = isc_mem_get(doq->mctx,
+							       stream->resplen);
+				if (stream->response == NULL)
+					perf_log_fatal("out of memory");
+				memcpy(stream->response, stream->prefix, 2);
+			}
+			if (stream->nread < stream->resplen) {
+				buf = stream->response + stream->nread;
+				want = stream->resplen - stream->nread;
+			} else {
+				/* Only the end of the stream may follow. */
+				buf = &extra;
+				want = 1;
+			}
+		}
+		n = perf_tls_read(stream->tls, buf, want);
+		if (n > 0) {
+			if (buf == &extra)
+				return (doq_stream_failed);
+			stream->nread += n;
+		} else if (n == 0) {
+			if (stream->response == NULL ||
+			    stream->nread != stream->resplen ||
+			    stream->resplen < 4)
+				return (doq_stream_failed);
+			/* The receiver matches the response by its ID. */
+			stream->response[2] = (stream->qid >> 8) & 0xff;
+			stream->response[3] = stream->qid & 0xff;
+			return (doq_stream_done);
+		} else if (errno == EAGAIN) {
+			return (doq_stream_more);
+		} else {
+			return (doq_stream_failed);
+		}
+	}
+}
+
+/* Gives queued queries streams of their own, as far as allowed. */
+static void
+doq_open(perf_doq_t *doq)
+{
+	doq_stream_t *stream;
+
+	while ((stream = ISC_LIST_HEAD(doq->pending)) != NULL &&
+	       doq->nopen < doq->max_streams)
+	{
+		stream->tls = perf_tls_stream(doq->tls);
+		if (stream->tls == NULL)
+			break;
+		ISC_LIST_UNLINK(doq->pending, stream, link);
+		ISC_LIST_APPEND(doq->open, stream, link);
+		doq->nopen++;
+		if (!stream_write(stream)) {
+			doq->nfailed++;
+			doq->nopen--;
+			stream_free(doq, &doq->open, stream);
+		}
+	}
+}
+
+/*
+ * Finishes writing queries which did not fit, collects complete
+ * responses, and reuses the streams they free.
+ */
+static void
+doq_service(perf_doq_t *doq)
+{
+	doq_stream_t *stream, *next;
+
+	perf_tls_events(doq->tls);
+	for (stream = ISC_LIST_HEAD(doq->open); stream != NULL;
+	     stream = next)
+	{
+		next = ISC_LIST_NEXT(stream, link);
+		if (!stream_write(stream)) {
+			doq->nfailed++;
+			doq->nopen--;
+			stream_free(doq, &doq->open, stream);
+			continue;
+		}
+		switch (stream_read(doq, stream)) {
+		case doq_stream_more:
+			break;
+		case doq_stream_done:
+			perf_tls_destroy(&stream->tls);
+			doq->nopen--;
+			ISC_LIST_UNLINK(doq->open, stream, link);
+			ISC_LIST_APPEND(doq->done, stream, link);
+			break;
+		case doq_stream_failed:
+			doq->nfailed++;
+			doq->nopen--;
+			stream_free(doq, &doq->open, stream);
+			break;
+		}
+	}
+	doq_open(doq);
+}
+
+perf_doq_t *
+perf_doq_create(isc_mem_t *mctx, perf_tls_t *tls, unsigned int max_streams)
+{
+	perf_doq_t *doq;
+
+	doq = isc_mem_get(mctx, sizeof(*doq));
+	if (doq == NULL)
+		perf_log_fatal("out of memory");
+	memset(doq, 0, sizeof(*doq));
+	doq->mctx = mctx;
+	MUTEX_INIT(&doq->lock);
+	doq->tls = tls;
+	doq->max_streams = max_streams;
+	ISC_LIST_INIT(doq->pending);
+	ISC_LIST_INIT(doq->open);
+	ISC_LIST_INIT(doq->done);
+
+	return (doq);
+}
+
+void
+perf_doq_destroy(perf_doq_t **doqp)
+{
+	perf_doq_t *doq = *doqp;
+
+	while (ISC_LIST_HEAD(doq->pending) != NULL)
+		stream_free(doq, &doq->pending, ISC_LIST_HEAD(doq->pending));
+	while (ISC_LIST_HEAD(doq->open) != NULL)
+		stream_free(doq, &doq->open, ISC_LIST_HEAD(doq->open));
+	while (ISC_LIST_HEAD(doq->done) != NULL)
+		stream_free(doq, &doq->done, ISC_LIST_HEAD(doq->done));
+	MUTEX_DESTROY(&doq->lock);
+	isc_mem_put(doq->mctx, doq, sizeof(*doq));
+	*doqp = NULL;
+}
+
+void
+perf_doq_submit(perf_doq_t *doq, const unsigned char *msg, size_t len)
+{
+	doq_stream_t *stream;
+	unsigned char *p;
+	size_t size;
+
+	size = sizeof(*stream) + len;
+	stream = isc_mem_get(doq->mctx, size);
+	if (stream == NULL)
+		perf_log_fatal("out of memory");
+	memset(stream, 0, sizeof(*stream));
+	ISC_LINK_INIT(stream, link);
+	stream->size = size;
+	stream->msglen = len;
+	memcpy(stream + 1, msg, len);
+	/* The message ID, after the length, must be 0 on a QUIC stream. */
+	if (len >= 4) {
+		p = (unsigned char *)(stream + 1);
+		stream->qid = (p[2] << 8) | p[3];
+		p[2] = 0;
+		p[3] = 0;
+	}
+
+	LOCK(&doq->lock);
+	ISC_LIST_APPEND(doq->pending, stream, link);
+	doq_open(doq);
+	UNLOCK(&doq->lock);
+}
+
+ssize_t
+perf_doq_read(perf_doq_t *doq, void *buf, size_t len)
+{
+	doq_stream_t *stream;
+	unsigned char *out = buf;
+	size_t n, copied = 0;
+	ssize_t ret;
+	int saved_errno = 0;
+
+	LOCK(&doq->lock);
+	if (ISC_LIST_EMPTY(doq->done))
+		doq_service(doq);
+	while (copied < len && (stream = ISC_LIST_HEAD(doq->done)) != NULL) {
+		n = stream->resplen - stream->offset;
+		if (n > len - copied)
+			n = len - copied;
+		memcpy(out + copied, stream->response + stream->offset, n);
+		copied += n;
+		stream->offset += n;
+		if (stream->offset == stream->resplen)
+			stream_free(doq, &doq->done, stream);
+	}
+	if (copied != 0) {
+		ret = copied;
+	} else if ((perf_tls_status(doq->tls) & PERF_TLS_CLOSED) != 0) {
+		ret = 0;
+	} else {
+		ret = -1;
+		saved_errno = EAGAIN;
+	}
+	UNLOCK(&doq->lock);
+
+	errno = saved_errno;
+	return (ret);
+}
+
+isc_uint64_t
+perf_doq_failed(perf_doq_t *doq)
+{
+	isc_uint64_t nfailed;
+
+	LOCK(&doq->lock);
+	nfailed = doq->nfailed;
+	UNLOCK(&doq->lock);
+
+	return (nfailed);
+}
+
+#endif
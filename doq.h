@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef PERF_DOQ_H
+#define PERF_DOQ_H 1
+
+#if defined(HAVE_LIBSSL) && defined(HAVE_OSSL_QUIC_CLIENT_METHOD)
+
+#include <sys/types.h>
+
+#include "tls.h"
+
+/*
+ * DNS over QUIC [RFC9250] client connections, carrying each query on a
+ * bidirectional stream of its own.  Like DNS over HTTPS connections, a
+ * connection may be written by one thread while another reads from it.
+ */
+typedef struct perf_doq perf_doq_t;
+
+/*
+ * Starts using an established QUIC connection, with at most
+ * 'max_streams' queries in flight on it; more wait their turn.
+ */
+perf_doq_t *
+perf_doq_create(isc_mem_t *mctx, perf_tls_t *tls, unsigned int max_streams);
+
+void
+perf_doq_destroy(perf_doq_t **doqp);
+
+/*
+ * Sends the DNS message 'msg', which is preceded by its 2 byte length
+ * as on TCP and in DNS over QUIC alike, on a new stream, or queues it
+ * until a stream is free.  The message goes out with an ID of 0, and
+ * its ID is put back into the response before it is read.
+ */
+void
+perf_doq_submit(perf_doq_t *doq, const unsigned char *msg, size_t len);
+
+/*
+ * Behaves like read() on a DNS over TCP connection: the responses are
+ * returned as a stream of DNS messages, each preceded by its length.
+ * Streams that end without a response are counted instead.  This also
+ * services the connection, and must be called regularly for that even
+ * when the socket is not readable.
+ */
+ssize_t
+perf_doq_read(perf_doq_t *doq, void *buf, size_t len);
+
+/* The number of streams which ended without a response. */
+isc_uint64_t
+perf_doq_failed(perf_doq_t *doq);
+
+#endif
+
+#endif
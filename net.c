@@ -54,7 +54,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include <isc/mem.h>
 #include <isc/result.h>
 #include <isc/sockaddr.h>
 
@@ -135,9 +141,155 @@ perf_net_parselocal(int family, const char *name, unsigned int port,
 	}
 }
 
+/*
+ * Parses a comma separated list of local addresses, defaulting to 'local',
+ * and a port range of the form LOW-HIGH.
+ */
+void
+perf_net_parselocalpool(isc_mem_t *mctx, int family, const char *names,
+			const char *ports, const isc_sockaddr_t *local,
+			perf_net_localpool_t *pool)
+{
+	char *copy, *name, *last;
+	unsigned int low, high, i;
+	char extra;
+
+	memset(pool, 0, sizeof(*pool));
+
+	pool->naddrs = 1;
+	if (names != NULL) {
+		for (i = 0; names[i] != '\0'; i++) {
+			if (names[i] == ',')
+				pool->naddrs++;
+		}
+	}
+	pool->addrs = isc_mem_get(mctx, pool->naddrs * sizeof(isc_sockaddr_t));
+	if (pool->addrs == NULL)
+		perf_log_fatal("out of memory");
+
+	if (names == NULL) {
+		pool->addrs[0] = *local;
+	} else {
+		copy = strdup(names);
+		if (copy == NULL)
+			perf_log_fatal("out of memory");
+		i = 0;
+		for (name = strtok_r(copy, ",", &last); name != NULL;
+		     name = strtok_r(NULL, ",", &last))
+		{
+			perf_net_parselocal(family, name, 0, &pool->addrs[i]);
+			if (isc_sockaddr_pf(&pool->addrs[i]) != family) {
+				fprintf(stderr, "local address %s does not "
+					"match the server's family\n", name);
+				perf_opt_usage();
+				exit(1);
+			}
+			i++;
+		}
+		free(copy);
+		if (i != pool->naddrs) {
+			fprintf(stderr, "invalid local address list %s\n",
+				names);
+			perf_opt_usage();
+			exit(1);
+		}
+	}
+
+	if (ports != NULL) {
+		if (sscanf(ports, "%u-%u%c", &low, &high, &extra) != 2 ||
+		    low == 0 || low > high || high > 0xFFFF)
+		{
+			fprintf(stderr, "invalid local port range %s\n", ports);
+			perf_opt_usage();
+			exit(1);
+		}
+		pool->low_port = low;
+		pool->nports = high - low + 1;
+	}
+}
+
+void
+perf_net_freelocalpool(isc_mem_t *mctx, perf_net_localpool_t *pool)
+{
+	if (pool->addrs != NULL)
+		isc_mem_put(mctx, pool->addrs,
+			    pool->naddrs * sizeof(isc_sockaddr_t));
+	pool->addrs = NULL;
+}
+
+unsigned int
+perf_net_localpool_size(const perf_net_localpool_t *pool)
+{
+	return pool->naddrs * (pool->nports != 0 ? pool->nports : 1);
+}
+
+void
+perf_net_localpool_get(const perf_net_localpool_t *pool, unsigned int index,
+		       isc_sockaddr_t *addr)
+{
+	index %= perf_net_localpool_size(pool);
+	*addr = pool->addrs[index % pool->naddrs];
+	if (pool->nports != 0)
+		isc_sockaddr_setport(addr,
+				     pool->low_port + index / pool->naddrs);
+	else
+		isc_sockaddr_setport(addr, 0);
+}
+
+/*
+ * Lets a connection reuse a local port which earlier connections have
+ * left in TIME_WAIT, or, when binding to port 0, leaves the choice of
+ * port until connect(), so that the kernel only needs the whole address
+ * and port quadruple to be unique rather than the local port.
+ */
+static void
+set_bind_options(int sock, const isc_sockaddr_t *local)
+{
+	int on = 1;
+
+	if (isc_sockaddr_getport(local) != 0) {
+		if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR,
+			       &on, sizeof(on)) < 0)
+			perf_log_warning("setsockopt(SO_REUSEADDR) failed: %s",
+					 strerror(errno));
+		return;
+	}
+#ifdef IP_BIND_ADDRESS_NO_PORT
+	(void)setsockopt(sock, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT,
+			 &on, sizeof(on));
+#endif
+}
+
+static void
+set_tcp_options(int sock, unsigned int tcpopts)
+{
+	int on = 1;
+
+	if ((tcpopts & PERF_NET_TCP_NODELAY) != 0 &&
+	    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on)) < 0)
+		perf_log_warning("setsockopt(TCP_NODELAY) failed: %s",
+				 strerror(errno));
+
+	/*
+	 * connect() then returns at once, and the first write goes out in
+	 * the SYN if the server has handed us a cookie before.
+	 */
+	if ((tcpopts & PERF_NET_TCP_FASTOPEN) != 0) {
+#ifdef TCP_FASTOPEN_CONNECT
+		if (setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN_CONNECT,
+			       &on, sizeof(on)) < 0)
+			perf_log_warning("setsockopt(TCP_FASTOPEN_CONNECT) "
+					 "failed: %s", strerror(errno));
+#else
+		perf_log_warning("TCP Fast Open is not supported");
+#endif
+	}
+}
+
 int
 perf_net_opensocket(const isc_sockaddr_t *server, const isc_sockaddr_t *local,
-		    unsigned int offset, int bufsize, int sock_type)
+		    unsigned int offset, int bufsize, int sock_type,
+		    unsigned int tcpopts)
 {
 	int family;
 	int sock;
@@ -188,12 +340,37 @@ perf_net_opensocket(const isc_sockaddr_t *server, const isc_sockaddr_t *local,
 		isc_sockaddr_setport(&tmp, port);
 	}
 
-	if (bind(sock, &tmp.type.sa, tmp.length) == -1)
-		perf_log_fatal("bind: %s\n", strerror(errno));
+	if (sock_type == SOCK_STREAM)
+		set_bind_options(sock, &tmp);
+	if (bind(sock, &tmp.type.sa, tmp.length) == -1) {
+		/*
+		 * Another local endpoint may be tried for a connection, so
+		 * leave reporting the failure, with errno, to the caller.
+		 */
+		if (sock_type != SOCK_STREAM)
+			perf_log_fatal("bind: %s\n", strerror(errno));
+		ret = errno;
+		close(sock);
+		errno = ret;
+		return PERF_NET_EBIND;
+	}
+	if (sock_type == SOCK_STREAM)
+		set_tcp_options(sock, tcpopts);
 	if (sock_type == SOCK_STREAM &&
 		connect(sock, &server->type.sa, server->length) < 0) {
 		if (!(errno == EINPROGRESS || errno == EWOULDBLOCK)) {
+			/*
+			 * The local port may only be chosen, or its
+			 * quadruple checked, as the socket connects.
+			 */
+			if (errno == EADDRINUSE || errno == EADDRNOTAVAIL) {
+				ret = errno;
+				close(sock);
+				errno = ret;
+				return PERF_NET_EBIND;
+			}
 			perf_log_warning("Error connecting to socket: %s.\n", strerror(errno));
+			close(sock);
 			return -1;
 		}
 	}
@@ -215,3 +392,49 @@ perf_net_opensocket(const isc_sockaddr_t *server, const isc_sockaddr_t *local,
 
 	return sock;
 }
+
+/*
+ * Closes a socket, and returns which of the requested TCP options (see
+ * perf_net_opensocket()) actually took effect on it.
+ */
+unsigned int
+perf_net_closesocket(int sock, unsigned int tcpopts)
+{
+	unsigned int used = 0;
+	socklen_t len;
+	int on;
+
+	if ((tcpopts & PERF_NET_TCP_NODELAY) != 0) {
+		on = 0;
+		len = sizeof(on);
+		if (getsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, &len) == 0 &&
+		    on != 0)
+			used |= PERF_NET_TCP_NODELAY;
+	}
+
+#if defined(TCP_INFO) && defined(TCPI_OPT_SYN_DATA)
+	if ((tcpopts & PERF_NET_TCP_FASTOPEN) != 0) {
+		struct tcp_info info;
+
+		memset(&info, 0, sizeof(info));
+		len = sizeof(info);
+		if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) == 0 &&
+		    (info.tcpi_options & TCPI_OPT_SYN_DATA) != 0)
+			used |= PERF_NET_TCP_FASTOPEN;
+	}
+#endif
+
+	/* A zero linger time makes close() send a RST, skipping TIME_WAIT. */
+	if ((tcpopts & PERF_NET_TCP_RESET) != 0) {
+		struct linger lng;
+
+		lng.l_onoff = 1;
+		lng.l_linger = 0;
+		if (setsockopt(sock, SOL_SOCKET, SO_LINGER,
+			       &lng, sizeof(lng)) == 0)
+			used |= PERF_NET_TCP_RESET;
+	}
+
+	close(sock);
+	return used;
+}
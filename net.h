@@ -63,8 +63,52 @@ void
 perf_net_parselocal(int family, const char *name, unsigned int port,
 		    isc_sockaddr_t *addr);
 
+/*
+ * Local endpoints which connections are bound to in turn.  Endpoint 'i'
+ * is address i % naddrs and port low_port + i / naddrs; with no port
+ * range, only the address is chosen, and the kernel picks a port when
+ * connecting.
+ */
+typedef struct {
+	isc_sockaddr_t *addrs;
+	unsigned int naddrs;
+	unsigned int low_port;
+	unsigned int nports;
+} perf_net_localpool_t;
+
+void
+perf_net_parselocalpool(isc_mem_t *mctx, int family, const char *names,
+			const char *ports, const isc_sockaddr_t *local,
+			perf_net_localpool_t *pool);
+
+void
+perf_net_freelocalpool(isc_mem_t *mctx, perf_net_localpool_t *pool);
+
+unsigned int
+perf_net_localpool_size(const perf_net_localpool_t *pool);
+
+void
+perf_net_localpool_get(const perf_net_localpool_t *pool, unsigned int index,
+		       isc_sockaddr_t *addr);
+
+/* TCP options for perf_net_opensocket() and perf_net_closesocket(). */
+#define PERF_NET_TCP_NODELAY	0x01	/* disable Nagle */
+#define PERF_NET_TCP_FASTOPEN	0x02	/* send the first data in the SYN */
+#define PERF_NET_TCP_RESET	0x04	/* close with a RST */
+
+/*
+ * Returned by perf_net_opensocket() when a stream socket could not be
+ * bound, or its local endpoint was unavailable as it connected, with errno
+ * set; other failures return -1.
+ */
+#define PERF_NET_EBIND		(-2)
+
 int
 perf_net_opensocket(const isc_sockaddr_t *server, const isc_sockaddr_t *local,
-		    unsigned int offset, int bufsize, int sock_type);
+		    unsigned int offset, int bufsize, int sock_type,
+		    unsigned int tcpopts);
+
+unsigned int
+perf_net_closesocket(int sock, unsigned int tcpopts);
 
 #endif
@@ -31,10 +31,12 @@
 #include "util.h"
 
 #define MAX_OPTS 64
+#define MAX_LONG_OPTS 64
 #define LINE_LENGTH 80
 
 typedef struct {
 	char c;
+	const char *name;
 	perf_opttype_t type;
 	const char *desc;
 	const char *help;
@@ -53,6 +55,8 @@ typedef struct {
 
 static opt_t opts[MAX_OPTS];
 static unsigned int nopts;
+static opt_t long_opts[MAX_LONG_OPTS];
+static unsigned int nlong_opts;
 static char optstr[MAX_OPTS * 2 + 2];
 static const char *progname;
 
@@ -67,6 +71,7 @@ perf_opt_add(char c, perf_opttype_t type, const char *desc, const char *help,
 		perf_log_fatal("too many defined options");
 	opt = &opts[nopts++];
 	opt->c = c;
+	opt->name = NULL;
 	opt->type = type;
 	opt->desc = desc;
 	opt->help = help;
@@ -82,6 +87,29 @@ perf_opt_add(char c, perf_opttype_t type, const char *desc, const char *help,
 	strcat(optstr, s);
 }
 
+void
+perf_long_opt_add(const char *name, perf_opttype_t type, const char *desc,
+		  const char *help, const char *defval, void *valp)
+{
+	opt_t *opt;
+
+	if (nlong_opts == MAX_LONG_OPTS)
+		perf_log_fatal("too many defined extended options");
+	opt = &long_opts[nlong_opts++];
+	opt->c = 'O';
+	opt->name = name;
+	opt->type = type;
+	opt->desc = desc;
+	opt->help = help;
+	if (defval != NULL) {
+		strncpy(opt->defvalbuf, defval, sizeof(opt->defvalbuf));
+		opt->defval = opt->defvalbuf;
+	} else {
+		opt->defval = NULL;
+	}
+	opt->u.valp = valp;
+}
+
 void
 perf_opt_usage(void)
 {
@@ -113,6 +141,19 @@ perf_opt_usage(void)
 			fprintf(stderr, " (default: %s)", opts[i].defval);
 		fprintf(stderr, "\n");
 	}
+
+	if (nlong_opts == 0)
+		return;
+	fprintf(stderr, "\nExtended options:\n");
+	for (i = 0; i < nlong_opts; i++) {
+		fprintf(stderr, "  -O %s", long_opts[i].name);
+		if (long_opts[i].desc != NULL)
+			fprintf(stderr, "=%s", long_opts[i].desc);
+		fprintf(stderr, "\n      %s", long_opts[i].help);
+		if (long_opts[i].defval)
+			fprintf(stderr, " (default: %s)", long_opts[i].defval);
+		fprintf(stderr, "\n");
+	}
 }
 
 static isc_uint32_t
@@ -183,17 +224,74 @@ parse_double(const char *desc, const char *str) {
 	exit(1);
 }
 
+static void
+set_value(opt_t *opt, const char *arg)
+{
+	switch (opt->type) {
+	case perf_opt_string:
+		*opt->u.stringp = (char *)arg;
+		break;
+	case perf_opt_boolean:
+		*opt->u.boolp = ISC_TRUE;
+		break;
+	case perf_opt_uint:
+		*opt->u.uintp = parse_uint(opt->desc, arg, 1, 0xFFFFFFFF);
+		break;
+	case perf_opt_timeval:
+		*opt->u.uint64p = parse_timeval(opt->desc, arg);
+		break;
+	case perf_opt_double:
+		*opt->u.doublep = parse_double(opt->desc, arg);
+		break;
+	case perf_opt_port:
+		*opt->u.portp = parse_uint(opt->desc, arg, 0, 0xFFFF);
+		break;
+	}
+}
+
+/*
+ * Handles -O name[=value].  Boolean extended options take no value.
+ */
+static void
+parse_long_opt(const char *arg)
+{
+	const char *value;
+	size_t namelen;
+	unsigned int i;
+
+	value = strchr(arg, '=');
+	namelen = (value != NULL) ? (size_t)(value - arg) : strlen(arg);
+	for (i = 0; i < nlong_opts; i++) {
+		if (strlen(long_opts[i].name) == namelen &&
+		    strncmp(long_opts[i].name, arg, namelen) == 0)
+			break;
+	}
+	if (i == nlong_opts) {
+		fprintf(stderr, "invalid extended option: %s\n", arg);
+		perf_opt_usage();
+		exit(1);
+	}
+	if ((long_opts[i].type == perf_opt_boolean) != (value == NULL)) {
+		fprintf(stderr, "invalid extended option syntax: %s\n", arg);
+		perf_opt_usage();
+		exit(1);
+	}
+	set_value(&long_opts[i], value != NULL ? value + 1 : NULL);
+}
+
 void
 perf_opt_parse(int argc, char **argv)
 {
 	int c;
-	opt_t *opt;
 	unsigned int i;
 
 	progname = isc_file_basename(argv[0]);
 
 	perf_opt_add('h', perf_opt_boolean, NULL, "print this help",
 		     NULL, NULL);
+	if (nlong_opts > 0)
+		perf_opt_add('O', perf_opt_string, "name=value",
+			     "set an extended option (see below)", NULL, NULL);
 
 	while ((c = getopt(argc, argv, optstr)) != -1) {
 		for (i = 0; i < nopts; i++) {
@@ -208,29 +306,11 @@ perf_opt_parse(int argc, char **argv)
 			perf_opt_usage();
 			exit(0);
 		}
-		opt = &opts[i];
-		switch (opt->type) {
-		case perf_opt_string:
-			*opt->u.stringp = optarg;
-			break;
-		case perf_opt_boolean:
-			*opt->u.boolp = ISC_TRUE;
-			break;
-		case perf_opt_uint:
-			*opt->u.uintp = parse_uint(opt->desc, optarg,
-						   1, 0xFFFFFFFF);
-			break;
-		case perf_opt_timeval:
-			*opt->u.uint64p = parse_timeval(opt->desc, optarg);
-			break;
-		case perf_opt_double:
-			*opt->u.doublep = parse_double(opt->desc, optarg);
-			break;
-		case perf_opt_port:
-			*opt->u.portp = parse_uint(opt->desc, optarg,
-						   0, 0xFFFF);
-			break;
+		if (c == 'O' && nlong_opts > 0) {
+			parse_long_opt(optarg);
+			continue;
 		}
+		set_value(&opts[i], optarg);
 	}
 	if (optind != argc) {
 		fprintf(stderr, "unexpected argument %s\n", argv[optind]);
@@ -31,6 +31,10 @@ void
 perf_opt_add(char c, perf_opttype_t type, const char *desc, const char *help,
 	     const char *defval, void *valp);
 
+void
+perf_long_opt_add(const char *name, perf_opttype_t type, const char *desc,
+		  const char *help, const char *defval, void *valp);
+
 void
 perf_opt_usage(void);
 
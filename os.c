@@ -33,12 +33,19 @@
  */
 
 #include <errno.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <poll.h>
+#include <sys/resource.h>
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
 
+#include <isc/mem.h>
 #include <isc/result.h>
 #include <isc/types.h>
 
@@ -73,6 +80,29 @@ perf_os_handlesignal(int sig, void (*handler)(int))
 		perf_log_fatal("sigaction: %s", strerror(errno));
 }
 
+/*
+ * Raises the limit on open files towards 'wanted', as far as the hard
+ * limit allows, and returns the limit then in effect.
+ */
+unsigned int
+perf_os_raisefdlimit(unsigned int wanted)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return (UINT_MAX);
+	if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur < wanted) {
+		rl.rlim_cur = wanted;
+		if (rl.rlim_max != RLIM_INFINITY && rl.rlim_cur > rl.rlim_max)
+			rl.rlim_cur = rl.rlim_max;
+		if (setrlimit(RLIMIT_NOFILE, &rl) < 0)
+			(void)getrlimit(RLIMIT_NOFILE, &rl);
+	}
+	if (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > UINT_MAX)
+		return (UINT_MAX);
+	return ((unsigned int)rl.rlim_cur);
+}
+
 isc_result_t
 perf_os_waituntilwriteable(int fd, isc_int64_t timeout)
 {
@@ -130,36 +160,253 @@ perf_os_waituntilreadable(int fd, int pipe_fd, isc_int64_t timeout)
 	}
 }
 
-isc_result_t
-perf_os_waituntilanyreadable(int *fds, unsigned int nfds, int pipe_fd,
-			     isc_int64_t timeout)
+/*
+ * Readiness notification for a set of sockets.  Each socket is registered
+ * once with a caller-chosen id, and waiting returns only the sockets which
+ * have something to report.  epoll is used where available; otherwise the
+ * registered sockets are polled.
+ */
+struct perf_os_events {
+	isc_mem_t *mctx;
+	unsigned int maxids;
+	int pipe_fd;
+#ifdef HAVE_SYS_EPOLL_H
+	int epfd;
+	struct epoll_event *epevents;
+#else
+	isc_boolean_t pipe_seen;
+	struct pollfd *pfds;
+#endif
+};
+
+#ifdef HAVE_SYS_EPOLL_H
+#define PIPE_ID UINT_MAX
+
+static isc_uint32_t
+to_epoll(unsigned int what)
 {
-	struct pollfd read_fds[nfds];
-	int timeout_msec;
-	unsigned int i;
-	int n;
+	isc_uint32_t events = 0;
+
+	if ((what & PERF_OS_EVENT_READ) != 0)
+		events |= EPOLLIN;
+	if ((what & PERF_OS_EVENT_WRITE) != 0)
+		events |= EPOLLOUT;
+	return events;
+}
+
+static void
+epoll_ctl_or_die(perf_os_events_t *events, int op, int fd, unsigned int id,
+		 isc_uint32_t what)
+{
+	struct epoll_event ev;
 
-	for (i = 0; i < nfds; i++) {
-		read_fds[i].fd = fds[i];
-		read_fds[i].events = POLLIN;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = what;
+	ev.data.u32 = id;
+	if (epoll_ctl(events->epfd, op, fd, &ev) < 0)
+		perf_log_fatal("epoll_ctl() failed: Error was %s",
+			       strerror(errno));
+}
+#endif
+
+perf_os_events_t *
+perf_os_events_create(isc_mem_t *mctx, unsigned int maxids, int pipe_fd)
+{
+	perf_os_events_t *events;
+
+	events = isc_mem_get(mctx, sizeof(*events));
+	if (events == NULL)
+		perf_log_fatal("out of memory");
+	memset(events, 0, sizeof(*events));
+	events->mctx = mctx;
+	events->maxids = maxids;
+	events->pipe_fd = pipe_fd;
+
+#ifdef HAVE_SYS_EPOLL_H
+	events->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (events->epfd < 0)
+		perf_log_fatal("epoll_create1() failed: Error was %s",
+			       strerror(errno));
+	events->epevents = isc_mem_get(mctx, (maxids + 1) *
+					     sizeof(struct epoll_event));
+	if (events->epevents == NULL)
+		perf_log_fatal("out of memory");
+	/*
+	 * The pipe is shared by all threads and never drained, so only
+	 * report it once.
+	 */
+	if (pipe_fd >= 0)
+		epoll_ctl_or_die(events, EPOLL_CTL_ADD, pipe_fd, PIPE_ID,
+				 EPOLLIN | EPOLLONESHOT);
+#else
+	{
+		unsigned int i;
+
+		events->pfds = isc_mem_get(mctx, (maxids + 1) *
+						 sizeof(struct pollfd));
+		if (events->pfds == NULL)
+			perf_log_fatal("out of memory");
+		for (i = 0; i < maxids; i++)
+			events->pfds[i].fd = -1;
+		events->pfds[maxids].fd = pipe_fd;
+		events->pfds[maxids].events = POLLIN;
 	}
-	read_fds[nfds].fd = pipe_fd;
+#endif
+
+	return events;
+}
+
+void
+perf_os_events_destroy(perf_os_events_t **eventsp)
+{
+	perf_os_events_t *events;
+
+	ISC_INSIST(eventsp != NULL && *eventsp != NULL);
+
+	events = *eventsp;
+	*eventsp = NULL;
+
+#ifdef HAVE_SYS_EPOLL_H
+	close(events->epfd);
+	isc_mem_put(events->mctx, events->epevents,
+		    (events->maxids + 1) * sizeof(struct epoll_event));
+#else
+	isc_mem_put(events->mctx, events->pfds,
+		    (events->maxids + 1) * sizeof(struct pollfd));
+#endif
+	isc_mem_put(events->mctx, events, sizeof(*events));
+}
+
+void
+perf_os_events_add(perf_os_events_t *events, int fd, unsigned int id,
+		   unsigned int what)
+{
+	ISC_INSIST(id < events->maxids);
+
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_ctl_or_die(events, EPOLL_CTL_ADD, fd, id, to_epoll(what));
+#else
+	events->pfds[id].fd = fd;
+	events->pfds[id].events = 0;
+	if ((what & PERF_OS_EVENT_READ) != 0)
+		events->pfds[id].events |= POLLIN;
+	if ((what & PERF_OS_EVENT_WRITE) != 0)
+		events->pfds[id].events |= POLLOUT;
+#endif
+}
+
+void
+perf_os_events_modify(perf_os_events_t *events, int fd, unsigned int id,
+		      unsigned int what)
+{
+	ISC_INSIST(id < events->maxids);
+
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_ctl_or_die(events, EPOLL_CTL_MOD, fd, id, to_epoll(what));
+#else
+	perf_os_events_add(events, fd, id, what);
+#endif
+}
+
+void
+perf_os_events_remove(perf_os_events_t *events, int fd, unsigned int id)
+{
+	ISC_INSIST(id < events->maxids);
+
+#ifdef HAVE_SYS_EPOLL_H
+	/* The socket may already have been closed. */
+	(void)epoll_ctl(events->epfd, EPOLL_CTL_DEL, fd, NULL);
+	(void)id;
+#else
+	(void)fd;
+	events->pfds[id].fd = -1;
+#endif
+}
+
+isc_result_t
+perf_os_events_wait(perf_os_events_t *events, perf_os_event_t *ready,
+		    unsigned int maxready, unsigned int *nreadyp,
+		    isc_int64_t timeout)
+{
+	int timeout_msec;
+	unsigned int nready;
+	isc_boolean_t canceled;
+	int i, n;
 
 	if (timeout < 0) {
-		timeout_msec = 0;
+		timeout_msec = -1;
 	} else {
 		timeout_msec = timeout / THOUSAND;
 	}
-	n = poll(read_fds, nfds, timeout_msec);
+
+	nready = 0;
+	canceled = ISC_FALSE;
+#ifdef HAVE_SYS_EPOLL_H
+	if (maxready > events->maxids + 1)
+		maxready = events->maxids + 1;
+	n = epoll_wait(events->epfd, events->epevents, maxready,
+		       timeout_msec);
 	if (n < 0) {
 		if (errno != EINTR)
-			perf_log_fatal("select() failed: Error was %s", strerror(errno));
+			perf_log_fatal("epoll_wait() failed: Error was %s",
+				       strerror(errno));
+		*nreadyp = 0;
 		return (ISC_R_CANCELED);
-	} else if (n == 0) {
-		return (ISC_R_TIMEDOUT);
-	} else if (read_fds[nfds].revents & POLLIN) {
+	}
+	for (i = 0; i < n; i++) {
+		struct epoll_event *ev = &events->epevents[i];
+
+		if (ev->data.u32 == PIPE_ID) {
+			canceled = ISC_TRUE;
+			continue;
+		}
+		ready[nready].id = ev->data.u32;
+		ready[nready].what = 0;
+		if ((ev->events & EPOLLIN) != 0)
+			ready[nready].what |= PERF_OS_EVENT_READ;
+		if ((ev->events & EPOLLOUT) != 0)
+			ready[nready].what |= PERF_OS_EVENT_WRITE;
+		if ((ev->events & (EPOLLERR | EPOLLHUP)) != 0)
+			ready[nready].what |= PERF_OS_EVENT_ERROR;
+		nready++;
+	}
+#else
+	n = poll(events->pfds, events->maxids + (events->pipe_seen ? 0 : 1),
+		 timeout_msec);
+	if (n < 0) {
+		if (errno != EINTR)
+			perf_log_fatal("poll() failed: Error was %s",
+				       strerror(errno));
+		*nreadyp = 0;
 		return (ISC_R_CANCELED);
-	} else {
-		return (ISC_R_SUCCESS);
 	}
+	if (!events->pipe_seen &&
+	    (events->pfds[events->maxids].revents & POLLIN) != 0)
+	{
+		events->pipe_seen = ISC_TRUE;
+		canceled = ISC_TRUE;
+	}
+	for (i = 0; i < (int)events->maxids && nready < maxready; i++) {
+		struct pollfd *pfd = &events->pfds[i];
+
+		if (pfd->fd < 0 || pfd->revents == 0)
+			continue;
+		ready[nready].id = i;
+		ready[nready].what = 0;
+		if ((pfd->revents & POLLIN) != 0)
+			ready[nready].what |= PERF_OS_EVENT_READ;
+		if ((pfd->revents & POLLOUT) != 0)
+			ready[nready].what |= PERF_OS_EVENT_WRITE;
+		if ((pfd->revents & (POLLERR | POLLHUP | POLLNVAL)) != 0)
+			ready[nready].what |= PERF_OS_EVENT_ERROR;
+		nready++;
+	}
+#endif
+
+	*nreadyp = nready;
+	if (canceled)
+		return (ISC_R_CANCELED);
+	if (nready == 0)
+		return (ISC_R_TIMEDOUT);
+	return (ISC_R_SUCCESS);
 }
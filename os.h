@@ -41,14 +41,46 @@ perf_os_blocksignal(int sig, isc_boolean_t block);
 void
 perf_os_handlesignal(int sig, void (*handler)(int));
 
+unsigned int
+perf_os_raisefdlimit(unsigned int wanted);
+
 isc_result_t
 perf_os_waituntilwriteable(int fd, isc_int64_t timeout);
 
 isc_result_t
 perf_os_waituntilreadable(int fd, int pipe_fd, isc_int64_t timeout);
 
+typedef struct perf_os_events perf_os_events_t;
+
+#define PERF_OS_EVENT_READ	0x01
+#define PERF_OS_EVENT_WRITE	0x02
+#define PERF_OS_EVENT_ERROR	0x04
+
+typedef struct {
+	unsigned int id;
+	unsigned int what;
+} perf_os_event_t;
+
+perf_os_events_t *
+perf_os_events_create(isc_mem_t *mctx, unsigned int maxids, int pipe_fd);
+
+void
+perf_os_events_destroy(perf_os_events_t **eventsp);
+
+void
+perf_os_events_add(perf_os_events_t *events, int fd, unsigned int id,
+		   unsigned int what);
+
+void
+perf_os_events_modify(perf_os_events_t *events, int fd, unsigned int id,
+		      unsigned int what);
+
+void
+perf_os_events_remove(perf_os_events_t *events, int fd, unsigned int id);
+
 isc_result_t
-perf_os_waituntilanyreadable(int *fds, unsigned int nfds, int pipe_fd,
-			     isc_int64_t timeout);
+perf_os_events_wait(perf_os_events_t *events, perf_os_event_t *ready,
+		    unsigned int maxready, unsigned int *nreadyp,
+		    isc_int64_t timeout);
 
 #endif
@@ -130,6 +130,7 @@ static isc_boolean_t edns;
 static isc_boolean_t dnssec;
 
 static perf_datafile_t *input;
+static isc_boolean_t compiled;
 
 /* The target traffic level at the end of the ramp-up */
 double max_qps = 100000.0;
@@ -240,6 +241,7 @@ setup(int argc, char **argv)
 	in_port_t local_port = DEFAULT_LOCAL_PORT;
 	const char *filename = NULL;
 	const char *tsigkey_str = NULL;
+	isc_boolean_t compiled_updates;
 	int sock_family;
 	unsigned int bufsize;
 	unsigned int i;
@@ -346,6 +348,9 @@ setup(int argc, char **argv)
 			    local_name, local_port, &local_addr);
 
 	input = perf_datafile_open(mctx, filename);
+	compiled = perf_datafile_iscompiled(input, &compiled_updates);
+	if (compiled && compiled_updates)
+		perf_log_fatal("the input holds compiled updates");
 
 	if (dnssec)
 		edns = ISC_TRUE;
@@ -358,7 +363,7 @@ setup(int argc, char **argv)
 		perf_log_fatal("out of memory");
 	for (i = 0; i < nsocks; i++)
 		socks[i] = perf_net_opensocket(&server_addr, &local_addr, i,
-					       bufsize, SOCK_DGRAM);
+					       bufsize, SOCK_DGRAM, 0);
 
 }
 
@@ -480,11 +485,15 @@ do_one_line(isc_buffer_t *lines, isc_buffer_t *msg) {
 	unsigned int length;
 	isc_result_t result;
 
-	isc_buffer_clear(lines);
-	result = perf_datafile_next(input, lines, ISC_FALSE);
+	if (compiled) {
+		result = perf_datafile_nextmsg(input, &used);
+	} else {
+		isc_buffer_clear(lines);
+		result = perf_datafile_next(input, lines, ISC_FALSE);
+		isc_buffer_usedregion(lines, &used);
+	}
 	if (result != ISC_R_SUCCESS)
 		perf_log_fatal("ran out of query data");
-	isc_buffer_usedregion(lines, &used);
 
 	q = ISC_LIST_HEAD(instanding_list);
 	if (! q)
@@ -493,8 +502,14 @@ do_one_line(isc_buffer_t *lines, isc_buffer_t *msg) {
 	sock = (q - queries) % nsocks;
 
 	isc_buffer_clear(msg);
-	result = perf_dns_buildrequest(NULL, (isc_textregion_t *) &used,
-				       qid, edns, dnssec, tsigkey, msg);
+	if (compiled)
+		result = perf_dns_copyrequest(&used, qid, edns, dnssec,
+					      tsigkey, msg);
+	else
+		result = perf_dns_buildrequest(NULL,
+					       (isc_textregion_t *) &used,
+					       qid, edns, dnssec, tsigkey,
+					       msg);
 	if (result != ISC_R_SUCCESS)
 		return (result);
 
@@ -0,0 +1,198 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stddef.h>
+
+#if defined(HAVE_IMMINTRIN_H) && defined(__SSE2__)
+#include <immintrin.h>
+#define SCAN_SSE2 1
+#if defined(__GNUC__) && !defined(__AVX2__)
+#define SCAN_AVX2 1
+#define AVX2_TARGET __attribute__((target("avx2")))
+#elif defined(__AVX2__)
+#define SCAN_AVX2 1
+#define AVX2_TARGET
+#endif
+#endif
+
+#include "scan.h"
+
+static inline int
+is_space(int c)
+{
+	return (c == ' ' || c == '\t' || c == '\n' || c == '\0');
+}
+
+#ifdef SCAN_AVX2
+static AVX2_TARGET size_t
+newline_avx2(const char *p, size_t len)
+{
+	const __m256i nl = _mm256_set1_epi8('\n');
+	size_t i;
+	unsigned int mask;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+			_mm256_loadu_si256((const __m256i *)(p + i)), nl));
+		if (mask != 0)
+			return (i + __builtin_ctz(mask));
+	}
+	for (; i < len; i++)
+		if (p[i] == '\n')
+			return (i);
+	return (len);
+}
+
+static AVX2_TARGET size_t
+space_avx2(const char *p, size_t len)
+{
+	const __m256i sp = _mm256_set1_epi8(' ');
+	const __m256i tab = _mm256_set1_epi8('\t');
+	const __m256i nl = _mm256_set1_epi8('\n');
+	const __m256i nul = _mm256_setzero_si256();
+	__m256i v, hit;
+	size_t i;
+	unsigned int mask;
+
+	for (i = 0; i + 32 <= len; i += 32) {
+		v = _mm256_loadu_si256((const __m256i *)(p + i));
+		hit = _mm256_or_si256(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+					_mm256_cmpeq_epi8(v, tab)),
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, nl),
+					_mm256_cmpeq_epi8(v, nul)));
+		mask = _mm256_movemask_epi8(hit);
+		if (mask != 0)
+			return (i + __builtin_ctz(mask));
+	}
+	for (; i < len; i++)
+		if (is_space(p[i]))
+			return (i);
+	return (len);
+}
+#endif
+
+#ifdef SCAN_SSE2
+static size_t
+newline_sse2(const char *p, size_t len)
+{
+	const __m128i nl = _mm_set1_epi8('\n');
+	size_t i;
+	unsigned int mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		mask = _mm_movemask_epi8(_mm_cmpeq_epi8(
+			_mm_loadu_si128((const __m128i *)(p + i)), nl));
+		if (mask != 0)
+			return (i + __builtin_ctz(mask));
+	}
+	for (; i < len; i++)
+		if (p[i] == '\n')
+			return (i);
+	return (len);
+}
+
+static size_t
+space_sse2(const char *p, size_t len)
+{
+	const __m128i sp = _mm_set1_epi8(' ');
+	const __m128i tab = _mm_set1_epi8('\t');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i nul = _mm_setzero_si128();
+	__m128i v, hit;
+	size_t i;
+	unsigned int mask;
+
+	for (i = 0; i + 16 <= len; i += 16) {
+		v = _mm_loadu_si128((const __m128i *)(p + i));
+		hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp),
+						_mm_cmpeq_epi8(v, tab)),
+				   _mm_or_si128(_mm_cmpeq_epi8(v, nl),
+						_mm_cmpeq_epi8(v, nul)));
+		mask = _mm_movemask_epi8(hit);
+		if (mask != 0)
+			return (i + __builtin_ctz(mask));
+	}
+	for (; i < len; i++)
+		if (is_space(p[i]))
+			return (i);
+	return (len);
+}
+#else
+static size_t
+newline_scalar(const char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (p[i] == '\n')
+			return (i);
+	return (len);
+}
+
+static size_t
+space_scalar(const char *p, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++)
+		if (is_space(p[i]))
+			return (i);
+	return (len);
+}
+#endif
+
+#ifdef SCAN_AVX2
+static int
+have_avx2(void)
+{
+	static int avx2 = -1;
+
+	/* Every thread finds the same answer, so a race does no harm. */
+	if (avx2 < 0)
+		avx2 = __builtin_cpu_supports("avx2") ? 1 : 0;
+	return (avx2);
+}
+#endif
+
+size_t
+perf_scan_newline(const char *p, size_t len)
+{
+#ifdef SCAN_AVX2
+	if (len >= 32 && have_avx2())
+		return (newline_avx2(p, len));
+#endif
+#ifdef SCAN_SSE2
+	return (newline_sse2(p, len));
+#else
+	return (newline_scalar(p, len));
+#endif
+}
+
+size_t
+perf_scan_space(const char *p, size_t len)
+{
+#ifdef SCAN_AVX2
+	if (len >= 32 && have_avx2())
+		return (space_avx2(p, len));
+#endif
+#ifdef SCAN_SSE2
+	return (space_sse2(p, len));
+#else
+	return (space_scalar(p, len));
+#endif
+}
@@ -0,0 +1,38 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PERF_SCAN_H
+#define PERF_SCAN_H 1
+
+#include <stddef.h>
+
+/*
+ * Searches for the end of a line, or of a token, in input text, using
+ * the widest vector instructions the CPU has (AVX2 or SSE2), or one byte
+ * at a time where there are none.  Each returns the offset of the first
+ * byte found, or 'len' if there is none.
+ */
+
+/* The first newline. */
+size_t
+perf_scan_newline(const char *p, size_t len);
+
+/* The first space, tab, newline or NUL, as strcspn(p, " \t\n") would. */
+size_t
+perf_scan_space(const char *p, size_t len);
+
+#endif
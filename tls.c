@@ -0,0 +1,576 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifdef HAVE_LIBSSL
+
+#include <errno.h>
+#include <pthread.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include <isc/mem.h>
+#include <isc/result.h>
+#include <isc/types.h>
+
+#include "log.h"
+#include "os.h"
+#include "tls.h"
+#include "util.h"
+
+/* Enough tickets to go round a burst of new connections. */
+#define MAX_SESSIONS	256
+
+struct perf_tlsctx {
+	isc_mem_t *mctx;
+	SSL_CTX *ctx;
+	const char *servername;
+	perf_tls_resume_t resume;
+	isc_boolean_t quic;
+
+	/* Sessions the servers have issued tickets for, newest last. */
+	pthread_mutex_t lock;
+	SSL_SESSION *sessions[MAX_SESSIONS];
+	unsigned int nsessions;
+};
+
+struct perf_tls {
+	isc_mem_t *mctx;
+	pthread_mutex_t lock;
+	SSL *ssl;
+	isc_boolean_t quic;
+	isc_boolean_t stream;		/* a QUIC stream, not a connection */
+	isc_boolean_t early;
+	isc_boolean_t early_writing;
+	size_t early_left;
+	size_t early_sent;
+	isc_boolean_t write_wants_read;
+};
+
+static void
+tls_log_error(const char *what)
+{
+	unsigned long err;
+	char buf[256];
+
+	err = ERR_get_error();
+	if (err == 0) {
+		perf_log_warning("%s: %s", what,
+				 errno != 0 ? strerror(errno) :
+				 "connection closed");
+		return;
+	}
+	ERR_error_string_n(err, buf, sizeof(buf));
+	perf_log_warning("%s: %s", what, buf);
+	ERR_clear_error();
+}
+
+/*
+ * Keeps each session the server offers for resumption.  Once the cache
+ * is full, the oldest make way.
+ */
+static int
+tls_new_session(SSL *ssl, SSL_SESSION *session)
+{
+	perf_tlsctx_t *ctx;
+
+	ctx = SSL_CTX_get_app_data(SSL_get_SSL_CTX(ssl));
+	LOCK(&ctx->lock);
+	if (ctx->nsessions == MAX_SESSIONS) {
+		SSL_SESSION_free(ctx->sessions[0]);
+		memmove(ctx->sessions, ctx->sessions + 1,
+			(MAX_SESSIONS - 1) * sizeof(SSL_SESSION *));
+		ctx->nsessions--;
+	}
+	ctx->sessions[ctx->nsessions++] = session;
+	UNLOCK(&ctx->lock);
+	return (1);
+}
+
+/*
+ * Takes the newest cached session.  Each is used only once, as TLS 1.3
+ * asks of clients, and as servers enforce for early data.
+ */
+static SSL_SESSION *
+tls_take_session(perf_tlsctx_t *ctx)
+{
+	SSL_SESSION *session = NULL;
+
+	LOCK(&ctx->lock);
+	while (session == NULL && ctx->nsessions > 0) {
+		session = ctx->sessions[--ctx->nsessions];
+		if (!SSL_SESSION_is_resumable(session)) {
+			SSL_SESSION_free(session);
+			session = NULL;
+		}
+	}
+	UNLOCK(&ctx->lock);
+	return (session);
+}
+
+perf_tlsctx_t *
+perf_tls_createctx(isc_mem_t *mctx, const char *alpn,
+		   const char *servername, perf_tls_resume_t resume,
+		   unsigned int options)
+{
+	unsigned char protos[256];
+	perf_tlsctx_t *ctx;
+
+	ctx = isc_mem_get(mctx, sizeof(*ctx));
+	if (ctx == NULL)
+		perf_log_fatal("out of memory");
+	memset(ctx, 0, sizeof(*ctx));
+	ctx->mctx = mctx;
+
+	if ((options & PERF_TLS_CTX_QUIC) != 0) {
+#ifdef HAVE_OSSL_QUIC_CLIENT_METHOD
+		ctx->quic = ISC_TRUE;
+		ctx->ctx = SSL_CTX_new(OSSL_QUIC_client_method());
+		if (resume == perf_tls_resume_early) {
+			perf_log_warning("OpenSSL does not send early data "
+					 "over QUIC; resuming without it");
+			resume = perf_tls_resume_ticket;
+		}
+#else
+		perf_log_fatal("this build does not support QUIC");
+#endif
+	} else {
+		ctx->ctx = SSL_CTX_new(TLS_client_method());
+	}
+	if (ctx->ctx == NULL)
+		perf_log_fatal("creating TLS context failed");
+	SSL_CTX_set_min_proto_version(ctx->ctx, TLS1_2_VERSION);
+	/*
+	 * Benchmark targets commonly use self-signed certificates, so
+	 * the server is not authenticated.
+	 */
+	SSL_CTX_set_verify(ctx->ctx, SSL_VERIFY_NONE, NULL);
+	SSL_CTX_set_mode(ctx->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE |
+			 SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+	SSL_CTX_set_options(ctx->ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+	protos[0] = strlen(alpn);
+	memcpy(protos + 1, alpn, protos[0]);
+	SSL_CTX_set_alpn_protos(ctx->ctx, protos, protos[0] + 1);
+	if ((options & PERF_TLS_CTX_KTLS) != 0 && !ctx->quic) {
+#ifdef SSL_OP_ENABLE_KTLS
+		SSL_CTX_set_options(ctx->ctx, SSL_OP_ENABLE_KTLS);
+#else
+		perf_log_warning("this OpenSSL does not support kernel TLS; "
+				 "encrypting in user space");
+#endif
+	}
+
+	ctx->servername = servername;
+	ctx->resume = resume;
+	MUTEX_INIT(&ctx->lock);
+	if (resume != perf_tls_resume_none) {
+		SSL_CTX_set_app_data(ctx->ctx, ctx);
+		SSL_CTX_set_session_cache_mode(ctx->ctx,
+					       SSL_SESS_CACHE_CLIENT |
+					       SSL_SESS_CACHE_NO_INTERNAL_STORE);
+		SSL_CTX_sess_set_new_cb(ctx->ctx, tls_new_session);
+	} else {
+		SSL_CTX_set_session_cache_mode(ctx->ctx, SSL_SESS_CACHE_OFF);
+		SSL_CTX_set_options(ctx->ctx, SSL_OP_NO_TICKET);
+	}
+
+	return (ctx);
+}
+
+#ifdef HAVE_OSSL_QUIC_CLIENT_METHOD
+/*
+ * Attaches a QUIC connection to its connected UDP socket.  Only the
+ * application opens streams, each as it is needed.
+ */
+static void
+tls_attach_quic(perf_tls_t *tls, int fd)
+{
+	struct sockaddr_storage ss;
+	socklen_t sslen = sizeof(ss);
+	struct sockaddr_in *sin;
+	struct sockaddr_in6 *sin6;
+	BIO_ADDR *peer;
+	BIO *bio;
+	int ok;
+
+	if (getpeername(fd, (struct sockaddr *)&ss, &sslen) == -1)
+		perf_log_fatal("getpeername: %s", strerror(errno));
+	peer = BIO_ADDR_new();
+	if (peer == NULL)
+		perf_log_fatal("out of memory");
+	if (ss.ss_family == AF_INET6) {
+		sin6 = (struct sockaddr_in6 *)&ss;
+		ok = BIO_ADDR_rawmake(peer, AF_INET6, &sin6->sin6_addr,
+				      sizeof(sin6->sin6_addr),
+				      sin6->sin6_port);
+	} else {
+		sin = (struct sockaddr_in *)&ss;
+		ok = BIO_ADDR_rawmake(peer, AF_INET, &sin->sin_addr,
+				      sizeof(sin->sin_addr), sin->sin_port);
+	}
+	bio = BIO_new_dgram(fd, BIO_NOCLOSE);
+	if (!ok || bio == NULL ||
+	    SSL_set1_initial_peer_addr(tls->ssl, peer) != 1)
+		perf_log_fatal("attaching QUIC connection failed");
+	BIO_ADDR_free(peer);
+	SSL_set_bio(tls->ssl, bio, bio);
+	SSL_set_blocking_mode(tls->ssl, 0);
+	SSL_set_default_stream_mode(tls->ssl, SSL_DEFAULT_STREAM_MODE_NONE);
+	SSL_set_incoming_stream_policy(tls->ssl,
+				       SSL_INCOMING_STREAM_POLICY_REJECT, 0);
+}
+#endif
+
+void
+perf_tls_destroyctx(perf_tlsctx_t **ctxp)
+{
+	perf_tlsctx_t *ctx = *ctxp;
+	unsigned int i;
+
+	for (i = 0; i < ctx->nsessions; i++)
+		SSL_SESSION_free(ctx->sessions[i]);
+	MUTEX_DESTROY(&ctx->lock);
+	SSL_CTX_free(ctx->ctx);
+	isc_mem_put(ctx->mctx, ctx, sizeof(*ctx));
+	*ctxp = NULL;
+}
+
+perf_tls_t *
+perf_tls_create(perf_tlsctx_t *ctx, int fd)
+{
+	perf_tls_t *tls;
+	SSL_SESSION *session;
+
+	tls = isc_mem_get(ctx->mctx, sizeof(*tls));
+	if (tls == NULL)
+		perf_log_fatal("out of memory");
+	memset(tls, 0, sizeof(*tls));
+	tls->mctx = ctx->mctx;
+	MUTEX_INIT(&tls->lock);
+
+	tls->ssl = SSL_new(ctx->ctx);
+	if (tls->ssl == NULL)
+		perf_log_fatal("creating TLS session failed");
+#ifdef HAVE_OSSL_QUIC_CLIENT_METHOD
+	tls->quic = ctx->quic;
+	if (tls->quic)
+		tls_attach_quic(tls, fd);
+	else
+#endif
+	if (SSL_set_fd(tls->ssl, fd) != 1)
+		perf_log_fatal("attaching TLS session failed");
+	if (ctx->servername != NULL)
+		SSL_set_tlsext_host_name(tls->ssl, ctx->servername);
+	SSL_set_connect_state(tls->ssl);
+
+	if (ctx->resume != perf_tls_resume_none) {
+		session = tls_take_session(ctx);
+		if (session != NULL) {
+			SSL_set_session(tls->ssl, session);
+			if (ctx->resume == perf_tls_resume_early &&
+			    SSL_SESSION_get_max_early_data(session) > 0)
+			{
+				tls->early = tls->early_writing = ISC_TRUE;
+				tls->early_left =
+				    SSL_SESSION_get_max_early_data(session);
+			}
+			SSL_SESSION_free(session);
+		}
+	}
+
+	return (tls);
+}
+
+void
+perf_tls_destroy(perf_tls_t **tlsp)
+{
+	perf_tls_t *tls = *tlsp;
+
+	/*
+	 * Send close_notify if the session got that far, but don't wait
+	 * for the server's.  A QUIC connection sends CONNECTION_CLOSE
+	 * instead, without waiting for its streams to be acknowledged;
+	 * a stream just goes.
+	 */
+#ifdef HAVE_OSSL_QUIC_CLIENT_METHOD
+	if (tls->quic) {
+		if (!tls->stream && SSL_is_init_finished(tls->ssl))
+			(void)SSL_shutdown_ex(tls->ssl,
+					      SSL_SHUTDOWN_FLAG_RAPID, NULL, 0);
+	} else
+#endif
+	if (SSL_is_init_finished(tls->ssl))
+		(void)SSL_shutdown(tls->ssl);
+	ERR_clear_error();
+	SSL_free(tls->ssl);
+	MUTEX_DESTROY(&tls->lock);
+	isc_mem_put(tls->mctx, tls, sizeof(*tls));
+	*tlsp = NULL;
+}
+
+isc_boolean_t
+perf_tls_early(perf_tls_t *tls)
+{
+	return (tls->early);
+}
+
+size_t
+perf_tls_early_sent(perf_tls_t *tls)
+{
+	size_t sent;
+
+	LOCK(&tls->lock);
+	sent = tls->early_sent;
+	UNLOCK(&tls->lock);
+
+	return (sent);
+}
+
+unsigned int
+perf_tls_status(perf_tls_t *tls)
+{
+	unsigned int status = 0;
+
+	LOCK(&tls->lock);
+	if (tls->write_wants_read)
+		status |= PERF_TLS_WRITE_WANTS_READ;
+#ifdef HAVE_OSSL_QUIC_CLIENT_METHOD
+	if (tls->quic) {
+		SSL_CONN_CLOSE_INFO info;
+
+		if (SSL_get_conn_close_info(tls->ssl, &info, sizeof(info)))
+			status |= PERF_TLS_CLOSED;
+	}
+#endif
+	if (SSL_is_init_finished(tls->ssl)) {
+		status |= PERF_TLS_ESTABLISHED;
+		if (SSL_session_reused(tls->ssl))
+			status |= PERF_TLS_RESUMED;
+#ifdef BIO_get_ktls_send
+		if (BIO_get_ktls_send(SSL_get_wbio(tls->ssl)))
+			status |= PERF_TLS_KTLS_SEND;
+		if (BIO_get_ktls_recv(SSL_get_rbio(tls->ssl)))
+			status |= PERF_TLS_KTLS_RECV;
+#endif
+		if (tls->early) {
+			switch (SSL_get_early_data_status(tls->ssl)) {
+			case SSL_EARLY_DATA_ACCEPTED:
+				status |= PERF_TLS_EARLY_ACCEPTED;
+				break;
+			case SSL_EARLY_DATA_REJECTED:
+				status |= PERF_TLS_EARLY_REJECTED;
+				break;
+			}
+		}
+	}
+	UNLOCK(&tls->lock);
+
+	return (status);
+}
+
+isc_result_t
+perf_tls_handshake(perf_tls_t *tls, unsigned int *whatp)
+{
+	isc_result_t result;
+	int ret;
+
+	LOCK(&tls->lock);
+	errno = 0;
+	ret = SSL_do_handshake(tls->ssl);
+	if (ret == 1) {
+		result = ISC_R_SUCCESS;
+	} else {
+		switch (SSL_get_error(tls->ssl, ret)) {
+		case SSL_ERROR_WANT_READ:
+			*whatp = PERF_OS_EVENT_READ;
+			result = ISC_R_WOULDBLOCK;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			*whatp = PERF_OS_EVENT_WRITE;
+			result = ISC_R_WOULDBLOCK;
+			break;
+		default:
+			tls_log_error("TLS handshake failed");
+			result = ISC_R_FAILURE;
+			break;
+		}
+	}
+	UNLOCK(&tls->lock);
+
+	return (result);
+}
+
+ssize_t
+perf_tls_read(perf_tls_t *tls, void *buf, size_t len)
+{
+	size_t n;
+	ssize_t ret;
+	int saved_errno = 0;
+
+	LOCK(&tls->lock);
+	/*
+	 * The handshake of a session sending early data is finished here,
+	 * which ends the early data.  It must be finished explicitly, as
+	 * OpenSSL cannot read the server's handshake while early data may
+	 * still be written.
+	 */
+	tls->early_writing = ISC_FALSE;
+	errno = 0;
+	if ((!tls->early || SSL_is_init_finished(tls->ssl) ||
+	     SSL_do_handshake(tls->ssl) == 1) &&
+	    SSL_read_ex(tls->ssl, buf, len, &n) == 1)
+	{
+		ret = n;
+	} else {
+		switch (SSL_get_error(tls->ssl, 0)) {
+		case SSL_ERROR_WANT_READ:
+		case SSL_ERROR_WANT_WRITE:
+			saved_errno = EAGAIN;
+			ret = -1;
+			break;
+		case SSL_ERROR_ZERO_RETURN:
+			ret = 0;
+			break;
+		case SSL_ERROR_SYSCALL:
+			saved_errno = errno;
+			ret = saved_errno == 0 ? 0 : -1;
+			ERR_clear_error();
+			break;
+		default:
+			tls_log_error("TLS read failed");
+			saved_errno = EPROTO;
+			ret = -1;
+			break;
+		}
+	}
+	UNLOCK(&tls->lock);
+
+	errno = saved_errno;
+	return (ret);
+}
+
+ssize_t
+perf_tls_write(perf_tls_t *tls, const void *buf, size_t len)
+{
+	size_t n;
+	ssize_t ret;
+	int ok, saved_errno = 0;
+
+	LOCK(&tls->lock);
+	/* What does not fit in the early data waits for the handshake. */
+	if (tls->early_writing && len > tls->early_left)
+		tls->early_writing = ISC_FALSE;
+	errno = 0;
+	if (tls->early_writing) {
+		ok = SSL_write_early_data(tls->ssl, buf, len, &n);
+		if (ok == 1) {
+			tls->early_left -= n;
+			tls->early_sent += n;
+		}
+	} else {
+		ok = SSL_write_ex(tls->ssl, buf, len, &n);
+	}
+	tls->write_wants_read = ISC_FALSE;
+	if (ok == 1) {
+		ret = n;
+	} else {
+		switch (SSL_get_error(tls->ssl, 0)) {
+		case SSL_ERROR_WANT_READ:
+			/* A key update or other message must be read first. */
+			tls->write_wants_read = ISC_TRUE;
+			saved_errno = EAGAIN;
+			break;
+		case SSL_ERROR_WANT_WRITE:
+			saved_errno = EAGAIN;
+			break;
+		case SSL_ERROR_SYSCALL:
+			saved_errno = errno != 0 ? errno : EPIPE;
+			ERR_clear_error();
+			break;
+		default:
+			tls_log_error("TLS write failed");
+			saved_errno = EPROTO;
+			break;
+		}
+		ret = -1;
+	}
+	UNLOCK(&tls->lock);
+
+	errno = saved_errno;
+	return (ret);
+}
+
+#ifdef HAVE_OSSL_QUIC_CLIENT_METHOD
+perf_tls_t *
+perf_tls_stream(perf_tls_t *conn)
+{
+	perf_tls_t *tls;
+	SSL *ssl;
+
+	LOCK(&conn->lock);
+	ssl = SSL_new_stream(conn->ssl, SSL_STREAM_FLAG_NO_BLOCK);
+	UNLOCK(&conn->lock);
+	if (ssl == NULL) {
+		ERR_clear_error();
+		return (NULL);
+	}
+
+	tls = isc_mem_get(conn->mctx, sizeof(*tls));
+	if (tls == NULL)
+		perf_log_fatal("out of memory");
+	memset(tls, 0, sizeof(*tls));
+	tls->mctx = conn->mctx;
+	MUTEX_INIT(&tls->lock);
+	tls->ssl = ssl;
+	tls->quic = tls->stream = ISC_TRUE;
+
+	return (tls);
+}
+
+isc_result_t
+perf_tls_conclude(perf_tls_t *stream)
+{
+	isc_result_t result = ISC_R_SUCCESS;
+
+	LOCK(&stream->lock);
+	if (SSL_stream_conclude(stream->ssl, 0) != 1) {
+		tls_log_error("ending QUIC stream failed");
+		result = ISC_R_FAILURE;
+	}
+	UNLOCK(&stream->lock);
+
+	return (result);
+}
+
+void
+perf_tls_events(perf_tls_t *conn)
+{
+	LOCK(&conn->lock);
+	(void)SSL_handle_events(conn->ssl);
+	ERR_clear_error();
+	UNLOCK(&conn->lock);
+}
+#endif
+
+#endif
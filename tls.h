@@ -0,0 +1,146 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#ifndef PERF_TLS_H
+#define PERF_TLS_H 1
+
+#ifdef HAVE_LIBSSL
+
+#include <sys/types.h>
+
+/*
+ * DNS over TLS client sessions on top of non-blocking sockets.  A
+ * session may be written by one thread while another reads from it;
+ * each call takes the session lock.  Where OpenSSL supports QUIC, a
+ * session may instead be a QUIC connection over a connected UDP socket,
+ * whose streams are then sessions of their own.
+ */
+typedef struct perf_tlsctx perf_tlsctx_t;
+typedef struct perf_tls perf_tls_t;
+
+/*
+ * How new sessions start: always with a full handshake, by resuming a
+ * session from a ticket the server issued earlier, or by also sending
+ * the first writes as TLS 1.3 early data where the ticket allows it.
+ */
+typedef enum {
+	perf_tls_resume_none,
+	perf_tls_resume_ticket,
+	perf_tls_resume_early
+} perf_tls_resume_t;
+
+#define PERF_TLS_ESTABLISHED	0x01	/* the handshake is complete */
+#define PERF_TLS_RESUMED	0x02	/* ... and resumed a session */
+#define PERF_TLS_EARLY_ACCEPTED	0x04	/* the early data was accepted */
+#define PERF_TLS_EARLY_REJECTED	0x08	/* ... or rejected, and so lost */
+#define PERF_TLS_KTLS_SEND	0x10	/* the kernel encrypts writes */
+#define PERF_TLS_KTLS_RECV	0x20	/* the kernel decrypts reads */
+#define PERF_TLS_CLOSED		0x40	/* the QUIC connection has ended */
+#define PERF_TLS_WRITE_WANTS_READ 0x80	/* the last write awaits data */
+
+/* Context options. */
+#define PERF_TLS_CTX_KTLS	0x01	/* offload records to the kernel */
+#define PERF_TLS_CTX_QUIC	0x02	/* make QUIC connections */
+
+/*
+ * 'alpn' is the application protocol to offer, such as "dot" or "h2".
+ * 'servername', if not NULL, is sent as SNI and must remain valid for
+ * the lifetime of the context.  With PERF_TLS_CTX_KTLS, sessions hand
+ * their record encryption to the kernel once the handshake is complete,
+ * where the kernel and the negotiated cipher allow it; perf_tls_status()
+ * tells which directions were handed over.  Once writes are, plaintext
+ * may be written to the socket directly instead of through
+ * perf_tls_write().  With PERF_TLS_CTX_QUIC, sessions are QUIC
+ * connections; OpenSSL's QUIC client does not send early data, so such
+ * sessions resume from tickets at most.
+ */
+perf_tlsctx_t *
+perf_tls_createctx(isc_mem_t *mctx, const char *alpn,
+		   const char *servername, perf_tls_resume_t resume,
+		   unsigned int options);
+
+void
+perf_tls_destroyctx(perf_tlsctx_t **ctxp);
+
+perf_tls_t *
+perf_tls_create(perf_tlsctx_t *ctx, int fd);
+
+void
+perf_tls_destroy(perf_tls_t **tlsp);
+
+/*
+ * Whether the session is sending early data.  If so, it can be written
+ * to straight away, and the handshake completes as it is read from,
+ * instead of through perf_tls_handshake().
+ */
+isc_boolean_t
+perf_tls_early(perf_tls_t *tls);
+
+/* How much of what has been written went out in early data. */
+size_t
+perf_tls_early_sent(perf_tls_t *tls);
+
+unsigned int
+perf_tls_status(perf_tls_t *tls);
+
+/*
+ * Advance the handshake.  Returns ISC_R_SUCCESS once it is complete,
+ * ISC_R_WOULDBLOCK with *whatp set to PERF_OS_EVENT_READ or
+ * PERF_OS_EVENT_WRITE if the socket must become ready first, and
+ * ISC_R_FAILURE (after logging why) if it failed.
+ */
+isc_result_t
+perf_tls_handshake(perf_tls_t *tls, unsigned int *whatp);
+
+/*
+ * These behave like read() and write() on a non-blocking socket: 0 is
+ * returned for a closed session, and -1 with errno set to EAGAIN if
+ * the call would block.  Writes may be partial.
+ */
+ssize_t
+perf_tls_read(perf_tls_t *tls, void *buf, size_t len);
+
+ssize_t
+perf_tls_write(perf_tls_t *tls, const void *buf, size_t len);
+
+#ifdef HAVE_OSSL_QUIC_CLIENT_METHOD
+/*
+ * Opens a bidirectional stream on an established QUIC connection, to be
+ * read and written like a session and destroyed with
+ * perf_tls_destroy() before the connection is.  Returns NULL if the
+ * server does not allow another stream yet.
+ */
+perf_tls_t *
+perf_tls_stream(perf_tls_t *conn);
+
+/* Ends what is sent on a stream (FIN). */
+isc_result_t
+perf_tls_conclude(perf_tls_t *stream);
+
+/*
+ * Processes what has arrived on a QUIC connection and any timers which
+ * have expired.  Connections are not serviced in the background, so
+ * this must be called regularly, whether or not the socket is readable.
+ */
+void
+perf_tls_events(perf_tls_t *conn);
+#endif
+
+#endif
+
+#endif
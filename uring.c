@@ -0,0 +1,589 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <endian.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <linux/io_uring.h>
+
+#include <isc/mem.h>
+#include <isc/result.h>
+#include <isc/types.h>
+
+#include "log.h"
+#include "os.h"
+#include "uring.h"
+#include "util.h"
+
+#define BUFFER_GROUP	0
+
+struct perf_uring {
+	isc_mem_t *mctx;
+	int fd;
+	isc_boolean_t sqpoll;
+
+	/* Protects the submission queue. */
+	pthread_mutex_t lock;
+	unsigned int sq_tail;
+	unsigned int pending;
+
+	void *sq_map;
+	size_t sq_map_size;
+	void *cq_map;
+	size_t cq_map_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+
+	unsigned int *ksq_head;
+	unsigned int *ksq_tail;
+	unsigned int *ksq_flags;
+	unsigned int sq_mask;
+	unsigned int sq_entries;
+
+	unsigned int *kcq_head;
+	unsigned int *kcq_tail;
+	struct io_uring_cqe *cqes;
+	unsigned int cq_mask;
+
+	struct io_uring_buf_ring *br;
+	size_t br_size;
+	unsigned int br_tail;
+	unsigned int br_mask;
+	unsigned char *bufs;
+	unsigned int nbufs;
+	unsigned int bufsize;
+
+	unsigned int features;
+};
+
+static int
+uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+	    unsigned int flags, void *arg, size_t argsz)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+		       flags, arg, argsz);
+}
+
+static int
+uring_register(int fd, unsigned int opcode, void *arg, unsigned int nargs)
+{
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nargs);
+}
+
+static void
+unmap_rings(perf_uring_t *ring)
+{
+	if (ring->sqes != NULL && ring->sqes != MAP_FAILED)
+		munmap(ring->sqes, ring->sqes_size);
+	if (ring->cq_map != NULL && ring->cq_map != MAP_FAILED &&
+	    ring->cq_map != ring->sq_map)
+		munmap(ring->cq_map, ring->cq_map_size);
+	if (ring->sq_map != NULL && ring->sq_map != MAP_FAILED)
+		munmap(ring->sq_map, ring->sq_map_size);
+}
+
+static isc_boolean_t
+op_supported(const struct io_uring_probe *probe, unsigned int op)
+{
+	return ISC_TF(op <= probe->last_op && op < probe->ops_len &&
+		      (probe->ops[op].flags & IO_URING_OP_SUPPORTED) != 0);
+}
+
+/*
+ * Checks that the kernel knows every operation queued here.  Multishot
+ * requests are flags on existing operations rather than operations of
+ * their own, so they are judged by what arrived alongside them: multishot
+ * polls with IORING_FEAT_RSRC_TAGS (Linux 5.13), multishot receives with
+ * IORING_OP_SEND_ZC (Linux 6.0).
+ */
+static isc_boolean_t
+probe_ops(perf_uring_t *ring, unsigned int features)
+{
+	struct io_uring_probe *probe;
+	size_t size;
+	isc_boolean_t ok;
+
+	size = sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op);
+	probe = isc_mem_get(ring->mctx, size);
+	if (probe == NULL)
+		perf_log_fatal("out of memory");
+	memset(probe, 0, size);
+	if (uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) < 0) {
+		isc_mem_put(ring->mctx, probe, size);
+		return (ISC_FALSE);
+	}
+
+	ok = ISC_TF(op_supported(probe, IORING_OP_SENDMSG) &&
+		    op_supported(probe, IORING_OP_RECV) &&
+		    op_supported(probe, IORING_OP_POLL_ADD) &&
+		    op_supported(probe, IORING_OP_POLL_REMOVE));
+	if ((features & IORING_FEAT_RSRC_TAGS) != 0)
+		ring->features |= PERF_URING_POLL_MULTISHOT;
+	if (op_supported(probe, IORING_OP_SEND_ZC))
+		ring->features |= PERF_URING_RECV_MULTISHOT;
+
+	isc_mem_put(ring->mctx, probe, size);
+	return (ok);
+}
+
+/*
+ * Returns NULL, with errno set, if the kernel cannot provide a ring with
+ * the features used here.
+ */
+perf_uring_t *
+perf_uring_create(isc_mem_t *mctx, unsigned int sq_entries,
+		  unsigned int cq_entries, isc_boolean_t sqpoll)
+{
+	perf_uring_t *ring;
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+	unsigned int *array;
+	unsigned int i;
+	int saved_errno;
+
+	ring = isc_mem_get(mctx, sizeof(*ring));
+	if (ring == NULL)
+		perf_log_fatal("out of memory");
+	memset(ring, 0, sizeof(*ring));
+	ring->mctx = mctx;
+	ring->sqpoll = sqpoll;
+	MUTEX_INIT(&ring->lock);
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+	p.cq_entries = cq_entries > sq_entries ? cq_entries : sq_entries;
+	if (sqpoll) {
+		p.flags |= IORING_SETUP_SQPOLL;
+		p.sq_thread_idle = 1000;
+	}
+	ring->fd = uring_setup(sq_entries, &p);
+	if (ring->fd < 0)
+		goto fail;
+	if ((p.features & IORING_FEAT_EXT_ARG) == 0 ||
+	    !probe_ops(ring, p.features)) {
+		errno = EOPNOTSUPP;
+		goto fail;
+	}
+
+	ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	ring->cq_map_size = p.cq_off.cqes +
+			    p.cq_entries * sizeof(struct io_uring_cqe);
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		if (ring->cq_map_size > ring->sq_map_size)
+			ring->sq_map_size = ring->cq_map_size;
+		ring->cq_map_size = ring->sq_map_size;
+	}
+	ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, ring->fd,
+			    IORING_OFF_SQ_RING);
+	if (ring->sq_map == MAP_FAILED)
+		goto fail;
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0) {
+		ring->cq_map = ring->sq_map;
+	} else {
+		ring->cq_map = mmap(NULL, ring->cq_map_size,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, ring->fd,
+				    IORING_OFF_CQ_RING);
+		if (ring->cq_map == MAP_FAILED)
+			goto fail;
+	}
+	ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, ring->fd,
+			  IORING_OFF_SQES);
+	if (ring->sqes == MAP_FAILED)
+		goto fail;
+
+	sq = ring->sq_map;
+	ring->ksq_head = (unsigned int *)(sq + p.sq_off.head);
+	ring->ksq_tail = (unsigned int *)(sq + p.sq_off.tail);
+	ring->ksq_flags = (unsigned int *)(sq + p.sq_off.flags);
+	ring->sq_mask = *(unsigned int *)(sq + p.sq_off.ring_mask);
+	ring->sq_entries = p.sq_entries;
+	ring->sq_tail = *ring->ksq_tail;
+	/* Submission slots are always used in order. */
+	array = (unsigned int *)(sq + p.sq_off.array);
+	for (i = 0; i < p.sq_entries; i++)
+		array[i] = i;
+
+	cq = ring->cq_map;
+	ring->kcq_head = (unsigned int *)(cq + p.cq_off.head);
+	ring->kcq_tail = (unsigned int *)(cq + p.cq_off.tail);
+	ring->cq_mask = *(unsigned int *)(cq + p.cq_off.ring_mask);
+	ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+	return ring;
+
+ fail:
+	saved_errno = errno;
+	unmap_rings(ring);
+	if (ring->fd >= 0)
+		close(ring->fd);
+	MUTEX_DESTROY(&ring->lock);
+	isc_mem_put(mctx, ring, sizeof(*ring));
+	errno = saved_errno;
+	return NULL;
+}
+
+unsigned int
+perf_uring_features(perf_uring_t *ring)
+{
+	return ring->features;
+}
+
+void
+perf_uring_destroy(perf_uring_t **ringp)
+{
+	perf_uring_t *ring;
+
+	ISC_INSIST(ringp != NULL && *ringp != NULL);
+
+	ring = *ringp;
+	*ringp = NULL;
+
+	unmap_rings(ring);
+	close(ring->fd);
+	if (ring->br != NULL) {
+		munmap(ring->br, ring->br_size);
+		isc_mem_put(ring->mctx, ring->bufs,
+			    ring->nbufs * ring->bufsize);
+	}
+	MUTEX_DESTROY(&ring->lock);
+	isc_mem_put(ring->mctx, ring, sizeof(*ring));
+}
+
+/*
+ * Registers a ring of 'nbufs' (a power of two) receive buffers, which
+ * the kernel hands out to multishot receives as data arrives.
+ */
+isc_result_t
+perf_uring_provide_buffers(perf_uring_t *ring, unsigned int nbufs,
+			   unsigned int bufsize)
+{
+	struct io_uring_buf_reg reg;
+	unsigned int i;
+
+	ISC_INSIST(ring->br == NULL);
+	ISC_INSIST(nbufs != 0 && (nbufs & (nbufs - 1)) == 0);
+
+	ring->br_size = nbufs * sizeof(struct io_uring_buf);
+	ring->br = mmap(NULL, ring->br_size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (ring->br == MAP_FAILED) {
+		ring->br = NULL;
+		return (ISC_R_NOMEMORY);
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uintptr_t)ring->br;
+	reg.ring_entries = nbufs;
+	reg.bgid = BUFFER_GROUP;
+	if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+		munmap(ring->br, ring->br_size);
+		ring->br = NULL;
+		return (ISC_R_NOTIMPLEMENTED);
+	}
+
+	ring->bufs = isc_mem_get(ring->mctx, nbufs * bufsize);
+	if (ring->bufs == NULL)
+		perf_log_fatal("out of memory");
+	ring->nbufs = nbufs;
+	ring->bufsize = bufsize;
+	ring->br_mask = nbufs - 1;
+	ring->br_tail = 0;
+	for (i = 0; i < nbufs; i++)
+		perf_uring_recycle_buffer(ring, i);
+
+	return (ISC_R_SUCCESS);
+}
+
+unsigned char *
+perf_uring_buffer(perf_uring_t *ring, unsigned int buffer)
+{
+	ISC_INSIST(buffer < ring->nbufs);
+	return ring->bufs + buffer * ring->bufsize;
+}
+
+/* Hands a buffer back to the kernel; only the consuming thread may call. */
+void
+perf_uring_recycle_buffer(perf_uring_t *ring, unsigned int buffer)
+{
+	struct io_uring_buf *buf;
+
+	buf = &ring->br->bufs[ring->br_tail & ring->br_mask];
+	buf->addr = (uintptr_t)perf_uring_buffer(ring, buffer);
+	buf->len = ring->bufsize;
+	buf->bid = buffer;
+	ring->br_tail++;
+	__atomic_store_n(&ring->br->tail, (isc_uint16_t)ring->br_tail,
+			 __ATOMIC_RELEASE);
+}
+
+/*
+ * Pushes queued requests to the kernel.  With a polling submission
+ * thread that only needs doing when the thread has gone idle.
+ */
+static void
+submit_locked(perf_uring_t *ring, unsigned int flags)
+{
+	int n;
+
+	if (ring->sqpoll) {
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if ((__atomic_load_n(ring->ksq_flags, __ATOMIC_RELAXED) &
+		     IORING_SQ_NEED_WAKEUP) != 0)
+			flags |= IORING_ENTER_SQ_WAKEUP;
+		ring->pending = 0;
+		if (flags == 0)
+			return;
+		n = uring_enter(ring->fd, 0, 0, flags, NULL, 0);
+	} else {
+		if (ring->pending == 0)
+			return;
+		n = uring_enter(ring->fd, ring->pending, 0, flags, NULL, 0);
+		if (n > 0)
+			ring->pending -= n;
+	}
+	if (n < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+		perf_log_fatal("io_uring_enter() failed: Error was %s",
+			       strerror(errno));
+}
+
+static struct io_uring_sqe *
+get_sqe(perf_uring_t *ring)
+{
+	struct io_uring_sqe *sqe;
+
+	while (ring->sq_tail - __atomic_load_n(ring->ksq_head,
+					       __ATOMIC_ACQUIRE) >=
+	       ring->sq_entries)
+		submit_locked(ring, ring->sqpoll ? IORING_ENTER_SQ_WAIT : 0);
+
+	sqe = &ring->sqes[ring->sq_tail & ring->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	return sqe;
+}
+
+static void
+queue_sqe(perf_uring_t *ring)
+{
+	ring->sq_tail++;
+	ring->pending++;
+	__atomic_store_n(ring->ksq_tail, ring->sq_tail, __ATOMIC_RELEASE);
+}
+
+/*
+ * A linked send is not started until the previous one has finished, and
+ * is cancelled if that one fails.
+ */
+void
+perf_uring_sendmsg(perf_uring_t *ring, int fd, const struct msghdr *msg,
+		   isc_boolean_t link, isc_uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	LOCK(&ring->lock);
+	sqe = get_sqe(ring);
+	sqe->opcode = IORING_OP_SENDMSG;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t)msg;
+	sqe->len = 1;
+	if (link)
+		sqe->flags = IOSQE_IO_LINK;
+	sqe->user_data = data;
+	queue_sqe(ring);
+	UNLOCK(&ring->lock);
+}
+
+/*
+ * Keeps receiving datagrams from 'fd' into provided buffers until the
+ * request is cancelled or runs out of buffers.
+ */
+void
+perf_uring_recv_multishot(perf_uring_t *ring, int fd, isc_uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	ISC_INSIST(ring->br != NULL);
+
+	LOCK(&ring->lock);
+	sqe = get_sqe(ring);
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = BUFFER_GROUP;
+	sqe->user_data = data;
+	queue_sqe(ring);
+	UNLOCK(&ring->lock);
+}
+
+void
+perf_uring_poll(perf_uring_t *ring, int fd, unsigned int what,
+		isc_boolean_t multishot, isc_uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+	isc_uint32_t events = 0;
+
+	if ((what & PERF_OS_EVENT_READ) != 0)
+		events |= POLLIN;
+	if ((what & PERF_OS_EVENT_WRITE) != 0)
+		events |= POLLOUT;
+#if __BYTE_ORDER == __BIG_ENDIAN
+	events = (events << 16) | (events >> 16);
+#endif
+
+	LOCK(&ring->lock);
+	sqe = get_sqe(ring);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll32_events = events;
+	if (multishot)
+		sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->user_data = data;
+	queue_sqe(ring);
+	UNLOCK(&ring->lock);
+}
+
+/* Cancels the poll request queued with 'data', if it is still armed. */
+void
+perf_uring_poll_remove(perf_uring_t *ring, isc_uint64_t data)
+{
+	struct io_uring_sqe *sqe;
+
+	LOCK(&ring->lock);
+	sqe = get_sqe(ring);
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = data;
+	sqe->user_data = data;
+	queue_sqe(ring);
+	UNLOCK(&ring->lock);
+}
+
+void
+perf_uring_submit(perf_uring_t *ring)
+{
+	LOCK(&ring->lock);
+	submit_locked(ring, 0);
+	UNLOCK(&ring->lock);
+}
+
+static unsigned int
+cq_ready(perf_uring_t *ring)
+{
+	return __atomic_load_n(ring->kcq_tail, __ATOMIC_ACQUIRE) -
+	       *ring->kcq_head;
+}
+
+/*
+ * Submits anything queued and waits until at least 'nwait' completions
+ * can be consumed, or the timeout (in microseconds; negative means
+ * forever) expires.
+ */
+isc_result_t
+perf_uring_wait(perf_uring_t *ring, unsigned int nwait, isc_int64_t timeout)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned int flags;
+	void *argp;
+	size_t argsz;
+
+	perf_uring_submit(ring);
+
+	while (cq_ready(ring) < nwait) {
+		flags = IORING_ENTER_GETEVENTS;
+		argp = NULL;
+		argsz = 0;
+		if (timeout >= 0) {
+			memset(&arg, 0, sizeof(arg));
+			ts.tv_sec = timeout / MILLION;
+			ts.tv_nsec = (timeout % MILLION) * THOUSAND;
+			arg.ts = (uintptr_t)&ts;
+			flags |= IORING_ENTER_EXT_ARG;
+			argp = &arg;
+			argsz = sizeof(arg);
+		}
+		if (uring_enter(ring->fd, 0, nwait - cq_ready(ring), flags,
+				argp, argsz) < 0)
+		{
+			if (errno == ETIME)
+				return (ISC_R_TIMEDOUT);
+			if (errno == EINTR)
+				return (ISC_R_CANCELED);
+			if (errno != EAGAIN && errno != EBUSY)
+				perf_log_fatal("io_uring_enter() failed: "
+					       "Error was %s",
+					       strerror(errno));
+		}
+		if (timeout >= 0)
+			break;
+	}
+	return (cq_ready(ring) >= nwait ? ISC_R_SUCCESS : ISC_R_TIMEDOUT);
+}
+
+/*
+ * Copies out the oldest completion without consuming it; call
+ * perf_uring_seen() once it has been dealt with.
+ */
+isc_boolean_t
+perf_uring_peek(perf_uring_t *ring, perf_uring_cqe_t *cqe)
+{
+	struct io_uring_cqe *kcqe;
+
+	if (cq_ready(ring) == 0)
+		return ISC_FALSE;
+	kcqe = &ring->cqes[*ring->kcq_head & ring->cq_mask];
+	cqe->data = kcqe->user_data;
+	cqe->res = kcqe->res;
+	cqe->flags = 0;
+	cqe->buffer = 0;
+	if ((kcqe->flags & IORING_CQE_F_MORE) != 0)
+		cqe->flags |= PERF_URING_MORE;
+	if ((kcqe->flags & IORING_CQE_F_BUFFER) != 0) {
+		cqe->flags |= PERF_URING_BUFFER;
+		cqe->buffer = kcqe->flags >> IORING_CQE_BUFFER_SHIFT;
+	}
+	return ISC_TRUE;
+}
+
+void
+perf_uring_seen(perf_uring_t *ring)
+{
+	__atomic_store_n(ring->kcq_head, *ring->kcq_head + 1,
+			 __ATOMIC_RELEASE);
+}
+
+#endif
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PERF_URING_H
+#define PERF_URING_H 1
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <sys/socket.h>
+
+/*
+ * A minimal io_uring wrapper, talking to the kernel directly.  Requests
+ * may be queued from several threads, but completions must only be
+ * consumed by one.
+ */
+typedef struct perf_uring perf_uring_t;
+
+#define PERF_URING_MORE		0x01	/* multishot request still armed */
+#define PERF_URING_BUFFER	0x02	/* 'buffer' names a provided buffer */
+
+/* What perf_uring_features() may report the kernel to support. */
+#define PERF_URING_POLL_MULTISHOT	0x01
+#define PERF_URING_RECV_MULTISHOT	0x02
+
+typedef struct {
+	isc_uint64_t data;
+	int res;
+	unsigned int flags;
+	unsigned int buffer;
+} perf_uring_cqe_t;
+
+perf_uring_t *
+perf_uring_create(isc_mem_t *mctx, unsigned int sq_entries,
+		  unsigned int cq_entries, isc_boolean_t sqpoll);
+
+unsigned int
+perf_uring_features(perf_uring_t *ring);
+
+void
+perf_uring_destroy(perf_uring_t **ringp);
+
+isc_result_t
+perf_uring_provide_buffers(perf_uring_t *ring, unsigned int nbufs,
+			   unsigned int bufsize);
+
+unsigned char *
+perf_uring_buffer(perf_uring_t *ring, unsigned int buffer);
+
+void
+perf_uring_recycle_buffer(perf_uring_t *ring, unsigned int buffer);
+
+void
+perf_uring_sendmsg(perf_uring_t *ring, int fd, const struct msghdr *msg,
+		   isc_boolean_t link, isc_uint64_t data);
+
+void
+perf_uring_recv_multishot(perf_uring_t *ring, int fd, isc_uint64_t data);
+
+void
+perf_uring_poll(perf_uring_t *ring, int fd, unsigned int what,
+		isc_boolean_t multishot, isc_uint64_t data);
+
+void
+perf_uring_poll_remove(perf_uring_t *ring, isc_uint64_t data);
+
+void
+perf_uring_submit(perf_uring_t *ring);
+
+isc_result_t
+perf_uring_wait(perf_uring_t *ring, unsigned int nwait, isc_int64_t timeout);
+
+isc_boolean_t
+perf_uring_peek(perf_uring_t *ring, perf_uring_cqe_t *cqe);
+
+void
+perf_uring_seen(perf_uring_t *ring);
+
+#endif
+
+#endif
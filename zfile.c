@@ -0,0 +1,409 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <isc/mem.h>
+
+#if defined(HAVE_ZLIB_H) && defined(HAVE_LIBZ)
+#include <zlib.h>
+#define ZFILE_GZIP 1
+#endif
+#if defined(HAVE_ZSTD_H) && defined(HAVE_LIBZSTD)
+#include <zstd.h>
+#define ZFILE_ZSTD 1
+#endif
+
+#include "log.h"
+#include "util.h"
+#include "zfile.h"
+
+#define OUT_SIZE	(1024 * 1024)
+#define IN_SIZE		(128 * 1024)
+
+typedef enum {
+	zfile_gzip,
+	zfile_zstd
+} zfile_format_t;
+
+/* Decompressed data, filled by the reader thread and then read. */
+typedef struct {
+	unsigned char data[OUT_SIZE];
+	size_t length;
+	isc_boolean_t full;
+	isc_boolean_t end;	/* the file ends after this data */
+} zbuffer_t;
+
+struct perf_zfile {
+	isc_mem_t *mctx;
+	int fd;
+	zfile_format_t format;
+	isc_boolean_t repeat;
+	isc_boolean_t started;
+	isc_boolean_t stopping;
+	pthread_t reader;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	zbuffer_t bufs[2];
+	/*
+	 * What has been read: the buffer, how far into it, and whether the
+	 * end of the file was reached.
+	 */
+	unsigned int current;
+	size_t offset;
+	isc_boolean_t at_end;
+	/* The compressed input, used only by the reader thread. */
+	unsigned char in[IN_SIZE];
+	size_t in_pos;
+	size_t in_len;
+	isc_boolean_t in_end;
+	isc_boolean_t in_frame;
+#ifdef ZFILE_GZIP
+	z_stream zs;
+#endif
+#ifdef ZFILE_ZSTD
+	ZSTD_DStream *zds;
+#endif
+};
+
+static const unsigned char gzip_magic[] = { 0x1f, 0x8b };
+static const unsigned char zstd_magic[] = { 0x28, 0xb5, 0x2f, 0xfd };
+
+/*
+ * Reads more of the compressed file, once what was read has been used.
+ */
+static void
+read_input(perf_zfile_t *zfile)
+{
+	ssize_t n;
+
+	if (zfile->in_pos < zfile->in_len || zfile->in_end)
+		return;
+	n = read(zfile->fd, zfile->in, sizeof(zfile->in));
+	if (n < 0)
+		perf_log_fatal("reading compressed input failed");
+	zfile->in_pos = 0;
+	zfile->in_len = n;
+	if (n == 0)
+		zfile->in_end = ISC_TRUE;
+}
+
+#ifdef ZFILE_GZIP
+static size_t
+inflate_some(perf_zfile_t *zfile, unsigned char *out, size_t len,
+	     isc_boolean_t *endp)
+{
+	z_stream *zs = &zfile->zs;
+	int ret;
+
+	zs->next_out = out;
+	zs->avail_out = len;
+	while (zs->avail_out > 0) {
+		read_input(zfile);
+		zs->next_in = zfile->in + zfile->in_pos;
+		zs->avail_in = zfile->in_len - zfile->in_pos;
+		ret = inflate(zs, Z_NO_FLUSH);
+		zfile->in_pos = zfile->in_len - zs->avail_in;
+		if (ret == Z_STREAM_END) {
+			/* Another gzip member may follow. */
+			inflateReset(zs);
+			zfile->in_frame = ISC_FALSE;
+		} else if (ret == Z_BUF_ERROR && zfile->in_end) {
+			if (zfile->in_frame)
+				perf_log_fatal("compressed input is "
+					       "truncated");
+			*endp = ISC_TRUE;
+			break;
+		} else if (ret != Z_OK) {
+			perf_log_fatal("compressed input is corrupt: %s",
+				       zs->msg != NULL ? zs->msg : "");
+		} else {
+			zfile->in_frame = ISC_TRUE;
+		}
+	}
+
+	return (len - zs->avail_out);
+}
+#endif
+
+#ifdef ZFILE_ZSTD
+static size_t
+zstd_some(perf_zfile_t *zfile, unsigned char *out, size_t len,
+	  isc_boolean_t *endp)
+{
+	ZSTD_outBuffer output = { out, len, 0 };
+	ZSTD_inBuffer input;
+	size_t ret, before;
+
+	while (output.pos < output.size) {
+		read_input(zfile);
+		input.src = zfile->in;
+		input.size = zfile->in_len;
+		input.pos = zfile->in_pos;
+		before = output.pos;
+		ret = ZSTD_decompressStream(zfile->zds, &output, &input);
+		if (ZSTD_isError(ret))
+			perf_log_fatal("compressed input is corrupt: %s",
+				       ZSTD_getErrorName(ret));
+		/*
+		 * A frame is done once nothing is left to flush; a call which
+		 * does nothing says only what the next frame needs.
+		 */
+		if (input.pos != zfile->in_pos || output.pos != before)
+			zfile->in_frame = ISC_TF(ret != 0);
+		zfile->in_pos = input.pos;
+		if (zfile->in_end && output.pos == before) {
+			if (zfile->in_frame)
+				perf_log_fatal("compressed input is "
+					       "truncated");
+			*endp = ISC_TRUE;
+			break;
+		}
+	}
+
+	return (output.pos);
+}
+#endif
+
+/*
+ * Decompresses as much as fits into 'out', setting *endp if the end of
+ * the file is reached.
+ */
+static size_t
+decompress(perf_zfile_t *zfile, unsigned char *out, size_t len,
+	   isc_boolean_t *endp)
+{
+	switch (zfile->format) {
+#ifdef ZFILE_GZIP
+	case zfile_gzip:
+		return (inflate_some(zfile, out, len, endp));
+#endif
+#ifdef ZFILE_ZSTD
+	case zfile_zstd:
+		return (zstd_some(zfile, out, len, endp));
+#endif
+	default:
+		ISC_INSIST(0);
+	}
+	return (0);
+}
+
+static void
+restart(perf_zfile_t *zfile)
+{
+	if (lseek(zfile->fd, 0L, SEEK_SET) < 0)
+		perf_log_fatal("cannot reread input");
+	zfile->in_pos = zfile->in_len = 0;
+	zfile->in_end = ISC_FALSE;
+	zfile->in_frame = ISC_FALSE;
+#ifdef ZFILE_GZIP
+	if (zfile->format == zfile_gzip)
+		inflateReset(&zfile->zs);
+#endif
+#ifdef ZFILE_ZSTD
+	if (zfile->format == zfile_zstd)
+		ZSTD_initDStream(zfile->zds);
+#endif
+}
+
+/*
+ * Fills each buffer in turn once it has been read, running through the
+ * file again at its end if it is to be read more than once.
+ */
+static void *
+do_decompress(void *arg)
+{
+	perf_zfile_t *zfile = arg;
+	zbuffer_t *buf;
+	unsigned int next;
+	size_t length;
+	isc_boolean_t end, stopping;
+
+	next = 0;
+	while (ISC_TRUE) {
+		buf = &zfile->bufs[next];
+		LOCK(&zfile->lock);
+		while (buf->full && !zfile->stopping)
+			WAIT(&zfile->cond, &zfile->lock);
+		stopping = zfile->stopping;
+		UNLOCK(&zfile->lock);
+		if (stopping)
+			break;
+
+		length = 0;
+		end = ISC_FALSE;
+		while (length < OUT_SIZE && !end)
+			length += decompress(zfile, buf->data + length,
+					     OUT_SIZE - length, &end);
+
+		LOCK(&zfile->lock);
+		buf->length = length;
+		buf->end = end;
+		buf->full = ISC_TRUE;
+		BROADCAST(&zfile->cond);
+		UNLOCK(&zfile->lock);
+		next ^= 1;
+
+		if (end) {
+			if (!zfile->repeat)
+				break;
+			restart(zfile);
+		}
+	}
+
+	return (NULL);
+}
+
+perf_zfile_t *
+perf_zfile_open(isc_mem_t *mctx, int fd, const char *filename)
+{
+	perf_zfile_t *zfile;
+	unsigned char magic[4];
+	zfile_format_t format;
+
+	if (pread(fd, magic, sizeof(magic), 0) != sizeof(magic))
+		return (NULL);
+	if (memcmp(magic, gzip_magic, sizeof(gzip_magic)) == 0)
+		format = zfile_gzip;
+	else if (memcmp(magic, zstd_magic, sizeof(zstd_magic)) == 0)
+		format = zfile_zstd;
+	else
+		return (NULL);
+
+#ifndef ZFILE_GZIP
+	if (format == zfile_gzip)
+		perf_log_fatal("%s: this build cannot read gzip input",
+			       filename);
+#endif
+#ifndef ZFILE_ZSTD
+	if (format == zfile_zstd)
+		perf_log_fatal("%s: this build cannot read zstd input",
+			       filename);
+#endif
+
+	zfile = isc_mem_get(mctx, sizeof(*zfile));
+	if (zfile == NULL)
+		perf_log_fatal("out of memory");
+	memset(zfile, 0, sizeof(*zfile));
+	zfile->mctx = mctx;
+	zfile->fd = fd;
+	zfile->format = format;
+	MUTEX_INIT(&zfile->lock);
+	COND_INIT(&zfile->cond);
+
+#ifdef ZFILE_GZIP
+	/* Accept gzip headers only, with the largest window. */
+	if (format == zfile_gzip &&
+	    inflateInit2(&zfile->zs, 16 + MAX_WBITS) != Z_OK)
+		perf_log_fatal("%s: cannot start decompression", filename);
+#endif
+#ifdef ZFILE_ZSTD
+	if (format == zfile_zstd) {
+		zfile->zds = ZSTD_createDStream();
+		if (zfile->zds == NULL)
+			perf_log_fatal("out of memory");
+		ZSTD_initDStream(zfile->zds);
+	}
+#endif
+
+	return (zfile);
+}
+
+void
+perf_zfile_close(perf_zfile_t **zfilep)
+{
+	perf_zfile_t *zfile;
+
+	ISC_INSIST(zfilep != NULL && *zfilep != NULL);
+
+	zfile = *zfilep;
+	*zfilep = NULL;
+
+	if (zfile->started) {
+		LOCK(&zfile->lock);
+		zfile->stopping = ISC_TRUE;
+		BROADCAST(&zfile->cond);
+		UNLOCK(&zfile->lock);
+		JOIN(zfile->reader, NULL);
+	}
+#ifdef ZFILE_GZIP
+	if (zfile->format == zfile_gzip)
+		inflateEnd(&zfile->zs);
+#endif
+#ifdef ZFILE_ZSTD
+	if (zfile->format == zfile_zstd)
+		ZSTD_freeDStream(zfile->zds);
+#endif
+	MUTEX_DESTROY(&zfile->lock);
+	isc_mem_put(zfile->mctx, zfile, sizeof(*zfile));
+}
+
+void
+perf_zfile_setrepeat(perf_zfile_t *zfile, isc_boolean_t repeat)
+{
+	zfile->repeat = repeat;
+}
+
+ssize_t
+perf_zfile_read(perf_zfile_t *zfile, void *buf, size_t len)
+{
+	zbuffer_t *current;
+	size_t n;
+
+	if (!zfile->started) {
+		zfile->started = ISC_TRUE;
+		THREAD(&zfile->reader, do_decompress, zfile);
+	}
+	if (zfile->at_end)
+		return (0);
+
+	/* This waits only if decompression has fallen behind. */
+	current = &zfile->bufs[zfile->current];
+	LOCK(&zfile->lock);
+	while (!current->full)
+		WAIT(&zfile->cond, &zfile->lock);
+	UNLOCK(&zfile->lock);
+
+	n = current->length - zfile->offset;
+	if (n > len)
+		n = len;
+	memcpy(buf, current->data + zfile->offset, n);
+	zfile->offset += n;
+
+	/* Once used up, the buffer is handed back to be filled again. */
+	if (zfile->offset == current->length) {
+		if (current->end)
+			zfile->at_end = ISC_TRUE;
+		LOCK(&zfile->lock);
+		current->full = ISC_FALSE;
+		BROADCAST(&zfile->cond);
+		UNLOCK(&zfile->lock);
+		zfile->current ^= 1;
+		zfile->offset = 0;
+	}
+
+	return (n);
+}
+
+void
+perf_zfile_rewind(perf_zfile_t *zfile)
+{
+	ISC_INSIST(zfile->repeat);
+	zfile->at_end = ISC_FALSE;
+}
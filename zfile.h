@@ -0,0 +1,62 @@
+/*
+ * Copyright (C) 2016 Sinodun IT Ltd.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice
+ * appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND NOMINUM DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL NOMINUM BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT
+ * OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef PERF_ZFILE_H
+#define PERF_ZFILE_H 1
+
+#include <sys/types.h>
+
+#include <isc/types.h>
+
+/*
+ * A gzip or zstd compressed file, decompressed ahead of the reader by a
+ * thread of its own into one of two buffers while the other is read.
+ */
+typedef struct perf_zfile perf_zfile_t;
+
+/*
+ * Returns NULL if the file open on 'fd' is not compressed.  The
+ * descriptor stays the caller's to close.
+ */
+perf_zfile_t *
+perf_zfile_open(isc_mem_t *mctx, int fd, const char *filename);
+
+void
+perf_zfile_close(perf_zfile_t **zfilep);
+
+/*
+ * Whether the file is to be read more than once; if so, it is
+ * decompressed again from the start as soon as its end is reached.
+ * Takes effect if set before the first read.
+ */
+void
+perf_zfile_setrepeat(perf_zfile_t *zfile, isc_boolean_t repeat);
+
+/*
+ * Behaves like read() on the decompressed file, returning 0 at its end.
+ */
+ssize_t
+perf_zfile_read(perf_zfile_t *zfile, void *buf, size_t len);
+
+/*
+ * Starts reading the file from the beginning again, once its end has
+ * been reached.
+ */
+void
+perf_zfile_rewind(perf_zfile_t *zfile);
+
+#endif